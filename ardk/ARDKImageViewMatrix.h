@@ -14,6 +14,9 @@
 #import <UIKit/UIKit.h>
 #import "ARDKLib.h"
 
+/// Size of the square tiles into which bitmaps are split for display
+#define TILE_SIZE (512.0)
+
 @interface ARDKImageViewMatrix : NSObject
 @property CGFloat width;
 @property CGFloat scale;
@@ -6,8 +6,6 @@
 //  Copyright © 2017 Artifex Software Inc. All rights reserved.
 //
 
-#define TILE_SIZE (512.0)
-
 #import "ARDKGeometry.h"
 #import "ARDKImageViewMatrix.h"
 
@@ -15,7 +15,9 @@
 #import <openssl/x509v3.h>
 #pragma clang diagnostic pop
 
-@interface ARDKOpenSSLKeychain : NSObject
+#import "ARDKOpenSSLTrustCache.h"
+
+@interface ARDKOpenSSLKeychain : NSObject<ARDKOpenSSLTrustSource>
 
 // Converts the error code "value" returned from SecXXX() API calls
 +(NSString * _Nonnull) SecAPI_errorToString:(OSStatus)value;
@@ -67,8 +69,8 @@
 ///
 -(EVP_PKEY * _Nullable) getPrivateKeyFromIdentity:(NSString * _Nonnull) identityLabel;
 
-/// Returns an X509_STORE containing the currently trusted certificates. The caller is responsible for calling
-/// X509_STORE_free() on the returned collection.
+/// Returns an X509_STORE containing the currently trusted certificates. The store is cached process-wide by
+/// ARDKOpenSSLTrustCache. The caller is responsible for calling X509_STORE_free() on the returned collection.
 ///
 /// @return                A pointer to an X509_STORE containing all currently trusted certificates.
 ///                        The caller is responsible for calling X509_STORE_free() on the returned collection.
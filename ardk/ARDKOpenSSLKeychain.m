@@ -274,9 +274,9 @@
     return ret;
 }
 
--(X509_STORE * _Nullable) getTrustedCertificates
+-(NSArray<NSData *> * _Nonnull) trustedCertificateData
 {
-    X509_STORE *returnValue = X509_STORE_new();
+    NSMutableArray<NSData *> *returnValue = [NSMutableArray array];
     
     // get all the certificates currently in the keychain
     NSDictionary *query = @{
@@ -303,26 +303,18 @@
                     SecCertificateRef certRef = (__bridge SecCertificateRef)[dict valueForKey:(__bridge id)kSecValueRef];
                     if (certRef)
                     {
-                        CFDataRef certDataRef = SecCertificateCopyData(certRef);
-                        if (certDataRef)
+                        // get the DER encoded X509 data
+                        NSData *certData = (__bridge_transfer NSData *) SecCertificateCopyData(certRef);
+                        if (certData)
                         {
-                            const unsigned char *certBytes = (const unsigned char *) CFDataGetBytePtr(certDataRef);
-                            long certBytesLen = (long) CFDataGetLength(certDataRef);
-                            
-                            // decode the DER encoded X509 data
-                            X509 *certX509 = d2i_X509(NULL, &certBytes, certBytesLen);
-                            if (certX509)
-                            {
-                                // add this certificate to the returned X509_STORE
-                                X509_STORE_add_cert(returnValue, certX509);
-                            }
+                            [returnValue addObject:certData];
                         }
                     }
                 }
             }
         }
     }
-    else
+    else if (copyResult != errSecItemNotFound)
     {
         NSLog(@"Error: %s SetItemCopyMatching() returns error '%@'",
               __PRETTY_FUNCTION__,
@@ -337,6 +329,11 @@
     return returnValue;
 }
 
+-(X509_STORE * _Nullable) getTrustedCertificates
+{
+    return [[ARDKOpenSSLTrustCache sharedCache] trustStore];
+}
+
 -(void) deleteItems:(NSString * _Nonnull) ofClass
 {
     NSDictionary *deleteQuery = @{
@@ -344,6 +341,7 @@
     };
     
     OSStatus deleteResult = SecItemDelete((__bridge CFDictionaryRef) deleteQuery);
+    [[ARDKOpenSSLTrustCache sharedCache] invalidate];
     if (deleteResult != errSecSuccess)
     {
         NSLog(@"Error: %s SecItemDelete() returns error (%d) '%@'",
@@ -107,6 +107,9 @@ static const int maxPasswordRetries = 5;
                     }
                 }
             }
+
+            // The set of trusted certificates has changed
+            [[ARDKOpenSSLTrustCache sharedCache] invalidate];
         }
 
         if (secItems)
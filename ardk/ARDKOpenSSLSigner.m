@@ -13,9 +13,17 @@
 #pragma clang diagnostic ignored "-Wdocumentation"
 #import <openssl/x509v3.h>
 #import <openssl/pkcs7.h>
+#import <openssl/evp.h>
 #import <openssl/err.h>
 #pragma clang diagnostic pop
 
+// Margin added by maxSignatureSize to the exact size of a model signature.
+// It covers the parts that can vary between the model and the real thing:
+// the signing time, which is encoded 2 bytes longer from 2050, and the length
+// octets of the enclosing DER structures, which grow by a byte at each of
+// their 128, 256 and 64K length thresholds
+#define PKCS7_SIZE_MARGIN (32)
+
 @implementation ARDKOpenSSLSigner
 {
     ARDKOpenSSLKeychain *_keychain;
@@ -23,7 +31,12 @@
     NSInteger            _selectedIdentityIndex;
     X509                *_certificate;
     EVP_PKEY            *_signingKey;
-    NSMutableData       *_signerSourceData;
+    // Running digest of the data sent since begin. Only the digest is
+    // needed to build a detached signature, so the data itself isn't kept
+    EVP_MD_CTX          *_digestCtx;
+    // Cached result of maxSignatureSize for the selected identity, 0 if
+    // not yet calculated
+    NSUInteger           _maxSignatureSize;
 }
 
 - (instancetype)init
@@ -37,11 +50,25 @@
         _signingKey = NULL;
         
         _selectedIdentityIndex = NSNotFound;
-        _signerSourceData = nil;
+        _digestCtx = NULL;
     }
     return self;
 }
 
+- (void)dealloc
+{
+    [self freeDigest];
+}
+
+- (void)freeDigest
+{
+    if (_digestCtx)
+    {
+        EVP_MD_CTX_destroy(_digestCtx);
+    }
+    _digestCtx = NULL;
+}
+
 // Get the signer's selected certificate's designated name
 - (id<PKCS7DesignatedName>)name
 {
@@ -77,15 +104,23 @@
 // Announce the start of a signing request before sending the data to sign
 - (void)begin
 {
-    _signerSourceData = [[NSMutableData alloc] init];
+    [self freeDigest];
+
+    _digestCtx = EVP_MD_CTX_create();
+    if (_digestCtx &&
+        EVP_DigestInit_ex(_digestCtx, EVP_sha256(), NULL) != 1)
+    {
+        [self freeDigest];
+    }
 }
 
 // Send a chunk of the data to be signed (may be called repeatedly)
 - (void)data:(NSData *)data
 {
-    if (_signerSourceData)
+    if (_digestCtx &&
+        EVP_DigestUpdate(_digestCtx, data.bytes, data.length) != 1)
     {
-        [_signerSourceData appendData:data];
+        [self freeDigest];
     }
 }
 
@@ -139,16 +174,66 @@
     }
 }
 
+// Create the PKCS7 signature object for a digest, with its signer info holding
+// everything but the signature itself. The result must be freed with PKCS7_free
+- (PKCS7 *)newPKCS7ForDigest:(const unsigned char *)digest
+                      length:(unsigned int)digestLen
+                  signerInfo:(PKCS7_SIGNER_INFO **)signerInfo
+{
+    PKCS7             *p7Sign = NULL;
+    PKCS7_SIGNER_INFO *p7SignerInfo = NULL;
+    STACK_OF(X509)    *auxCerts = NULL;
+    // PKCS7_PARTIAL leaves the signer info unsigned, so that the digest
+    // computed in data: can be added before signing, in place of
+    // PKCS7_final digesting the content itself
+    int               pkcs7Flags = PKCS7_PARTIAL | PKCS7_BINARY | PKCS7_DETACHED;
+
+    // TODO: If the signer has intermediate certificates include them in the PKCS7 signature,
+    // so only the root CA need be in the trusted cert store for verification purposes.
+    //auxCerts = ??? TODO ???
+
+    // Create the PKCS7 signature object
+    p7Sign = PKCS7_sign(NULL,
+                        NULL,
+                        auxCerts,
+                        NULL,
+                        pkcs7Flags );
+    if (!p7Sign)
+    {
+        return NULL;
+    }
+
+    // Add the certificate, private key, aux keys and digest to the PKCS7 signature
+    // object. This also adds the content type and SMIMECapabilities attributes
+    p7SignerInfo = PKCS7_sign_add_signer(p7Sign,
+                                         _certificate,
+                                         _signingKey,
+                                         EVP_sha256(),
+                                         pkcs7Flags );
+
+    // Add the signing time and message digest attributes, as PKCS7_final
+    // would have done
+    if (!p7SignerInfo ||
+        PKCS7_add0_attrib_signing_time(p7SignerInfo, NULL) != 1 ||
+        PKCS7_add1_attrib_digest(p7SignerInfo, digest, (int)digestLen) != 1)
+    {
+        PKCS7_free(p7Sign);
+        return NULL;
+    }
+
+    *signerInfo = p7SignerInfo;
+    return p7Sign;
+}
+
 // Announce the end of the data and request the signature
 - (NSData *)sign
 {
     NSMutableData     *returnValue = NULL;
     PKCS7             *p7Sign = NULL;
     PKCS7_SIGNER_INFO *p7SignerInfo = NULL;
-    BIO               *inBio = NULL;
     BIO               *outBio = NULL;
-    STACK_OF(X509)    *auxCerts = NULL;
-    int               pkcs7Flags = PKCS7_STREAM | PKCS7_BINARY | PKCS7_DETACHED;
+    unsigned char     digest[EVP_MAX_MD_SIZE];
+    unsigned int      digestLen = 0;
 
     if (!_keychain)
     {
@@ -168,40 +253,21 @@
         goto CLEANUP;
     }
 
-    inBio = BIO_new(BIO_s_mem());
-    if (!inBio)
+    // Complete the digest of the data we're signing
+    if (!_digestCtx ||
+        EVP_DigestFinal_ex(_digestCtx, digest, &digestLen) != 1)
     {
         goto CLEANUP;
     }
     
-    // write the data we're signing into inBio
-    BIO_write(inBio,
-              [_signerSourceData bytes],
-              (int)[_signerSourceData length]);
-    
-    // TODO: If the signer has intermediate certificates include them in the PKCS7 signature,
-    // so only the root CA need be in the trusted cert store for verification purposes.
-    //auxCerts = ??? TODO ???
-
-    // Create the PKCS7 signature object
-    p7Sign = PKCS7_sign(NULL,
-                        NULL,
-                        auxCerts,
-                        inBio,
-                        pkcs7Flags );
+    p7Sign = [self newPKCS7ForDigest:digest length:digestLen signerInfo:&p7SignerInfo];
     if (!p7Sign)
     {
         goto CLEANUP;
     }
-    
-    // Add the certificate, private key, aux keys and digest to the PKCS7 signature object
-    p7SignerInfo = PKCS7_sign_add_signer(p7Sign,
-                                         _certificate,
-                                         _signingKey,
-                                         EVP_get_digestbyname("sha256"),
-                                         pkcs7Flags );
-   
-    if (!p7SignerInfo)
+
+    // Sign the attributes, as PKCS7_final would have done
+    if (PKCS7_SIGNER_INFO_sign(p7SignerInfo) != 1)
     {
         goto CLEANUP;
     }
@@ -211,14 +277,6 @@
     {
         goto CLEANUP;
     }
-    
-    // Finalize the PKCS7 signature object
-    if (PKCS7_final(p7Sign,
-                    inBio,
-                    pkcs7Flags) != 1)
-    {
-        goto CLEANUP;
-    }
 
     // Convert the PKCS7 signature object to DER encoding
     if (i2d_PKCS7_bio(outBio,
@@ -243,15 +301,48 @@
 CLEANUP:
     BIO_free(outBio);
     PKCS7_free(p7Sign);
-    BIO_free(inBio);
+    [self freeDigest];
+
+    return returnValue;
+}
 
-    if (auxCerts)
+// Get an upper bound on the length of the signatures that sign will return.
+// A model of the signature is built just as sign would, but with a placeholder
+// of the largest size the key can produce in place of the signature, so that
+// no private key operation is needed, and its DER encoding measured
+- (NSUInteger)maxSignatureSize
+{
+    if (_maxSignatureSize == 0)
     {
-        sk_X509_free(auxCerts);
-        auxCerts = NULL;
+        [self ensureCertificate];
+
+        if (_certificate == NULL || _signingKey == NULL)
+        {
+            return 0;
+        }
+
+        unsigned char      digest[EVP_MAX_MD_SIZE] = {0};
+        PKCS7_SIGNER_INFO *p7SignerInfo = NULL;
+        PKCS7             *p7Sign = [self newPKCS7ForDigest:digest
+                                                     length:(unsigned int)EVP_MD_size(EVP_sha256())
+                                                 signerInfo:&p7SignerInfo];
+        int                size = 0;
+        if (p7Sign &&
+            ASN1_STRING_set(p7SignerInfo->enc_digest, NULL, EVP_PKEY_size(_signingKey)) == 1)
+        {
+            size = i2d_PKCS7(p7Sign, NULL);
+        }
+        PKCS7_free(p7Sign);
+
+        if (size <= 0)
+        {
+            return 0;
+        }
+
+        _maxSignatureSize = size + PKCS7_SIZE_MARGIN;
     }
-    
-    return returnValue;
+
+    return _maxSignatureSize;
 }
 
 -(NSInteger) numCertificates
@@ -273,6 +364,7 @@ CLEANUP:
 -(void) setSelectedCertificateIndex:(NSInteger) index
 {
     _selectedIdentityIndex = index;
+    _maxSignatureSize = 0;
     [self ensureCertificate];
 }
 
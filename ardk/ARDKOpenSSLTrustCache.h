@@ -0,0 +1,83 @@
+//
+//  ARDKOpenSSLTrustCache.h
+//  smart-office-nui
+//
+//  Process-wide cache of the trusted certificate store used in signature
+//  verification, and of the results of checking signers' certificates
+//  against it, so that repeated verification of signatures from the same
+//  signer skips the trust setup.
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#ifndef ARDK_OPENSSL_TRUST_CACHE_H
+#define ARDK_OPENSSL_TRUST_CACHE_H
+
+#import <Foundation/Foundation.h>
+#import "ARDKPKCS7.h"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdocumentation"
+#import <openssl/x509v3.h>
+#pragma clang diagnostic pop
+
+/// Protocol for the providers of the certificates that verification trusts
+@protocol ARDKOpenSSLTrustSource <NSObject>
+
+/// Returns the DER encodings of the trusted certificates
+-(NSArray<NSData *> * _Nonnull) trustedCertificateData;
+
+@end
+
+/// A trust source that reads certificates from the files of a directory, DER or
+/// PEM encoded, for use in place of the keychain when testing
+@interface ARDKOpenSSLCertificateDirectory : NSObject<ARDKOpenSSLTrustSource>
+
+-(instancetype _Nonnull) initWithPath:(NSString * _Nonnull) path;
+
+@end
+
+/// The outcome of checking the trust of a signer's certificate
+@interface ARDKOpenSSLTrustResult : NSObject
+
+/// YES if the certificate is trusted by the iOS profiles installed on the device
+@property(readonly) BOOL trustedByProfiles;
+
+/// YES if a chain can be built from the certificate to one trusted by the trust source
+@property(readonly) BOOL trustedByKeychain;
+
+/// The reason for trustedByKeychain being NO
+@property(readonly, nullable) NSString *error;
+
+@property(readonly, nonnull) id<PKCS7DesignatedName> designatedName;
+@property(readonly, nonnull) id<PKCS7Description> certDescription;
+
+@end
+
+@interface ARDKOpenSSLTrustCache : NSObject
+
+/// The source of trusted certificates. Defaults to the app's keychain. Setting
+/// it invalidates the cache
+@property(nonnull) id<ARDKOpenSSLTrustSource> source;
+
+/// Returns the process-wide cache
++(ARDKOpenSSLTrustCache * _Nonnull) sharedCache;
+
+/// Returns an X509_STORE of the trusted certificates, creating it from the
+/// source if there isn't one cached. The caller is responsible for calling
+/// X509_STORE_free() on the returned store.
+-(X509_STORE * _Nullable) trustStore;
+
+/// Returns the result of checking the trust of "cert", using "chain" as the
+/// untrusted certificates from which to build a chain. Results are remembered
+/// for an hour, per combination of certificate and chain.
+-(ARDKOpenSSLTrustResult * _Nonnull) trustOfCertificate:(X509 * _Nonnull) cert
+                                              withChain:(STACK_OF(X509) * _Nullable) chain;
+
+/// Discards the cached store and results. Must be called when the set of
+/// trusted certificates changes.
+-(void) invalidate;
+
+@end
+
+#endif /* ARDK_OPENSSL_TRUST_CACHE_H */
@@ -0,0 +1,311 @@
+//
+//  ARDKOpenSSLTrustCache.m
+//  smart-office-nui
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <Security/Security.h>
+#import "ARDKOpenSSLTrustCache.h"
+#import "ARDKOpenSSLKeychain.h"
+#import "ARDKOpenSSLCert.h"
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdocumentation"
+#import <openssl/pem.h>
+#pragma clang diagnostic pop
+
+// How long a trust result is reused. Limited, so that the expiry of certificates
+// and changes to the installed profiles are noticed
+#define TRUST_RESULT_LIFETIME (60 * 60)
+
+// Decode a certificate from DER or PEM. The caller is responsible for calling
+// X509_free() on the returned certificate
+static X509 *decodeCertificate(NSData *data)
+{
+    const unsigned char *bytes = data.bytes;
+    X509 *cert = d2i_X509(NULL, &bytes, (long)data.length);
+    if (cert == NULL)
+    {
+        BIO *bio = BIO_new_mem_buf((void *)data.bytes, (int)data.length);
+        if (bio)
+        {
+            cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+            BIO_free(bio);
+        }
+        ERR_clear_error();
+    }
+
+    return cert;
+}
+
+@implementation ARDKOpenSSLCertificateDirectory
+{
+    NSString *_path;
+}
+
+-(instancetype) initWithPath:(NSString *) path
+{
+    if (self = [super init])
+    {
+        _path = path;
+    }
+    return self;
+}
+
+-(NSArray<NSData *> *) trustedCertificateData
+{
+    NSMutableArray<NSData *> *certs = [NSMutableArray array];
+    NSArray<NSString *> *files = [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_path error:nil];
+    for (NSString *file in files)
+    {
+        NSData *data = [NSData dataWithContentsOfFile:[_path stringByAppendingPathComponent:file]];
+        X509 *cert = data ? decodeCertificate(data) : NULL;
+        if (cert)
+        {
+            NSData *der = [ARDKOpenSSLCert convertX509ToDER:cert];
+            if (der)
+            {
+                [certs addObject:der];
+            }
+            X509_free(cert);
+        }
+    }
+
+    return certs;
+}
+
+@end
+
+@interface ARDKOpenSSLTrustResult ()
+@property(readwrite) BOOL trustedByProfiles;
+@property(readwrite) BOOL trustedByKeychain;
+@property(readwrite) NSString *error;
+@property(readwrite) id<PKCS7DesignatedName> designatedName;
+@property(readwrite) id<PKCS7Description> certDescription;
+@property NSDate *date;
+@end
+
+@implementation ARDKOpenSSLTrustResult
+@end
+
+@implementation ARDKOpenSSLTrustCache
+{
+    id<ARDKOpenSSLTrustSource> _source;
+    X509_STORE *_store;
+    // Results keyed by the fingerprints of the certificate and its chain
+    NSMutableDictionary<NSData *, ARDKOpenSSLTrustResult *> *_results;
+    // Incremented on each invalidation, so that checks in progress at the
+    // time don't store stale results
+    NSUInteger _generation;
+}
+
++(ARDKOpenSSLTrustCache *) sharedCache
+{
+    static ARDKOpenSSLTrustCache *cache;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[ARDKOpenSSLTrustCache alloc] init];
+    });
+
+    return cache;
+}
+
+-(instancetype) init
+{
+    if (self = [super init])
+    {
+        _source = [[ARDKOpenSSLKeychain alloc] init];
+        _store = NULL;
+        _results = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+-(void) dealloc
+{
+    X509_STORE_free(_store);
+}
+
+-(id<ARDKOpenSSLTrustSource>) source
+{
+    @synchronized (self)
+    {
+        return _source;
+    }
+}
+
+-(void) setSource:(id<ARDKOpenSSLTrustSource>) source
+{
+    @synchronized (self)
+    {
+        _source = source;
+        [self invalidate];
+    }
+}
+
+-(void) invalidate
+{
+    @synchronized (self)
+    {
+        X509_STORE_free(_store);
+        _store = NULL;
+        [_results removeAllObjects];
+        _generation++;
+    }
+}
+
+-(X509_STORE *) trustStore
+{
+    @synchronized (self)
+    {
+        if (_store == NULL)
+        {
+            _store = X509_STORE_new();
+            if (_store)
+            {
+                for (NSData *data in [_source trustedCertificateData])
+                {
+                    X509 *cert = decodeCertificate(data);
+                    if (cert)
+                    {
+                        // The store takes its own reference
+                        X509_STORE_add_cert(_store, cert);
+                        X509_free(cert);
+                    }
+                }
+            }
+        }
+
+        if (_store)
+        {
+            // OpenSSL 1.0.2 lacks X509_STORE_up_ref
+            CRYPTO_add(&_store->references, 1, CRYPTO_LOCK_X509_STORE);
+        }
+
+        return _store;
+    }
+}
+
+// The key under which to remember the trust of "cert" when using "chain"
+-(NSData *) keyForCertificate:(X509 *) cert withChain:(STACK_OF(X509) *) chain
+{
+    NSMutableData *key = [NSMutableData data];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+
+    if (X509_digest(cert, EVP_sha256(), md, &mdLen) != 1)
+    {
+        return nil;
+    }
+    [key appendBytes:md length:mdLen];
+
+    for (int i = 0; i < sk_X509_num(chain); i++)
+    {
+        if (X509_digest(sk_X509_value(chain, i), EVP_sha256(), md, &mdLen) != 1)
+        {
+            return nil;
+        }
+        [key appendBytes:md length:mdLen];
+    }
+
+    return key;
+}
+
+// Returns YES if "certToCheck" is trusted by the certificates currently installed
+// in the iOS system profiles for this device, returns NO if not trusted
+-(BOOL) isTrustedBySystemProfiles:(X509 *)certToCheck
+{
+    BOOL certIsTrusted = NO;
+
+    NSData *certDER = [ARDKOpenSSLCert convertX509ToDER:certToCheck];
+    if (certDER &&
+        ([certDER length] > 0))
+    {
+        SecCertificateRef certRef = SecCertificateCreateWithData(NULL,
+                                                                 (__bridge CFDataRef) certDER);
+        if (certRef)
+        {
+            SecPolicyRef policyRef = SecPolicyCreateBasicX509();
+            if (policyRef)
+            {
+                SecTrustRef trustRef = NULL;
+                OSStatus err = SecTrustCreateWithCertificates((__bridge CFArrayRef) @[(__bridge id)certRef],
+                                                              policyRef,
+                                                              &trustRef);
+                if (err == errSecSuccess)
+                {
+                    SecTrustResultType trustResult = (SecTrustResultType) -1;
+                    err = SecTrustEvaluate(trustRef, &trustResult);
+                    certIsTrusted = (trustResult == kSecTrustResultProceed);
+                }
+                if (trustRef)
+                {
+                    CFRelease(trustRef);
+                }
+                CFRelease(policyRef);
+            }
+            CFRelease(certRef);
+        }
+    }
+
+    return certIsTrusted;
+}
+
+-(ARDKOpenSSLTrustResult *) trustOfCertificate:(X509 *) cert withChain:(STACK_OF(X509) *) chain
+{
+    NSData *key = [self keyForCertificate:cert withChain:chain];
+    ARDKOpenSSLTrustResult *result = nil;
+    NSUInteger generation;
+
+    @synchronized (self)
+    {
+        result = key ? _results[key] : nil;
+        generation = _generation;
+    }
+
+    if (result &&
+        -result.date.timeIntervalSinceNow < TRUST_RESULT_LIFETIME)
+    {
+        return result;
+    }
+
+    // Build the result outside the lock, so that checks of different
+    // certificates can proceed concurrently
+    result = [[ARDKOpenSSLTrustResult alloc] init];
+    result.date = [NSDate date];
+    result.designatedName = [ARDKOpenSSLCertDesignatedName designatedNameFromX509:cert];
+    result.certDescription = [ARDKOpenSSLCertDescription descriptionFromX509:cert];
+    result.trustedByProfiles = [self isTrustedBySystemProfiles:cert];
+
+    X509_STORE *store = [self trustStore];
+    X509_STORE_CTX *storeCtx = X509_STORE_CTX_new();
+    if (store &&
+        storeCtx &&
+        X509_STORE_CTX_init(storeCtx, store, cert, chain) == 1)
+    {
+        X509_STORE_CTX_set_default(storeCtx, "smime_sign");
+        result.trustedByKeychain = (X509_verify_cert(storeCtx) == 1);
+        if (!result.trustedByKeychain)
+        {
+            result.error = @(X509_verify_cert_error_string(X509_STORE_CTX_get_error(storeCtx)));
+        }
+    }
+    X509_STORE_CTX_free(storeCtx);
+    X509_STORE_free(store);
+
+    if (key)
+    {
+        @synchronized (self)
+        {
+            if (_generation == generation)
+            {
+                _results[key] = result;
+            }
+        }
+    }
+
+    return result;
+}
+
+@end
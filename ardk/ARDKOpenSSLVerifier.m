@@ -7,19 +7,26 @@
 
 #import "ARDKOpenSSLVerifier.h"
 #import "ARDKOpenSSLCert.h"
-#import "ARDKOpenSSLKeychain.h"
+#import "ARDKOpenSSLTrustCache.h"
 
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wdocumentation"
 #import <openssl/x509v3.h>
 #import <openssl/pkcs7.h>
+#import <openssl/evp.h>
 #import <openssl/err.h>
 #pragma clang diagnostic pop
 
+// The digest algorithms a signature may use, that begin prepares for
+static const int supportedDigests[] = { NID_sha1, NID_sha256, NID_sha384, NID_sha512 };
+#define NUM_DIGESTS (sizeof(supportedDigests) / sizeof(supportedDigests[0]))
+
 @implementation ARDKOpenSSLVerifier
 {
-    ARDKOpenSSLKeychain           *_keychain;
-    NSMutableData                 *_verifyData;
+    // Running digests of the data sent since begin, one per entry of
+    // supportedDigests, NULL for those not in use. Only the digest is
+    // needed to check a detached signature, so the data itself isn't kept
+    EVP_MD_CTX                    *_digestCtx[NUM_DIGESTS];
     ARDKOpenSSLCertDesignatedName *_designatedName;
     ARDKOpenSSLCertDescription    *_description;
 }
@@ -28,31 +35,241 @@
 {
     if (self = [super init])
     {
-        _keychain = [[ARDKOpenSSLKeychain alloc] init];
-
-        _verifyData = nil;
         _designatedName = nil;
         _description = nil;
     }
     return self;
 }
 
+- (void)dealloc
+{
+    [self freeDigests];
+}
+
+- (void)freeDigests
+{
+    for (int i = 0; i < NUM_DIGESTS; i++)
+    {
+        if (_digestCtx[i])
+        {
+            EVP_MD_CTX_destroy(_digestCtx[i]);
+        }
+        _digestCtx[i] = NULL;
+    }
+}
+
+- (void)startDigest:(int)nid
+{
+    for (int i = 0; i < NUM_DIGESTS; i++)
+    {
+        if (supportedDigests[i] == nid && _digestCtx[i] == NULL)
+        {
+            _digestCtx[i] = EVP_MD_CTX_create();
+            if (_digestCtx[i] &&
+                EVP_DigestInit_ex(_digestCtx[i], EVP_get_digestbynid(nid), NULL) != 1)
+            {
+                EVP_MD_CTX_destroy(_digestCtx[i]);
+                _digestCtx[i] = NULL;
+            }
+        }
+    }
+}
+
+// Complete the digest of the data with the algorithm used by "signerInfo". The
+// running digest is left as it was, for any other signer using the same algorithm
+- (BOOL)finishDigestFor:(PKCS7_SIGNER_INFO *)signerInfo
+                   into:(unsigned char *)digest
+                 length:(unsigned int *)digestLen
+{
+    int nid = OBJ_obj2nid(signerInfo->digest_alg->algorithm);
+    for (int i = 0; i < NUM_DIGESTS; i++)
+    {
+        if (supportedDigests[i] == nid && _digestCtx[i])
+        {
+            EVP_MD_CTX *mdCtx = EVP_MD_CTX_create();
+            BOOL finished = (mdCtx &&
+                             EVP_MD_CTX_copy_ex(mdCtx, _digestCtx[i]) == 1 &&
+                             EVP_DigestFinal_ex(mdCtx, digest, digestLen) == 1);
+            EVP_MD_CTX_destroy(mdCtx);
+            return finished;
+        }
+    }
+
+    NSLog(@"Error: %s - Unsupported digest algorithm %s.",
+          __PRETTY_FUNCTION__, OBJ_nid2sn(nid));
+    return NO;
+}
+
+- (PKCS7 *)parseSignature:(NSData *)signature
+{
+    BIO *sigStream = BIO_new_mem_buf((void *)[signature bytes], (int)[signature length]);
+    PKCS7 *sigP7 = d2i_PKCS7_bio(sigStream, NULL);
+    BIO_free(sigStream);
+
+    return sigP7;
+}
+
 // Announce the start of a verification request before sending the data
 - (void)begin
 {
-    _verifyData = [[NSMutableData alloc] init];
+    [self freeDigests];
     
+    // The signature isn't yet known, so digest with every algorithm it might use
+    for (int i = 0; i < NUM_DIGESTS; i++)
+    {
+        [self startDigest:supportedDigests[i]];
+    }
+
+    _designatedName = [[ARDKOpenSSLCertDesignatedName alloc] initWithDefaults];
+    _description = [[ARDKOpenSSLCertDescription alloc] initWithDefaults];
+}
+
+// Announce the start of a verification request, digesting only with the
+// algorithms used by the signature
+- (void)begin:(NSData *)signature
+{
+    [self freeDigests];
+
+    PKCS7 *sigP7 = [self parseSignature:signature];
+    if (sigP7 &&
+        PKCS7_type_is_signed(sigP7))
+    {
+        STACK_OF(PKCS7_SIGNER_INFO) *signerInfos = PKCS7_get_signer_info(sigP7);
+        for (int i = 0; i < sk_PKCS7_SIGNER_INFO_num(signerInfos); i++)
+        {
+            PKCS7_SIGNER_INFO *signerInfo = sk_PKCS7_SIGNER_INFO_value(signerInfos, i);
+            [self startDigest:OBJ_obj2nid(signerInfo->digest_alg->algorithm)];
+        }
+    }
+    PKCS7_free(sigP7);
+
     _designatedName = [[ARDKOpenSSLCertDesignatedName alloc] initWithDefaults];
     _description = [[ARDKOpenSSLCertDescription alloc] initWithDefaults];
 }
 
+// Create a verifier for "signature" that continues from the data sent to this
+// one so far, by copying the running digests the signature needs
+- (id<PKCS7Verifier>)forkFor:(NSData *)signature
+{
+    ARDKOpenSSLVerifier *fork = [[ARDKOpenSSLVerifier alloc] init];
+    BOOL covered = NO;
+
+    PKCS7 *sigP7 = [self parseSignature:signature];
+    if (sigP7 &&
+        PKCS7_type_is_signed(sigP7))
+    {
+        covered = YES;
+        STACK_OF(PKCS7_SIGNER_INFO) *signerInfos = PKCS7_get_signer_info(sigP7);
+        for (int i = 0; i < sk_PKCS7_SIGNER_INFO_num(signerInfos); i++)
+        {
+            PKCS7_SIGNER_INFO *signerInfo = sk_PKCS7_SIGNER_INFO_value(signerInfos, i);
+            int nid = OBJ_obj2nid(signerInfo->digest_alg->algorithm);
+            BOOL copied = NO;
+            for (int j = 0; j < NUM_DIGESTS; j++)
+            {
+                if (supportedDigests[j] == nid && _digestCtx[j])
+                {
+                    if (fork->_digestCtx[j] == NULL)
+                    {
+                        fork->_digestCtx[j] = EVP_MD_CTX_create();
+                        if (fork->_digestCtx[j] &&
+                            EVP_MD_CTX_copy_ex(fork->_digestCtx[j], _digestCtx[j]) != 1)
+                        {
+                            EVP_MD_CTX_destroy(fork->_digestCtx[j]);
+                            fork->_digestCtx[j] = NULL;
+                        }
+                    }
+                    copied = fork->_digestCtx[j] != NULL;
+                }
+            }
+            covered = covered && copied;
+        }
+    }
+    PKCS7_free(sigP7);
+
+    if (!covered)
+    {
+        return nil;
+    }
+
+    fork->_designatedName = [[ARDKOpenSSLCertDesignatedName alloc] initWithDefaults];
+    fork->_description = [[ARDKOpenSSLCertDescription alloc] initWithDefaults];
+    return fork;
+}
+
 // Send a chunk of the data on which a signature is to be verified
 - (void)data:(NSData *)data
 {
-    if (_verifyData)
+    for (int i = 0; i < NUM_DIGESTS; i++)
+    {
+        if (_digestCtx[i] &&
+            EVP_DigestUpdate(_digestCtx[i], data.bytes, data.length) != 1)
+        {
+            EVP_MD_CTX_destroy(_digestCtx[i]);
+            _digestCtx[i] = NULL;
+        }
+    }
+}
+
+// Check that "signerInfo" holds a valid signature by "signerCert" of "digest". This
+// is the check that PKCS7_verify makes, but working from the digest rather than
+// the data
+- (BOOL)verifySignerInfo:(PKCS7_SIGNER_INFO *)signerInfo
+                    cert:(X509 *)signerCert
+                  digest:(unsigned char *)digest
+                  length:(unsigned int)digestLen
+{
+    BOOL verified = NO;
+    EVP_PKEY *publicKey = X509_get_pubkey(signerCert);
+    const EVP_MD *md = EVP_get_digestbyobj(signerInfo->digest_alg->algorithm);
+    STACK_OF(X509_ATTRIBUTE) *signedAttrs = PKCS7_get_signed_attributes(signerInfo);
+    ASN1_OCTET_STRING *encDigest = signerInfo->enc_digest;
+
+    if (!publicKey || !md)
+    {
+        goto CLEANUP;
+    }
+
+    if (sk_X509_ATTRIBUTE_num(signedAttrs) > 0)
     {
-        [_verifyData appendData:data];
+        // The signature is of the signed attributes, one of which is the digest of the data
+        ASN1_OCTET_STRING *attrDigest = PKCS7_digest_from_attributes(signedAttrs);
+        if (!attrDigest ||
+            attrDigest->length != digestLen ||
+            memcmp(attrDigest->data, digest, digestLen) != 0)
+        {
+            goto CLEANUP;
+        }
+
+        unsigned char *attrBuf = NULL;
+        int attrLen = ASN1_item_i2d((ASN1_VALUE *)signedAttrs, &attrBuf, ASN1_ITEM_rptr(PKCS7_ATTR_VERIFY));
+        EVP_MD_CTX *mdCtx = EVP_MD_CTX_create();
+        if (attrBuf && mdCtx)
+        {
+            verified = (EVP_VerifyInit_ex(mdCtx, md, NULL) == 1 &&
+                        EVP_VerifyUpdate(mdCtx, attrBuf, attrLen) == 1 &&
+                        EVP_VerifyFinal(mdCtx, encDigest->data, encDigest->length, publicKey) == 1);
+        }
+        EVP_MD_CTX_destroy(mdCtx);
+        OPENSSL_free(attrBuf);
     }
+    else
+    {
+        // The signature is of the digest of the data
+        EVP_PKEY_CTX *pkeyCtx = EVP_PKEY_CTX_new(publicKey, NULL);
+        if (pkeyCtx)
+        {
+            verified = (EVP_PKEY_verify_init(pkeyCtx) == 1 &&
+                        EVP_PKEY_CTX_set_signature_md(pkeyCtx, md) == 1 &&
+                        EVP_PKEY_verify(pkeyCtx, encDigest->data, encDigest->length, digest, digestLen) == 1);
+        }
+        EVP_PKEY_CTX_free(pkeyCtx);
+    }
+
+CLEANUP:
+    EVP_PKEY_free(publicKey);
+
+    return verified;
 }
 
 // Announce the end of the data and request verification of the signature
@@ -60,76 +277,86 @@
 {
     PKCS7VerifyResult res = PKCS7VerifyResult_Unknown;
 
-    BIO *dataToVerify = NULL;
-    BIO *sigStream = NULL;
     PKCS7 *sigP7 = NULL;
-    X509_STORE *trustedCertsFromAppKeychain = NULL;
+    STACK_OF(X509) *signers = NULL;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
 
-    dataToVerify = BIO_new_mem_buf((void *)[_verifyData bytes], (int)[_verifyData length]);
-    sigStream = BIO_new_mem_buf((void *)[signature bytes], (int)[signature length]);
-    sigP7 = d2i_PKCS7_bio(sigStream, NULL);
+    sigP7 = [self parseSignature:signature];
     
     if (sigP7 &&
         PKCS7_type_is_signed(sigP7))
     {
-        // Verify document has not been edited since signing.
-        int verifyResult = PKCS7_verify(sigP7, NULL, NULL, dataToVerify, NULL, PKCS7_NOVERIFY);
-        if (verifyResult != 1)
+        // get the certs who signed this signature, one per signer info
+        signers = PKCS7_get0_signers(sigP7, NULL, 0);
+        STACK_OF(PKCS7_SIGNER_INFO) *signerInfos = PKCS7_get_signer_info(sigP7);
+        int numSigners = sk_PKCS7_SIGNER_INFO_num(signerInfos);
+
+        // Verify document has not been edited since signing, by every signer
+        X509 *signerCert = NULL;
+        BOOL digestsVerified = (signers &&
+                                numSigners > 0 &&
+                                sk_X509_num(signers) == numSigners);
+        for (int i = 0; digestsVerified && i < numSigners; i++)
         {
-            NSLog(@"Document digest verification failure. This document has been changed after it was signed. Error:%s",
-                  ERR_error_string(ERR_get_error(), NULL));
-            res = PKCS7VerifyResult_DigestFailure;
-            goto CLEANUP;
+            PKCS7_SIGNER_INFO *signerInfo = sk_PKCS7_SIGNER_INFO_value(signerInfos, i);
+            signerCert = sk_X509_value(signers, i);
+            digestsVerified = ([self finishDigestFor:signerInfo into:digest length:&digestLen] &&
+                               [self verifySignerInfo:signerInfo cert:signerCert digest:digest length:digestLen]);
         }
 
-        // get the current set of trusted certificates
-        trustedCertsFromAppKeychain = [_keychain getTrustedCertificates];
-        
-        // get the certs who signed this signature
-        STACK_OF(X509) *signers = PKCS7_get0_signers(sigP7, NULL, 0);
-        
-        // get the cert used to sign this object
-        X509 *signerCert = NULL;
-        if (signers &&
-            (sk_X509_num(signers) > 0))
+        if (!digestsVerified)
         {
-            signerCert = sk_X509_value(signers, 0);
-            [self updateName:signerCert];
-            [self updateDescription:signerCert];
+            char errorString[256];
+            ERR_error_string_n(ERR_get_error(), errorString, sizeof(errorString));
+            NSLog(@"Document digest verification failure. This document has been changed after it was signed. Error:%s",
+                  errorString);
+            if (signerCert)
+            {
+                [self updateName:signerCert];
+                [self updateDescription:signerCert];
+            }
+            res = PKCS7VerifyResult_DigestFailure;
+            goto CLEANUP;
         }
 
-        NSString *subjectNameOneLine = NULL;
-        if (signerCert)
+        // Check that every signer's cert is trusted by the certificates currently
+        // installed in the iOS profiles on this device, or by those currently installed
+        // in the iOS app keychain for this app, using the certificates in the signature
+        // to complete the chain. The results are cached for repeated verifications.
+        // The signature is described by its first signer
+        BOOL trustedByProfiles = YES;
+        BOOL trustedByKeychain = YES;
+        BOOL everySignerTrusted = YES;
+        ARDKOpenSSLTrustResult *trust = nil;
+        NSString *trustError = nil;
+        for (int i = 0; i < numSigners; i++)
         {
-            X509_NAME *x509Name = X509_get_subject_name(signerCert);
-            if (x509Name)
+            ARDKOpenSSLTrustResult *signerTrust = [[ARDKOpenSSLTrustCache sharedCache] trustOfCertificate:sk_X509_value(signers, i)
+                                                                                                withChain:sigP7->d.sign->cert];
+            if (trust == nil)
+                trust = signerTrust;
+            trustedByProfiles = trustedByProfiles && signerTrust.trustedByProfiles;
+            trustedByKeychain = trustedByKeychain && signerTrust.trustedByKeychain;
+            if (!signerTrust.trustedByProfiles && !signerTrust.trustedByKeychain)
             {
-                char *tempName = X509_NAME_oneline(x509Name, NULL, 0);
-                if (tempName)
-                {
-                    subjectNameOneLine = [NSString stringWithUTF8String:tempName];
-                    OPENSSL_free(tempName);
-                    tempName = NULL;
-                }
+                everySignerTrusted = NO;
+                if (trustError == nil)
+                    trustError = signerTrust.error;
             }
         }
-        
-        // Try to verify that "signerCert" is trusted by the certificates currently
-        // installed in the iOS profiles on this device
-        BOOL trustedByProfiles = [self isTrustedBySystemProfiles:signerCert];
+        _designatedName = (ARDKOpenSSLCertDesignatedName *)trust.designatedName;
+        _description = (ARDKOpenSSLCertDescription *)trust.certDescription;
+
+        NSString *subjectNameOneLine = _description.subject;
         NSLog(@"This document was signed by '%@', the signature is %@ by the currently installed iOS profiles",
               subjectNameOneLine ? subjectNameOneLine : @"<unknown>",
               trustedByProfiles ? @"TRUSTED" : @"NOT TRUSTED");
-        
-        // Try to verify that "signerCert" is trusted by the certificates currently
-        // installed in the iOS app keychain for this app
-        verifyResult = PKCS7_verify(sigP7, signers, trustedCertsFromAppKeychain, dataToVerify, NULL, 0);
-        BOOL trustedByKeychain = (verifyResult == 1);
         NSLog(@"This document was signed by '%@', the signature is %@ by the current keychain for this app",
               subjectNameOneLine ? subjectNameOneLine : @"<unknown>",
               trustedByKeychain ? @"TRUSTED" : @"NOT TRUSTED");
         
-        BOOL signerCertIsTrusted = (trustedByProfiles || trustedByKeychain);
+        BOOL signerCertIsTrusted = everySignerTrusted;
         if (signerCertIsTrusted)
         {
             NSLog(@"Document signature verified. The document was signed by the trusted certificate '%@'", 
@@ -141,7 +368,7 @@
         {
             NSLog(@"Document signature verify failed. The document was signed by the untrusted certificate '%@'. (Error: %s)", 
                   subjectNameOneLine ? subjectNameOneLine : @"<unknown>",
-                  ERR_error_string(ERR_get_error(), NULL));
+                  trustError ? trustError.UTF8String : "none");
             
             res = PKCS7VerifyResult_NotTrusted;
         }
@@ -155,17 +382,11 @@
     }
 
 CLEANUP:
+    sk_X509_free(signers);
     PKCS7_free(sigP7);
-    BIO_free(sigStream);
-    BIO_free(dataToVerify);
-
-    if (trustedCertsFromAppKeychain)
-    {
-        X509_STORE_free(trustedCertsFromAppKeychain);
-        trustedCertsFromAppKeychain = NULL;
-    }
+    [self freeDigests];
     
-    return res;;
+    return res;
 }
 
 // Update the signer's designated name from the signing certificate in the signature
@@ -192,43 +413,4 @@ CLEANUP:
    return _description;
 }
 
-// Returns YES if "certToCheck" is trusted by the certificates currently installed
-// in the iOS system profiles for this device, returns NO if not trusted
-- (BOOL) isTrustedBySystemProfiles:(X509 *)certToCheck
-{
-    BOOL certIsTrusted = NO;
-    
-    if (certToCheck)
-    {
-        NSData *certDER = [ARDKOpenSSLCert convertX509ToDER:certToCheck];
-        if (certDER &&
-            ([certDER length] > 0))
-        {
-            SecCertificateRef certRef = SecCertificateCreateWithData(NULL,
-                                                                     (__bridge CFDataRef) certDER);
-            if (certRef)
-            {
-                SecPolicyRef policyRef = SecPolicyCreateBasicX509();
-                if (policyRef)
-                {
-                    SecTrustRef trustRef;
-                    OSStatus err = SecTrustCreateWithCertificates((__bridge CFArrayRef) @[(__bridge id)certRef],
-                                                                  policyRef,
-                                                                  &trustRef);
-                    if (err == errSecSuccess)
-                    {
-                        SecTrustResultType trustResult = (SecTrustResultType) -1;
-                        err = SecTrustEvaluate(trustRef, &trustResult);
-                        certIsTrusted = (trustResult == kSecTrustResultProceed);
-                    }
-                    CFRelease(trustRef);
-                }
-                CFRelease(policyRef);
-            }
-            CFRelease(certRef);
-        }
-    }
-    return certIsTrusted;
-}
-
 @end
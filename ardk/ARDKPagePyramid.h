@@ -0,0 +1,72 @@
+//
+//  ARDKPagePyramid.h
+//  smart-office-nui
+//
+//  Low resolution renders of every page of a document, at a few fixed
+//  widths, built in the background. Used to display pages at small
+//  scales without rendering, and as placeholders while a full render
+//  is in progress.
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <UIKit/UIKit.h>
+#import "ARDKLib.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface ARDKPagePyramid : NSObject<ARDKDocumentEventTarget>
+
+/// The widths, in pixels, of the renders held for each page, in ascending
+/// order. Defaults to 64, 128 and 256.
+@property(copy) NSArray<NSNumber *> *levelWidths;
+
+/// Directory in which to keep the renders between sessions. Defaults to nil,
+/// in which case they are held only in memory. Files in this directory are
+/// written directly, bypassing any ARDKSecureFS in use, so this should not
+/// be set for documents requiring secure storage. Renders are stored in a
+/// subdirectory specific to documentIdentity, and only if that is set.
+@property(nullable, copy, nonatomic) NSString *diskCacheDirectory;
+
+/// A string identifying the document's file and its content, such as that
+/// returned by identityForFileAtPath:. Renders stored on disk by a session
+/// are reused only by later sessions with the same identity.
+@property(nullable, copy, nonatomic) NSString *documentIdentity;
+
+/// Return an identity for a document file, derived from its path, size and
+/// modification date
++ (NSString * _Nullable)identityForFileAtPath:(NSString *)path;
+
+/// Return the pyramid for a document, creating it and starting the
+/// background build if necessary. Must be called on the UI thread,
+/// as must all other methods.
++ (ARDKPagePyramid *)pyramidForDoc:(id<ARDKDoc>)doc;
+
+/// The width of the largest render held per page
+@property(readonly) CGFloat maxWidth;
+
+/// The maximum number of bytes of compressed renders held in memory. Once
+/// exceeded, the least recently used renders that are stored on disk are
+/// dropped from memory, to be read back as needed. Without a disk cache,
+/// the build stops once the budget is reached. Defaults to 16MB.
+@property(nonatomic) NSUInteger byteBudget;
+
+/// Whether a render of a page at least as wide as specified is available
+- (BOOL)hasPage:(NSInteger)pageNumber ofWidth:(CGFloat)width;
+
+/// Provide an image for a page, of the smallest width at least that specified
+/// if available, and otherwise the largest available. The image is read and
+/// decoded in the background and passed to the block on the UI thread. Passes
+/// nil if the page has yet to be processed, or has been invalidated meanwhile.
+- (void)imageForPage:(NSInteger)pageNumber ofWidth:(CGFloat)width whenReady:(void (^)(UIImage * _Nullable image))block;
+
+/// Provide a bitmap of a page at a specific size, scaled from a render at least
+/// as wide. The render is read, decoded and scaled in the background, and the
+/// bitmap passed to the block on the UI thread. Passes nil if the page has yet
+/// to be processed, or has been invalidated meanwhile, or if the size requested
+/// is larger than the renders held.
+- (void)bitmapForPage:(NSInteger)pageNumber ofSize:(CGSize)size whenReady:(void (^)(ARDKBitmap * _Nullable bm))block;
+
+@end
+
+NS_ASSUME_NONNULL_END
@@ -0,0 +1,603 @@
+//
+//  ARDKPagePyramid.m
+//  smart-office-nui
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <objc/runtime.h>
+#import <CommonCrypto/CommonDigest.h>
+#import "ARDKPagePyramid.h"
+
+// Renders are held JPEG compressed, at roughly a tenth of their raw size
+#define JPEG_QUALITY (0.8)
+
+// Delay before retrying a page for which a bitmap couldn't be allocated
+#define RETRY_DELAY (1.0)
+
+#define DEFAULT_BYTE_BUDGET (16 << 20)
+
+static char pyramidKey;
+
+static ARDKBitmap *bitmapFromImage(UIImage *image)
+{
+    CGImageRef cgImage = image.CGImage;
+    if (cgImage == NULL)
+        return nil;
+
+    size_t width = CGImageGetWidth(cgImage);
+    size_t height = CGImageGetHeight(cgImage);
+    ARDKBitmap *bm = [ARDKBitmap bitmapAtSize:CGSizeMake(width, height) ofType:ARDKBitmapType_RGBA8888];
+    if (bm == nil)
+        return nil;
+
+    ARDKBitmapInfo info = bm.asBitmap;
+    CGColorSpaceRef cs = CGColorSpaceCreateDeviceRGB();
+    CGContextRef cgctx = CGBitmapContextCreate(info.memptr, width, height, 8, info.lineSkip, cs, kCGImageAlphaPremultipliedLast | kCGBitmapByteOrderDefault);
+    CGColorSpaceRelease(cs);
+    if (cgctx == NULL)
+        return nil;
+
+    CGContextDrawImage(cgctx, CGRectMake(0, 0, width, height), cgImage);
+    CGContextRelease(cgctx);
+    return bm;
+}
+
+@interface ARDKPagePyramid ()
+@property(weak) id<ARDKDoc> doc;
+/// Compressed renders held in memory, for each page, in order of increasing width
+@property NSMutableDictionary<NSNumber *, NSArray<NSData *> *> *levels;
+/// The pages held in memory, least recently used first
+@property NSMutableOrderedSet<NSNumber *> *lru;
+@property NSUInteger bytes;
+/// The pages whose renders are stored in the current content directory
+@property NSMutableIndexSet *stored;
+/// The pages changed in this session, whose renders no longer correspond to
+/// the document's file, and so are held only in memory
+@property NSMutableIndexSet *changedPages;
+/// Serial queue on which files are read and written, and renders decoded
+@property dispatch_queue_t queue;
+@property NSInteger nextPage;
+@property BOOL building;
+// Incremented on each invalidation, so that builds and reads in progress
+// at the time don't deliver stale content
+@property NSUInteger generation;
+// Incremented each time the whole of the document's content changes, and
+// used to name the directory holding the renders of the current content
+@property NSUInteger contentGeneration;
+@property NSInteger lastPageCount;
+@property BOOL lastLoadingComplete;
+@end
+
+@implementation ARDKPagePyramid
+
+- (instancetype)initForDoc:(id<ARDKDoc>)doc
+{
+    self = [super init];
+    if (self)
+    {
+        _doc = doc;
+        _levelWidths = @[@64, @128, @256];
+        _byteBudget = DEFAULT_BYTE_BUDGET;
+        _levels = [NSMutableDictionary dictionary];
+        _lru = [NSMutableOrderedSet orderedSet];
+        _stored = [NSMutableIndexSet indexSet];
+        _changedPages = [NSMutableIndexSet indexSet];
+        _queue = dispatch_queue_create("ARDKPagePyramid", DISPATCH_QUEUE_SERIAL);
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(purgeMemory)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
++ (ARDKPagePyramid *)pyramidForDoc:(id<ARDKDoc>)doc
+{
+    assert([NSThread isMainThread]);
+    // The pyramid is attached to the document object so that it has the same lifetime
+    ARDKPagePyramid *pyramid = objc_getAssociatedObject(doc, &pyramidKey);
+    if (pyramid == nil)
+    {
+        pyramid = [[ARDKPagePyramid alloc] initForDoc:doc];
+        objc_setAssociatedObject(doc, &pyramidKey, pyramid, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        // The build starts in response to the page count being reported
+        [doc addTarget:pyramid];
+    }
+
+    return pyramid;
+}
+
++ (NSString *)identityForFileAtPath:(NSString *)path
+{
+    NSDictionary<NSFileAttributeKey, id> *attrs = [[NSFileManager defaultManager] attributesOfItemAtPath:path error:nil];
+    if (attrs == nil)
+        return nil;
+
+    return [NSString stringWithFormat:@"%@:%llu:%f", path.stringByStandardizingPath,
+            attrs.fileSize, attrs.fileModificationDate.timeIntervalSinceReferenceDate];
+}
+
+- (CGFloat)maxWidth
+{
+    return self.levelWidths.lastObject.doubleValue;
+}
+
+- (void)setLevelWidths:(NSArray<NSNumber *> *)levelWidths
+{
+    _levelWidths = [levelWidths sortedArrayUsingSelector:@selector(compare:)];
+    [self removeAllLevels];
+    // The stored renders are named by width, so those of other widths don't count
+    [self.stored removeAllIndexes];
+    [self invalidateFrom:0];
+}
+
+- (void)setByteBudget:(NSUInteger)byteBudget
+{
+    _byteBudget = byteBudget;
+    [self trimToBudget];
+    [self buildNext];
+}
+
+- (void)setDiskCacheDirectory:(NSString *)diskCacheDirectory
+{
+    _diskCacheDirectory = [diskCacheDirectory copy];
+    [self diskLocationHasChanged];
+}
+
+- (void)setDocumentIdentity:(NSString *)documentIdentity
+{
+    _documentIdentity = [documentIdentity copy];
+    [self diskLocationHasChanged];
+}
+
+/// Pages known to be stored in the old location may not be in the new one, and
+/// changes made before a new identity was set are included in that identity
+- (void)diskLocationHasChanged
+{
+    [self.stored removeAllIndexes];
+    [self.changedPages removeAllIndexes];
+    [self invalidateFrom:0];
+}
+
+#pragma mark Memory
+
+- (void)touch:(NSNumber *)key
+{
+    [self.lru removeObject:key];
+    [self.lru addObject:key];
+}
+
+- (void)setLevels:(NSArray<NSData *> *)levels forPage:(NSInteger)pageNumber
+{
+    NSNumber *key = @(pageNumber);
+    [self removeLevelsForPage:pageNumber];
+    self.levels[key] = levels;
+    [self.lru addObject:key];
+    for (NSData *data in levels)
+        self.bytes += data.length;
+
+    [self trimToBudget];
+}
+
+- (void)removeLevelsForPage:(NSInteger)pageNumber
+{
+    NSNumber *key = @(pageNumber);
+    for (NSData *data in self.levels[key])
+        self.bytes -= data.length;
+
+    [self.levels removeObjectForKey:key];
+    [self.lru removeObject:key];
+}
+
+- (void)removeAllLevels
+{
+    [self.levels removeAllObjects];
+    [self.lru removeAllObjects];
+    self.bytes = 0;
+}
+
+/// Drop from memory the least recently used renders that can be read back from disk
+- (void)trimToBudget
+{
+    for (NSNumber *key in [self.lru.array copy])
+    {
+        if (self.bytes <= self.byteBudget)
+            break;
+
+        if ([self.stored containsIndex:key.integerValue])
+            [self removeLevelsForPage:key.integerValue];
+    }
+}
+
+- (void)purgeMemory
+{
+    // Renders not stored on disk are lost, and rebuilt in due course
+    [self removeAllLevels];
+    self.nextPage = 0;
+    [self buildNext];
+}
+
+#pragma mark Disk
+
+/// The directory holding all the stored renders of the document, whatever its content
+- (NSString *)diskDocumentDirectory
+{
+    if (self.diskCacheDirectory == nil || self.documentIdentity == nil)
+        return nil;
+
+    NSData *identity = [self.documentIdentity dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(identity.bytes, (CC_LONG)identity.length, digest);
+
+    NSMutableString *name = [NSMutableString stringWithCapacity:CC_SHA256_DIGEST_LENGTH * 2];
+    for (int i = 0; i < CC_SHA256_DIGEST_LENGTH; i++)
+        [name appendFormat:@"%02x", digest[i]];
+
+    return [self.diskCacheDirectory stringByAppendingPathComponent:name];
+}
+
+/// The directory holding the stored renders of the document's current content
+- (NSString *)diskContentDirectory
+{
+    return [[self diskDocumentDirectory] stringByAppendingPathComponent:
+            [NSString stringWithFormat:@"%lu", (unsigned long)self.contentGeneration]];
+}
+
+- (NSString *)diskPathForPage:(NSInteger)pageNumber level:(NSInteger)level
+{
+    return [[self diskContentDirectory] stringByAppendingPathComponent:
+            [NSString stringWithFormat:@"%ld-%ld.jpg", (long)pageNumber, (long)self.levelWidths[level].integerValue]];
+}
+
+/// The paths of the files holding a page's renders, or nil if they aren't to be stored
+- (NSArray<NSString *> *)diskPathsForPage:(NSInteger)pageNumber
+{
+    if ([self diskDocumentDirectory] == nil || [self.changedPages containsIndex:pageNumber])
+        return nil;
+
+    NSMutableArray<NSString *> *paths = [NSMutableArray arrayWithCapacity:self.levelWidths.count];
+    for (NSInteger i = 0; i < self.levelWidths.count; i++)
+        [paths addObject:[self diskPathForPage:pageNumber level:i]];
+
+    return paths;
+}
+
+/// Remove all stored renders of the document and start afresh for changed content.
+/// The renders stored before such a change are never valid afterwards, whether in
+/// this session or a later one, which starts from the original content
+- (void)purgeDisk
+{
+    NSString *dir = [self diskDocumentDirectory];
+    if (dir)
+    {
+        dispatch_async(self.queue, ^{
+            [[NSFileManager defaultManager] removeItemAtPath:dir error:nil];
+        });
+    }
+
+    [self.stored removeAllIndexes];
+    [self.changedPages removeAllIndexes];
+    self.contentGeneration++;
+}
+
+/// Remove the stored renders of a single page, whose content has changed. Those
+/// subsequently made are held only in memory, since a later session starts from
+/// the content of the document's file
+- (void)purgeDiskForPage:(NSInteger)pageNumber
+{
+    NSArray<NSString *> *paths = [self diskPathsForPage:pageNumber];
+    if (paths)
+    {
+        dispatch_async(self.queue, ^{
+            for (NSString *path in paths)
+                [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+        });
+    }
+
+    [self.stored removeIndex:pageNumber];
+    [self.changedPages addIndex:pageNumber];
+}
+
+#pragma mark Building
+
+- (BOOL)isProcessed:(NSInteger)pageNumber
+{
+    return self.levels[@(pageNumber)] != nil || [self.stored containsIndex:pageNumber];
+}
+
+/// Start processing the next page lacking renders, if not already busy. Pages are
+/// processed one at a time so as to interleave with the rendering of the visible
+/// pages, rather than delay it.
+- (void)buildNext
+{
+    id<ARDKDoc> doc = self.doc;
+    if (self.building || doc == nil)
+        return;
+
+    while (self.nextPage < doc.pageCount && [self isProcessed:self.nextPage])
+        self.nextPage++;
+
+    if (self.nextPage >= doc.pageCount)
+        return;
+
+    NSArray<NSString *> *paths = [self diskPathsForPage:self.nextPage];
+    // Without a disk cache, renders beyond the budget would have nowhere to go
+    if (paths == nil && self.bytes >= self.byteBudget)
+        return;
+
+    NSInteger pageNumber = self.nextPage++;
+    NSUInteger generation = self.generation;
+    self.building = YES;
+
+    // Renders stored by an earlier session are left on disk until needed
+    dispatch_async(self.queue, ^{
+        BOOL found = paths != nil;
+        for (NSString *path in paths)
+        {
+            if (![[NSFileManager defaultManager] fileExistsAtPath:path])
+            {
+                found = NO;
+                break;
+            }
+        }
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (self.generation != generation)
+            {
+                self.building = NO;
+                self.nextPage = MIN(self.nextPage, pageNumber);
+                [self buildNext];
+            }
+            else if (found)
+            {
+                self.building = NO;
+                [self.stored addIndex:pageNumber];
+                [self buildNext];
+            }
+            else
+            {
+                [self renderPage:pageNumber];
+            }
+        });
+    });
+}
+
+/// Render a page at each of the level widths, and hold the results. Called with
+/// building set, which is cleared once done.
+- (void)renderPage:(NSInteger)pageNumber
+{
+    id<ARDKDoc> doc = self.doc;
+    id<ARDKPage> page = [doc getPage:pageNumber update:nil];
+    CGSize pageSize = page.size;
+    if (pageSize.width <= 0 || pageSize.height <= 0)
+    {
+        self.building = NO;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self buildNext];
+        });
+        return;
+    }
+
+    NSArray<NSNumber *> *widths = self.levelWidths;
+    CGFloat zoom = self.maxWidth / pageSize.width;
+    ARDKBitmap *bm = [ARDKBitmap bitmapAtSize:CGSizeMake(self.maxWidth, ceil(pageSize.height * zoom)) ofType:ARDKBitmapType_RGBA8888];
+    if (bm == nil)
+    {
+        // Likely short of memory. Try the page again later
+        self.building = NO;
+        self.nextPage = MIN(self.nextPage, pageNumber);
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(RETRY_DELAY * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
+            [self buildNext];
+        });
+        return;
+    }
+
+    NSUInteger generation = self.generation;
+    [page renderAtZoom:zoom withDocOrigin:CGPointZero intoBitmap:bm progress:^(ARError error) {
+        // Downscale and compress in the background
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
+            NSMutableArray<NSData *> *levels = nil;
+            if (error == 0)
+            {
+                levels = [NSMutableArray arrayWithCapacity:widths.count];
+                for (NSNumber *width in widths)
+                {
+                    ARDKBitmap *levelBm = bm;
+                    if (width.doubleValue != bm.width)
+                    {
+                        levelBm = [ARDKBitmap bitmapAtSize:CGSizeMake(width.doubleValue, ceil(pageSize.height * width.doubleValue / pageSize.width)) ofType:ARDKBitmapType_RGBA8888];
+                        [levelBm scaleFrom:bm];
+                    }
+
+                    NSData *data = UIImageJPEGRepresentation(levelBm.asImage, JPEG_QUALITY);
+                    if (data == nil)
+                    {
+                        levels = nil;
+                        break;
+                    }
+
+                    [levels addObject:data];
+                }
+            }
+
+            dispatch_async(dispatch_get_main_queue(), ^{
+                self.building = NO;
+                if (self.generation != generation)
+                {
+                    // Overtaken by an invalidation, so try again
+                    self.nextPage = MIN(self.nextPage, pageNumber);
+                }
+                else if (levels)
+                {
+                    NSArray<NSString *> *paths = [self diskPathsForPage:pageNumber];
+                    if (paths)
+                    {
+                        NSString *dir = [self diskContentDirectory];
+                        dispatch_async(self.queue, ^{
+                            [[NSFileManager defaultManager] createDirectoryAtPath:dir withIntermediateDirectories:YES attributes:nil error:nil];
+                            for (NSInteger i = 0; i < levels.count; i++)
+                                [levels[i] writeToFile:paths[i] atomically:YES];
+                        });
+
+                        // Reads are queued behind the writes, so the page can
+                        // count as stored straight away
+                        [self.stored addIndex:pageNumber];
+                    }
+
+                    [self setLevels:levels forPage:pageNumber];
+                }
+
+                [self buildNext];
+            });
+        });
+    }];
+}
+
+- (void)invalidateFrom:(NSInteger)pageNumber
+{
+    self.generation++;
+    self.nextPage = MIN(self.nextPage, pageNumber);
+    [self buildNext];
+}
+
+#pragma mark Access
+
+- (NSInteger)levelForPage:(NSInteger)pageNumber ofWidth:(CGFloat)width exact:(BOOL)exact
+{
+    if (![self isProcessed:pageNumber])
+        return NSNotFound;
+
+    for (NSInteger i = 0; i < self.levelWidths.count; i++)
+    {
+        if (self.levelWidths[i].doubleValue >= width)
+            return i;
+    }
+
+    return exact ? NSNotFound : self.levelWidths.count - 1;
+}
+
+/// Decode, on the queue, a page's render at a level, read from memory or from
+/// disk, passing the result, or nil on failure, to the block on the UI thread
+- (void)decodePage:(NSInteger)pageNumber level:(NSInteger)level
+              with:(id (^)(ARDKBitmap *levelBm))process
+         whenReady:(void (^)(id _Nullable result))block
+{
+    NSNumber *key = @(pageNumber);
+    NSData *data = self.levels[key][level];
+    NSString *path = nil;
+    if (data)
+        [self touch:key];
+    else
+        path = [self diskPathForPage:pageNumber level:level];
+
+    NSUInteger generation = self.generation;
+    dispatch_async(self.queue, ^{
+        NSData *jpeg = data ? data : [NSData dataWithContentsOfFile:path];
+        ARDKBitmap *levelBm = jpeg ? bitmapFromImage([UIImage imageWithData:jpeg]) : nil;
+        id result = levelBm ? process(levelBm) : nil;
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block(self.generation == generation ? result : nil);
+        });
+    });
+}
+
+- (BOOL)hasPage:(NSInteger)pageNumber ofWidth:(CGFloat)width
+{
+    return [self levelForPage:pageNumber ofWidth:width exact:YES] != NSNotFound;
+}
+
+- (void)imageForPage:(NSInteger)pageNumber ofWidth:(CGFloat)width whenReady:(void (^)(UIImage *))block
+{
+    NSInteger level = [self levelForPage:pageNumber ofWidth:width exact:NO];
+    if (level == NSNotFound)
+    {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block(nil);
+        });
+        return;
+    }
+
+    [self decodePage:pageNumber level:level with:^id(ARDKBitmap *levelBm) {
+        return levelBm.asImage;
+    } whenReady:block];
+}
+
+- (void)bitmapForPage:(NSInteger)pageNumber ofSize:(CGSize)size whenReady:(void (^)(ARDKBitmap *))block
+{
+    NSInteger level = [self levelForPage:pageNumber ofWidth:size.width exact:YES];
+    if (level == NSNotFound)
+    {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block(nil);
+        });
+        return;
+    }
+
+    [self decodePage:pageNumber level:level with:^id(ARDKBitmap *levelBm) {
+        if (levelBm.width == size.width && levelBm.height == size.height)
+            return levelBm;
+
+        ARDKBitmap *bm = [ARDKBitmap bitmapAtSize:size ofType:ARDKBitmapType_RGBA8888];
+        [bm scaleFrom:levelBm];
+        return bm;
+    } whenReady:block];
+}
+
+#pragma mark <ARDKDocumentEventTarget>
+
+- (void)invalidateAll
+{
+    [self removeAllLevels];
+    [self purgeDisk];
+    [self invalidateFrom:0];
+}
+
+- (void)updatePageCount:(NSInteger)pageCount andLoadingComplete:(BOOL)complete
+{
+    // Once loaded, a change in page count means pages have been inserted or
+    // deleted, so that renders may now belong to different page numbers
+    BOOL changed = self.lastLoadingComplete && pageCount != self.lastPageCount;
+    self.lastPageCount = pageCount;
+    self.lastLoadingComplete = complete;
+
+    if (changed)
+        [self invalidateAll];
+    else
+        [self buildNext];
+}
+
+- (void)pageSizeHasChanged
+{
+    [self invalidateAll];
+}
+
+- (void)selectionHasChanged
+{
+}
+
+- (void)layoutHasCompleted
+{
+}
+
+- (void)pageContentHasChanged:(NSInteger)pageNumber
+{
+    // The renders of the other pages remain valid, both in memory and on disk
+    [self removeLevelsForPage:pageNumber];
+    [self purgeDiskForPage:pageNumber];
+    [self invalidateFrom:pageNumber];
+}
+
+- (void)documentContentHasChanged
+{
+    [self invalidateAll];
+}
+
+@end
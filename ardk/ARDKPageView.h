@@ -62,6 +62,14 @@ NS_ASSUME_NONNULL_BEGIN
 /// Kick off a render of a particular area of the page at a specific scale
 - (void)displayArea:(CGRect)area atScale:(CGFloat)scale usingBitmap:(ARDKBitmap *)bm whenDone:(void (^ _Nullable)(void))block;
 
+/// Like displayArea:atScale:usingBitmap:whenDone:, but optionally rendering
+/// any new areas as a quick draft. A subsequent non-draft call replaces all
+/// draft content
+- (void)displayArea:(CGRect)area atScale:(CGFloat)scale usingBitmap:(ARDKBitmap *)bm draft:(BOOL)draft whenDone:(void (^ _Nullable)(void))block;
+
+/// Whether any of the currently displayed content was rendered as a draft
+@property(readonly) BOOL hasDraftContent;
+
 /// Mark as not taking part in a render pass. This is necessary to keep
 /// the alternation of bitmap use for rendering
 - (void)missRenderPass;
@@ -8,7 +8,9 @@
 
 #import "ARDKGeometry.h"
 #import "ARDKImageViewMatrix.h"
+#import "ARDKPagePyramid.h"
 #import "ARDKPageView.h"
+#import "ARDKTileCache.h"
 
 static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
 {
@@ -55,6 +57,42 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
     return res;
 }
 
+static BOOL bitmapIsDark(ARDKBitmap *bm)
+{
+    while (bm.parent)
+        bm = bm.parent;
+
+    return bm.darkMode;
+}
+
+/// Merge rectangles that abut and share a complete edge
+static NSArray<NSValue *> *mergeRects(NSArray<NSValue *> *rects)
+{
+    NSMutableArray<NSValue *> *res = [NSMutableArray arrayWithCapacity:rects.count];
+    for (NSValue *val in rects)
+    {
+        CGRect rect = val.CGRectValue;
+        BOOL merged = NO;
+        for (NSUInteger i = 0; i < res.count && !merged; i++)
+        {
+            CGRect other = res[i].CGRectValue;
+            if ((CGRectGetMinX(rect) == CGRectGetMinX(other) && CGRectGetMaxX(rect) == CGRectGetMaxX(other)
+                 && (CGRectGetMinY(rect) == CGRectGetMaxY(other) || CGRectGetMaxY(rect) == CGRectGetMinY(other)))
+                || (CGRectGetMinY(rect) == CGRectGetMinY(other) && CGRectGetMaxY(rect) == CGRectGetMaxY(other)
+                 && (CGRectGetMinX(rect) == CGRectGetMaxX(other) || CGRectGetMaxX(rect) == CGRectGetMinX(other))))
+            {
+                res[i] = [NSValue valueWithCGRect:CGRectUnion(rect, other)];
+                merged = YES;
+            }
+        }
+
+        if (!merged)
+            [res addObject:val];
+    }
+
+    return res;
+}
+
 @interface ARDKPageView ()
 @property CGRect layoutFrame;
 @property CGRect bmRect;
@@ -69,6 +107,12 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
 @property NSMutableArray<NSValue *> *requestedUpdates;
 @property UIView *selectionHighlight; ///< Current page indicator in pages view / slide sorter
 @property BOOL contentChanged;
+@property BOOL hasDraftContent;
+@property BOOL hasPyramidContent; ///< Part of the bitmap was scaled from the page pyramid
+@property ARDKTileCache *tileCache;
+@property ARDKPagePyramid *pyramid;
+@property UIImageView *placeholder; ///< Low resolution page image shown until tiles cover it
+@property BOOL placeholderPending; ///< The placeholder image has been requested from the pyramid
 @end
 
 #define HIGHLIGHT_THICKNESS (5.0)
@@ -109,6 +153,11 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
         self.layer.borderColor = [UIColor colorWithWhite:BORDER_LUM/255.0 alpha:1.0].CGColor;
         self.backgroundColor = [UIColor whiteColor];
         self.requestedUpdates = [NSMutableArray array];
+        // A placeholder image, from the document's page pyramid, sits behind the
+        // rendered tiles, so that there is something to see while rendering.
+        self.placeholder = [[UIImageView alloc] initWithFrame:CGRectZero];
+        self.placeholder.autoresizingMask = UIViewAutoresizingFlexibleWidth | UIViewAutoresizingFlexibleHeight;
+        [self addSubview:self.placeholder];
         // Create a view to contain the matrix if image views, used to
         // display the page contents. Using this separate view,
         // rather than attaching the image views directly, avoids
@@ -118,6 +167,8 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
         self.tiles = [ARDKImageViewMatrix matrixForView:matrixContainer];
 
         self.displayRenders = [NSMutableArray array];
+        self.tileCache = [ARDKTileCache cacheForDoc:doc];
+        self.pyramid = [ARDKPagePyramid pyramidForDoc:doc];
         _doc = doc;
     }
 
@@ -141,6 +192,7 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
 - (void) resizeOverlays
 {
     self.selectionHighlight.frame = CGRectInset(self.bounds, -HIGHLIGHT_THICKNESS, -HIGHLIGHT_THICKNESS);
+    self.placeholder.frame = self.bounds;
 }
 
 - (id<ARDKDoc>) doc
@@ -260,6 +312,11 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
 }
 
 - (void)displayArea:(CGRect)area atScale:(CGFloat)scale usingBitmap:(ARDKBitmap *)bm whenDone:(void (^)(void))block
+{
+    [self displayArea:area atScale:scale usingBitmap:bm draft:NO whenDone:block];
+}
+
+- (void)displayArea:(CGRect)area atScale:(CGFloat)scale usingBitmap:(ARDKBitmap *)bm draft:(BOOL)draft whenDone:(void (^)(void))block
 {
     CGRect irect    = CGRectIntegral(ARCGRectScale(area, scale));
     // Restrict the area to the size of the bitmap provided (because of use of floats could be too big by 1 pixel)
@@ -277,15 +334,21 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
         __block int renderProcessCount = 0;
         CGRect lastRect = self.bmRect;
         ARDKBitmap *lastBm = self.bm;
-        if (self.updateRender || scale != self.scale || self.contentChanged)
+        if (self.updateRender || scale != self.scale || self.contentChanged || (self.hasDraftContent && !draft))
         {
             // If there was an update render going or if the area to be rendered has changed
             // better not reuse any of the tiles in the image view matrix, or copy any data
-            // from the previously used bitmap.
+            // from the previously used bitmap. The same applies when replacing a draft.
             lastRect = CGRectNull;
             [self.tiles requestReset];
         }
 
+        NSArray<NSValue *> *newAreas = rectMinus(irect, lastRect);
+        // Draft content survives only in the area copied from the previous bitmap
+        self.hasDraftContent = draft ? newAreas.count > 0 || (self.hasDraftContent && CGRectIntersectsRect(lastRect, irect)) : NO;
+        // Likewise content from the page pyramid, which is never offered to the tile cache
+        BOOL pyramidContent = self.hasPyramidContent && CGRectIntersectsRect(lastRect, irect);
+
         self.contentChanged = NO;
         self.bmRect = irect;
         self.tiles.scale = scale;
@@ -298,8 +361,19 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
         [self.updateRender abort];
         self.updateRender = nil;
 
+        // Drafts are not cached, and neither are renders that failed
+        __block BOOL cacheable = !draft;
+        CGFloat renderZoom = self.renderZoom;
+        BOOL darkMode = bitmapIsDark(bm);
+        CGRect pageArea = CGRectIntegral(ARCGRectScale(self.bounds, scale));
+
         // This function will be called when all processing of the bitmap (copying and rendering to) is complete
         void (^onRenderFinished)(void) = ^(void){
+            // Offer the result to the document's tile cache, unless overtaken
+            // by a further call, or content has changed in the meantime
+            if (cacheable && self.bm == bm && CGRectEqualToRect(self.bmRect, irect) && self.requestedUpdates.count == 0)
+                [self.tileCache harvestPage:self.pageNumber atZoom:renderZoom darkMode:darkMode pageArea:pageArea fromBitmap:bm bmArea:irect];
+
             [self.tiles displayArea:self.bmRect usingBitmap:self.bm onComplete:^{
                 [self.displayRenders removeAllObjects];
 
@@ -328,22 +402,150 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
             });
         }
 
-        // Render any new area
-        for (NSValue *val in rectMinus(irect, lastRect))
+        // The pyramid's renders are not dark-mode converted
+        self.placeholder.hidden = darkMode;
+        if (self.placeholder.image == nil && !self.placeholderPending)
         {
-            renderProcessCount++;
-            CGRect renderArea = val.CGRectValue;
-            id<ARDKRender> render = [self.page renderAtZoom:self.renderZoom
-                                              withDocOrigin:ARCGPointScale(renderArea.origin, -1)
-                                                 intoBitmap:[ARDKBitmap bitmapFromSubarea:CGRectOffset(renderArea, -irect.origin.x, -irect.origin.y) ofBitmap:bm]
-                                                   progress:^(ARError error)
+            NSInteger pageNumber = self.pageNumber;
+            self.placeholderPending = YES;
+            [self.pyramid imageForPage:pageNumber ofWidth:pageArea.size.width whenReady:^(UIImage *image) {
+                self.placeholderPending = NO;
+                if (self.pageNumber == pageNumber && self.placeholder.image == nil)
+                    self.placeholder.image = image;
+            }];
+        }
+
+        // Render any of the areas given
+        void (^renderAreas)(NSArray<NSValue *> *) = ^(NSArray<NSValue *> *areas) {
+            for (NSValue *val in areas)
             {
-                if (--renderProcessCount == 0)
-                    onRenderFinished();
+                renderProcessCount++;
+                CGRect renderArea = val.CGRectValue;
+                CGPoint docOrigin = ARCGPointScale(renderArea.origin, -1);
+                ARDKBitmap *renderBm = [ARDKBitmap bitmapFromSubarea:CGRectOffset(renderArea, -irect.origin.x, -irect.origin.y) ofBitmap:bm];
+                void (^progress)(ARError) = ^(ARError error)
+                {
+                    if (error)
+                        cacheable = NO;
+
+                    if (--renderProcessCount == 0)
+                        onRenderFinished();
+                };
+                id<ARDKRender> render = draft ? [self.page draftAtZoom:renderZoom withDocOrigin:docOrigin intoBitmap:renderBm progress:progress]
+                                              : [self.page renderAtZoom:renderZoom withDocOrigin:docOrigin intoBitmap:renderBm progress:progress];
+                [self.displayRenders addObject:render];
+            }
+        };
+
+        // At small scales, the page pyramid may have a render large enough
+        // to use in place of rendering, even for drafts. It is read, decoded
+        // and scaled in the background
+        if (newAreas.count > 0 && pageArea.size.width <= self.pyramid.maxWidth
+            && [self.pyramid hasPage:self.pageNumber ofWidth:pageArea.size.width])
+        {
+            NSArray<NSValue *> *thumbAreas = newAreas;
+            renderProcessCount++;
+            [self.pyramid bitmapForPage:self.pageNumber ofSize:pageArea.size whenReady:^(ARDKBitmap *thumbBm) {
+                if (thumbBm == nil)
+                {
+                    // Lost to an invalidation, so render after all, unless overtaken
+                    if (self.bm == bm)
+                        renderAreas(thumbAreas);
+
+                    if (--renderProcessCount == 0)
+                        onRenderFinished();
+                    return;
+                }
+
+                dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                    for (NSValue *val in thumbAreas)
+                    {
+                        CGRect newArea = CGRectIntersection(val.CGRectValue, pageArea);
+                        if (CGRectIsEmpty(newArea))
+                            continue;
+
+                        ARDKBitmap *src = [ARDKBitmap bitmapFromSubarea:CGRectOffset(newArea, -pageArea.origin.x, -pageArea.origin.y) ofBitmap:thumbBm];
+                        ARDKBitmap *tgt = [ARDKBitmap bitmapFromSubarea:CGRectOffset(newArea, -irect.origin.x, -irect.origin.y) ofBitmap:bm];
+                        [tgt copyFrom:src];
+                        [tgt doDarkModeConversion];
+                    }
+
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        if (--renderProcessCount == 0)
+                            onRenderFinished();
+                    });
+                });
             }];
-            [self.displayRenders addObject:render];
+
+            // These areas aren't drafts, but neither are they worth caching as tiles
+            newAreas = @[];
+            pyramidContent = YES;
+            if (draft)
+                self.hasDraftContent = self.hasDraftContent && CGRectIntersectsRect(lastRect, irect);
         }
 
+        self.hasPyramidContent = pyramidContent;
+        if (pyramidContent)
+            cacheable = NO;
+
+        // Satisfy what we can of the new areas from the document's tile cache
+        if (!draft && newAreas.count > 0)
+        {
+            NSMutableArray<NSValue *> *misses = [NSMutableArray array];
+            for (NSValue *val in newAreas)
+            {
+                CGRect newArea = val.CGRectValue;
+                CGRect range = CGRectIntegral(ARCGRectScale(newArea, 1/TILE_SIZE));
+                for (CGFloat y = CGRectGetMinY(range); y < CGRectGetMaxY(range); y++)
+                {
+                    // Contiguous misses along a row are rendered as one
+                    CGRect missRun = CGRectNull;
+                    for (CGFloat x = CGRectGetMinX(range); x < CGRectGetMaxX(range); x++)
+                    {
+                        CGRect needed = CGRectIntersection(ARCGRectScale(CGRectMake(x, y, 1, 1), TILE_SIZE), newArea);
+                        if (CGRectIsEmpty(needed))
+                            continue;
+
+                        CGRect tileArea;
+                        ARDKBitmap *tileBm = [self.tileCache tileForPage:self.pageNumber
+                                                                  atZoom:renderZoom
+                                                                 atIndex:CGPointMake(x, y)
+                                                                darkMode:darkMode
+                                                                covering:needed
+                                                                    area:&tileArea];
+                        if (tileBm == nil)
+                        {
+                            missRun = CGRectUnion(missRun, needed);
+                            continue;
+                        }
+
+                        if (!CGRectIsNull(missRun))
+                            [misses addObject:[NSValue valueWithCGRect:missRun]];
+                        missRun = CGRectNull;
+
+                        renderProcessCount++;
+                        ARDKBitmap *src = [ARDKBitmap bitmapFromSubarea:CGRectOffset(needed, -tileArea.origin.x, -tileArea.origin.y) ofBitmap:tileBm];
+                        ARDKBitmap *tgt = [ARDKBitmap bitmapFromSubarea:CGRectOffset(needed, -irect.origin.x, -irect.origin.y) ofBitmap:bm];
+                        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                            [tgt copyFrom:src];
+                            dispatch_async(dispatch_get_main_queue(), ^{
+                                if (--renderProcessCount == 0)
+                                    onRenderFinished();
+                            });
+                        });
+                    }
+
+                    if (!CGRectIsNull(missRun))
+                        [misses addObject:[NSValue valueWithCGRect:missRun]];
+                }
+            }
+
+            newAreas = mergeRects(misses);
+        }
+
+        // Render any new area
+        renderAreas(newAreas);
+
         assert(renderProcessCount > 0);
     }
 }
@@ -362,6 +564,8 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
     [self.displayRenders removeAllObjects];
     self.bmRect = CGRectNull;
     self.bm = nil;
+    self.hasDraftContent = NO;
+    self.hasPyramidContent = NO;
     [self.tiles clear];
 }
 
@@ -369,6 +573,9 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
 {
     self.page = nil;
     self.bmRect = CGRectNull;
+    self.hasDraftContent = NO;
+    self.hasPyramidContent = NO;
+    self.placeholder.image = nil;
     [self abortRenders];
     [self.tiles clear];
     self.selectionHighlight.hidden = YES;
@@ -387,6 +594,7 @@ static NSArray<NSValue *> *rectMinus(CGRect whole, CGRect part)
     if (pageChange || !self.page)
     {
         self.pageNumber = pageNumber;
+        self.placeholder.image = nil;
         __weak typeof(self) weakSelf = self;
         self.page = [self.doc getPage:pageNumber update:^(CGRect area) {
             [weakSelf requestUpdate:area];
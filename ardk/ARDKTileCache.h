@@ -0,0 +1,58 @@
+//
+//  ARDKTileCache.h
+//  smart-office-nui
+//
+//  Document-wide cache of rendered page content, shared between all
+//  the views of a document. Content is held as tiles on the same grid
+//  as used by ARDKImageViewMatrix, keyed by page, zoom bucket (powers of
+//  two) and tile index, and is discarded least-recently-used first to
+//  keep within a byte budget.
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <UIKit/UIKit.h>
+#import "ARDKLib.h"
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface ARDKTileCache : NSObject<ARDKDocumentEventTarget>
+
+/// The maximum number of bytes of bitmap data held by the cache
+@property NSUInteger byteBudget;
+
+/// Return the cache for a document, creating it if necessary. Must be called
+/// on the UI thread, as must all other methods.
++ (ARDKTileCache *)cacheForDoc:(id<ARDKDoc>)doc;
+
+/// Return the bitmap for a tile, if held. The tile must have been rendered at
+/// exactly the specified zoom, and cover at least the specified part of the tile
+/// area. Any bitmap returned is of the tile's full rendered area, which is given
+/// via the area parameter, in page pixel coordinates.
+- (ARDKBitmap * _Nullable)tileForPage:(NSInteger)pageNumber
+                               atZoom:(CGFloat)zoom
+                              atIndex:(CGPoint)index
+                             darkMode:(BOOL)darkMode
+                             covering:(CGRect)needed
+                                 area:(CGRect *)area;
+
+/// Copy into the cache any complete tiles held within a rendered bitmap. pageArea
+/// is the full extent of the page, and bmArea the area the bitmap represents,
+/// both in page pixel coordinates. The tiles are copied before returning, so
+/// the bitmap may be reused as soon as this call completes.
+- (void)harvestPage:(NSInteger)pageNumber
+             atZoom:(CGFloat)zoom
+           darkMode:(BOOL)darkMode
+           pageArea:(CGRect)pageArea
+         fromBitmap:(ARDKBitmap *)bm
+             bmArea:(CGRect)bmArea;
+
+/// Discard all tiles for a page
+- (void)invalidatePage:(NSInteger)pageNumber;
+
+/// Discard all tiles
+- (void)clear;
+
+@end
+
+NS_ASSUME_NONNULL_END
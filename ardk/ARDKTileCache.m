@@ -0,0 +1,271 @@
+//
+//  ARDKTileCache.m
+//  smart-office-nui
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <objc/runtime.h>
+#import "ARDKGeometry.h"
+#import "ARDKImageViewMatrix.h"
+#import "ARDKTileCache.h"
+
+#define DEFAULT_BYTE_BUDGET (48 << 20)
+// Relative difference in zoom below which tiles are considered interchangeable
+#define ZOOM_TOLERANCE (0.001)
+
+static char cacheKey;
+
+@interface ARDKTileCacheKey : NSObject<NSCopying>
+@property(readonly) NSInteger pageNumber;
+@property(readonly) int bucket;
+@property(readonly) CGPoint index;
+
++ (ARDKTileCacheKey *)keyForPage:(NSInteger)pageNumber atZoom:(CGFloat)zoom atIndex:(CGPoint)index;
+
+@end
+
+@implementation ARDKTileCacheKey
+
++ (ARDKTileCacheKey *)keyForPage:(NSInteger)pageNumber atZoom:(CGFloat)zoom atIndex:(CGPoint)index
+{
+    ARDKTileCacheKey *key = [[ARDKTileCacheKey alloc] init];
+    key->_pageNumber = pageNumber;
+    // Tiles are bucketed by the power of two below their zoom, so that
+    // renders at neighbouring zooms replace each other, rather than
+    // accumulating.
+    key->_bucket = (int)floor(log2(zoom));
+    key->_index = index;
+    return key;
+}
+
+- (id)copyWithZone:(NSZone *)zone
+{
+    return self;
+}
+
+- (BOOL)isEqual:(id)object
+{
+    if (![object isKindOfClass:[ARDKTileCacheKey class]])
+        return NO;
+
+    ARDKTileCacheKey *other = object;
+    return other->_pageNumber == _pageNumber
+        && other->_bucket == _bucket
+        && CGPointEqualToPoint(other->_index, _index);
+}
+
+- (NSUInteger)hash
+{
+    return ((NSUInteger)_pageNumber * 31 + (NSUInteger)_bucket) * 1021
+        + (NSUInteger)_index.y * 257 + (NSUInteger)_index.x;
+}
+
+@end
+
+@interface ARDKTileCacheEntry : NSObject
+@property ARDKBitmap *bitmap;
+@property CGRect area;
+@property CGFloat zoom;
+@property BOOL darkMode;
+@property NSUInteger bytes;
+@end
+
+@implementation ARDKTileCacheEntry
+@end
+
+@interface ARDKTileCache ()
+@property NSMutableDictionary<ARDKTileCacheKey *, ARDKTileCacheEntry *> *entries;
+@property NSMutableOrderedSet<ARDKTileCacheKey *> *lru;
+@property NSUInteger bytes;
+@end
+
+@implementation ARDKTileCache
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _byteBudget = DEFAULT_BYTE_BUDGET;
+        _entries = [NSMutableDictionary dictionary];
+        _lru = [NSMutableOrderedSet orderedSet];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(clear)
+                                                     name:UIApplicationDidReceiveMemoryWarningNotification
+                                                   object:nil];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+}
+
++ (ARDKTileCache *)cacheForDoc:(id<ARDKDoc>)doc
+{
+    assert([NSThread isMainThread]);
+    // The cache is attached to the document object so that it has the same lifetime
+    ARDKTileCache *cache = objc_getAssociatedObject(doc, &cacheKey);
+    if (cache == nil)
+    {
+        cache = [[ARDKTileCache alloc] init];
+        objc_setAssociatedObject(doc, &cacheKey, cache, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+        [doc addTarget:cache];
+    }
+
+    return cache;
+}
+
+- (void)removeEntryForKey:(ARDKTileCacheKey *)key
+{
+    ARDKTileCacheEntry *entry = self.entries[key];
+    if (entry)
+    {
+        self.bytes -= entry.bytes;
+        [self.entries removeObjectForKey:key];
+        [self.lru removeObject:key];
+    }
+}
+
+- (void)touch:(ARDKTileCacheKey *)key
+{
+    [self.lru removeObject:key];
+    [self.lru addObject:key];
+}
+
+- (void)trimToBudget
+{
+    while (self.bytes > self.byteBudget && self.lru.count > 0)
+        [self removeEntryForKey:self.lru.firstObject];
+}
+
+- (void)setByteBudget:(NSUInteger)byteBudget
+{
+    _byteBudget = byteBudget;
+    [self trimToBudget];
+}
+
+- (ARDKTileCacheEntry *)entryForKey:(ARDKTileCacheKey *)key atZoom:(CGFloat)zoom darkMode:(BOOL)darkMode covering:(CGRect)needed
+{
+    ARDKTileCacheEntry *entry = self.entries[key];
+    if (entry == nil
+        || fabs(entry.zoom - zoom) > zoom * ZOOM_TOLERANCE
+        || entry.darkMode != darkMode
+        || !CGRectContainsRect(entry.area, needed))
+        return nil;
+
+    return entry;
+}
+
+- (ARDKBitmap *)tileForPage:(NSInteger)pageNumber atZoom:(CGFloat)zoom atIndex:(CGPoint)index darkMode:(BOOL)darkMode covering:(CGRect)needed area:(CGRect *)area
+{
+    assert([NSThread isMainThread]);
+    ARDKTileCacheKey *key = [ARDKTileCacheKey keyForPage:pageNumber atZoom:zoom atIndex:index];
+    ARDKTileCacheEntry *entry = [self entryForKey:key atZoom:zoom darkMode:darkMode covering:needed];
+    if (entry == nil)
+        return nil;
+
+    [self touch:key];
+    *area = entry.area;
+    return entry.bitmap;
+}
+
+- (void)harvestPage:(NSInteger)pageNumber atZoom:(CGFloat)zoom darkMode:(BOOL)darkMode pageArea:(CGRect)pageArea fromBitmap:(ARDKBitmap *)bm bmArea:(CGRect)bmArea
+{
+    assert([NSThread isMainThread]);
+    if (self.byteBudget == 0 || zoom <= 0)
+        return;
+
+    ARDKBitmapType bmType = bm.asBitmap.type;
+
+    CGRect range = CGRectIntegral(ARCGRectScale(bmArea, 1/TILE_SIZE));
+    for (CGFloat y = CGRectGetMinY(range); y < CGRectGetMaxY(range); y++)
+    {
+        for (CGFloat x = CGRectGetMinX(range); x < CGRectGetMaxX(range); x++)
+        {
+            CGPoint index = CGPointMake(x, y);
+            CGRect tileArea = CGRectIntersection(ARCGRectScale(CGRectMake(x, y, 1, 1), TILE_SIZE), pageArea);
+            // Only complete tiles are of use
+            if (CGRectIsEmpty(tileArea) || !CGRectContainsRect(bmArea, tileArea))
+                continue;
+
+            ARDKTileCacheKey *key = [ARDKTileCacheKey keyForPage:pageNumber atZoom:zoom atIndex:index];
+            if ([self entryForKey:key atZoom:zoom darkMode:darkMode covering:tileArea])
+            {
+                [self touch:key];
+                continue;
+            }
+
+            ARDKTileCacheEntry *entry = [[ARDKTileCacheEntry alloc] init];
+            entry.bitmap = [ARDKBitmap bitmapAtSize:tileArea.size ofType:bmType];
+            if (entry.bitmap == nil)
+                continue;
+            entry.area = tileArea;
+            entry.zoom = zoom;
+            entry.darkMode = darkMode;
+            entry.bytes = entry.bitmap.asBitmap.lineSkip * entry.bitmap.height;
+
+            // Copy now, while the caller still holds the bitmap. Once it is
+            // released, it may be reused for another render at any time
+            [entry.bitmap copyFrom:[ARDKBitmap bitmapFromSubarea:CGRectOffset(tileArea, -bmArea.origin.x, -bmArea.origin.y) ofBitmap:bm]];
+
+            [self removeEntryForKey:key];
+            self.entries[key] = entry;
+            [self.lru addObject:key];
+            self.bytes += entry.bytes;
+        }
+    }
+
+    [self trimToBudget];
+}
+
+- (void)invalidatePage:(NSInteger)pageNumber
+{
+    assert([NSThread isMainThread]);
+    for (ARDKTileCacheKey *key in self.entries.allKeys)
+    {
+        if (key.pageNumber == pageNumber)
+            [self removeEntryForKey:key];
+    }
+}
+
+- (void)clear
+{
+    [self.entries removeAllObjects];
+    [self.lru removeAllObjects];
+    self.bytes = 0;
+}
+
+#pragma mark <ARDKDocumentEventTarget>
+
+- (void)updatePageCount:(NSInteger)pageCount andLoadingComplete:(BOOL)complete
+{
+}
+
+- (void)pageSizeHasChanged
+{
+    [self clear];
+}
+
+- (void)selectionHasChanged
+{
+}
+
+- (void)layoutHasCompleted
+{
+}
+
+- (void)pageContentHasChanged:(NSInteger)pageNumber
+{
+    [self invalidatePage:pageNumber];
+}
+
+- (void)documentContentHasChanged
+{
+    [self clear];
+}
+
+@end
@@ -22,6 +22,11 @@ NS_ASSUME_NONNULL_BEGIN
 @interface ARDKViewRenderer : NSObject
 @property BOOL darkMode;
 
+/// Render quick drafts while the view is moving (renders being triggered in
+/// quick succession), replacing them with full-quality renders once it settles.
+/// Defaults to YES.
+@property BOOL draftWhileMoving;
+
 - (instancetype)initWithDelegate:(id<ARDKViewRendererDelegate>)delegate lib:(id<ARDKDoc>)ardkdoc;
 
 - (void)triggerRender;
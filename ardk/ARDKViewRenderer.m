@@ -21,6 +21,13 @@
 // Arbitrary set initial size
 #define SET_SIZE (25)
 
+// Renders triggered within this many seconds of the previous one are taken
+// to be due to scrolling or zooming, and are rendered as drafts
+#define MOVING_INTERVAL (0.1)
+// Time without a triggered render after which the view is considered settled
+// and any drafts are replaced
+#define SETTLE_DELAY (0.25)
+
 @interface ARDKViewRenderer ()
 @property BOOL firstRenderComplete;
 @property void (^afterRenderBlock)(void);
@@ -28,6 +35,9 @@
 @property int bitmapIndex;
 @property BOOL renderRequested;
 @property BOOL forceRenderRequested;
+@property BOOL draftRequested;
+@property BOOL draftRendered;
+@property CFTimeInterval lastTriggerTime;
 @property int renderCount;
 @property(weak) id<ARDKViewRendererDelegate> delegate;
 @property NSMutableSet<ARDKPageView *> *previouslyRenderedPages;
@@ -49,6 +59,7 @@
         self.delegate = delegate;
         [self createBitmaps];
         self.previousScreenRects = [NSDictionary dictionary];
+        self.draftWhileMoving = YES;
         [self forceRender];
     }
 
@@ -185,6 +196,9 @@
 
     self.forceRenderRequested = NO;
 
+    BOOL draft = self.draftRequested;
+    self.draftRequested = NO;
+
     NSMutableDictionary<NSNumber *,NSValue *> *screenRects = [NSMutableDictionary dictionary];
 
     NSMutableSet<ARDKPageView *> *renderedPages = [NSMutableSet setWithCapacity:SET_SIZE];
@@ -226,7 +240,7 @@
             // Knock out each from the previously rendered set so we can see at the end
             // which we've missed
             [self.previouslyRenderedPages removeObject:(ARDKPageView *)pageView];
-            [(ARDKPageView *)pageView displayArea:pageViewRect atScale:retinalScale usingBitmap:bm whenDone:^{
+            [(ARDKPageView *)pageView displayArea:pageViewRect atScale:retinalScale usingBitmap:bm draft:draft whenDone:^{
                 // Count down as they complete
                 self.renderCount--;
 
@@ -261,6 +275,23 @@
 
 - (void)triggerRender
 {
+    // Renders triggered in quick succession indicate that the view is moving,
+    // in which case render drafts and schedule their replacement for when
+    // the view settles
+    CFTimeInterval now = CACurrentMediaTime();
+    self.draftRequested = self.draftWhileMoving && now - self.lastTriggerTime < MOVING_INTERVAL;
+    self.lastTriggerTime = now;
+    if (self.draftRequested)
+    {
+        self.draftRendered = YES;
+        [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                                 selector:@selector(refineDrafts)
+                                                   object:nil];
+        [self performSelector:@selector(refineDrafts)
+                   withObject:nil
+                   afterDelay:SETTLE_DELAY];
+    }
+
     // Note that a render is needed
     self.renderRequested = YES;
     // If the previous render has completed, start a new one. Otherwise
@@ -269,6 +300,16 @@
         [self renderPages];
 }
 
+- (void)refineDrafts
+{
+    if (self.draftRendered)
+    {
+        self.draftRendered = NO;
+        [self forceRender];
+        [self triggerRender];
+    }
+}
+
 - (void)forceRender
 {
     self.forceRenderRequested = YES;
@@ -117,6 +117,9 @@ typedef struct ARDKBitmapInfo
 /// Adjust the use of the bitmap's buffer to a different size
 - (void) adjustToSize:(CGSize)size;
 
+/// Whether the bitmap's buffer is large enough to adjust to a size
+- (BOOL) canAdjustToSize:(CGSize)size;
+
 /// Adjust the use of the bitmap's buffer to the largest size
 /// for a given width
 - (void) adjustToWidth:(NSInteger)width;
@@ -125,6 +128,16 @@ typedef struct ARDKBitmapInfo
 ///Bitmaps must be the same size
 - (void)copyFrom:(ARDKBitmap *)otherBm;
 
+///Scale the contents of another bitmap to fill this one
+///Bitmaps must be of the same type
+- (void)scaleFrom:(ARDKBitmap *)otherBm;
+
+///Scale the contents of another bitmap by a given factor into this one,
+///with their top-left corners aligned. Where this bitmap extends beyond
+///the scaled contents, the edge pixels are repeated
+///Bitmaps must be of the same type
+- (void)scaleFrom:(ARDKBitmap *)otherBm byFactor:(CGFloat)factor;
+
 /// Return details of the bitmap as a ARDKBitmapInfo structure.
 - (ARDKBitmapInfo)asBitmap;
 
@@ -217,6 +230,15 @@ typedef struct ARDKBitmapInfo
                     intoBitmap:(ARDKBitmap *)bm
                       progress:(void (^)(ARError error))block;
 
+/// Like renderAtZoom:withDocOrigin:intoBitmap:progress: but rendering a
+/// quick, reduced-quality draft, suitable for display while the view
+/// is moving. The draft should be replaced by a normal render once the
+/// view settles.
+- (id<ARDKRender>)draftAtZoom:(CGFloat)zoom
+                withDocOrigin:(CGPoint)orig
+                   intoBitmap:(ARDKBitmap *)bm
+                     progress:(void (^)(ARError error))block;
+
 /// Kick off a render of a layer into a bitmap at a specific zoom. orig is
 /// the document origin in bitmap coordinates. The block is called on the UI
 /// thread when the render has completed.
@@ -325,6 +347,17 @@ typedef enum ARDKSaveResult
 /// Called each time a document layout operation completes.
 - (void)layoutHasCompleted;
 
+@optional
+
+/// Called when the content of a page has changed, whether or not
+/// the page is currently displayed.
+- (void)pageContentHasChanged:(NSInteger)pageNumber;
+
+/// Called when the content of any page may have changed, including pages
+/// not currently displayed or loaded, e.g., after a change of rendering
+/// profile, or a form calculation or script run.
+- (void)documentContentHasChanged;
+
 @end
 
 @protocol ARDKLib;
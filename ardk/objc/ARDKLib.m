@@ -257,6 +257,12 @@ static void darken_bitmap_888(uint8_t  *bitmap,
         [NSException raise:@"IllegalAspectAdjust" format:@"Bitmap too small to adjust to size"];
 }
 
+- (BOOL)canAdjustToSize:(CGSize)size
+{
+    size_t rowBytes = ((size_t)size.width * self.bytesPerPixel + 3) & ~3;
+    return self.parent == nil && rowBytes * (size_t)size.height <= bufSize;
+}
+
 - (void)adjustToWidth:(NSInteger)width
 {
     NSInteger height = bufSize / ((width * self.bytesPerPixel + 3) & ~3);
@@ -279,5 +285,85 @@ static void darken_bitmap_888(uint8_t  *bitmap,
     }
 }
 
+- (void)scaleFrom:(ARDKBitmap *)otherBm
+{
+    if (_bmType != otherBm->_bmType)
+        [NSException raise:@"BadBitmapScale" format:@"Attempt to scale from bitmap of different type"];
+
+    switch (_bmType)
+    {
+        case ARDKBitmapType_A8:
+            vImageScale_Planar8(&otherBm->buf16, &buf16, NULL, kvImageNoFlags);
+            break;
+
+        case ARDKBitmapType_RGB555:
+        case ARDKBitmapType_RGB565:
+        {
+            // vImage has no scaler for packed 16-bit formats, so sample the
+            // nearest pixel. Used only for drafts, so quality is unimportant
+            if (buf16.width == 0 || buf16.height == 0)
+                break;
+
+            size_t sx = (otherBm->buf16.width << 16) / buf16.width;
+            size_t sy = (otherBm->buf16.height << 16) / buf16.height;
+            for (size_t y = 0; y < buf16.height; y++)
+            {
+                uint16_t *src = (uint16_t *)((uint8_t *)otherBm->buf16.data + ((y * sy) >> 16) * otherBm->buf16.rowBytes);
+                uint16_t *tgt = (uint16_t *)((uint8_t *)buf16.data + y * buf16.rowBytes);
+                for (size_t x = 0; x < buf16.width; x++)
+                    tgt[x] = src[(x * sx) >> 16];
+            }
+            break;
+        }
+
+        case ARDKBitmapType_RGBA8888:
+            vImageScale_ARGB8888(&otherBm->buf16, &buf16, NULL, kvImageNoFlags);
+            break;
+    }
+}
+
+- (void)scaleFrom:(ARDKBitmap *)otherBm byFactor:(CGFloat)factor
+{
+    if (_bmType != otherBm->_bmType)
+        [NSException raise:@"BadBitmapScale" format:@"Attempt to scale from bitmap of different type"];
+
+    // vImage places pixel centres at integer coordinates, so the offset keeps
+    // the pixels' edges, rather than their centres, in register
+    vImage_AffineTransform transform = {factor, 0, 0, factor, (factor - 1) / 2, (factor - 1) / 2};
+
+    switch (_bmType)
+    {
+        case ARDKBitmapType_A8:
+            vImageAffineWarp_Planar8(&otherBm->buf16, &buf16, NULL, &transform, 0, kvImageEdgeExtend);
+            break;
+
+        case ARDKBitmapType_RGB555:
+        case ARDKBitmapType_RGB565:
+        {
+            // As for scaleFrom:, sample the nearest pixel
+            if (otherBm->buf16.width == 0 || otherBm->buf16.height == 0)
+                break;
+
+            size_t step = (size_t)(65536 / factor);
+            for (size_t y = 0; y < buf16.height; y++)
+            {
+                size_t sy = MIN((y * step) >> 16, otherBm->buf16.height - 1);
+                uint16_t *src = (uint16_t *)((uint8_t *)otherBm->buf16.data + sy * otherBm->buf16.rowBytes);
+                uint16_t *tgt = (uint16_t *)((uint8_t *)buf16.data + y * buf16.rowBytes);
+                for (size_t x = 0; x < buf16.width; x++)
+                    tgt[x] = src[MIN((x * step) >> 16, otherBm->buf16.width - 1)];
+            }
+            break;
+        }
+
+        case ARDKBitmapType_RGBA8888:
+        {
+            Pixel_8888 background = {0, 0, 0, 0};
+            vImageAffineWarp_ARGB8888(&otherBm->buf16, &buf16, NULL, &transform, background, kvImageEdgeExtend);
+            break;
+        }
+    }
+}
+
 @end
 
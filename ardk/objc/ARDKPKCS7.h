@@ -49,12 +49,21 @@ typedef enum
 // Announce the start of a signing request before sending the data to sign
 - (void)begin;
 
-// Send a chunk of the data to be signed (may be called repeatedly)
+// Send a chunk of the data to be signed (may be called repeatedly). The
+// data may reference the caller's buffer, and so is valid only for the
+// duration of the call
 - (void)data:(NSData *)data;
 
 // Announce the end of the data and request the signature
 - (NSData *)sign;
 
+@optional
+
+// Get an upper bound on the length of the signatures that sign will return.
+// Signers that don't implement this, or return 0, are sized by producing a
+// signature of no data, which costs an extra private key operation
+- (NSUInteger)maxSignatureSize;
+
 @end
 
 @protocol PKCS7Verifier <NSObject>
@@ -74,6 +83,19 @@ typedef enum
 // Get the signers certificate description from the signature
 - (id<PKCS7Description>)description:(NSData *)signature;
 
+@optional
+
+// Announce the start of a verification request, in place of begin, for
+// verifiers that can make use of knowing the signature in advance
+- (void)begin:(NSData *)signature;
+
+// Create a verifier for "signature" that continues from the data sent to this
+// one since begin, as though it had itself been begun and sent that data.
+// Lets signatures over a common prefix of a file share its digesting. Returns
+// nil if this verifier's state cannot serve for the signature, such as when
+// begun for a signature using a different digest algorithm
+- (nullable id<PKCS7Verifier>)forkFor:(NSData *)signature;
+
 @end
 
 NS_ASSUME_NONNULL_END
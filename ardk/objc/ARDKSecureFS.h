@@ -34,6 +34,16 @@ NS_ASSUME_NONNULL_BEGIN
 
 - (unsigned long long)ARDKSecureFS_seekToEndOfFile;
 
+@optional
+
+/// As ARDKSecureFS_writeData:, except that the data passed references the
+/// caller's buffers, and so is valid only for the duration of the call. It
+/// must be copied if it needs to be kept.
+///
+/// Implementing this avoids a copy of each buffer written while saving. If
+/// not implemented, the data is copied and passed to ARDKSecureFS_writeData:.
+- (void)ARDKSecureFS_writeTransientData:(NSData *)data;
+
 @end
 
 
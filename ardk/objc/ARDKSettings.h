@@ -28,4 +28,38 @@
 
 @property (strong) id<ARDKSecureFS> _Nullable secureFs;
 
+/// The size of the blocks in which documents are read via secureFs
+///
+/// Each block is a single call to ARDKSecureFS_readDataOfLength:, so larger
+/// blocks mean fewer calls, at the cost of memory. Defaults to 256KB.
+@property NSUInteger secureFsReadBlockSize;
+
+/// The number of bytes of recently read blocks to cache per secureFs handle
+///
+/// PDF parsing jumps around the file, so caching saves rereading, and
+/// decrypting, the same areas. Blocks are discarded least recently used
+/// first. Defaults to 8MB.
+@property NSUInteger secureFsBlockCacheSize;
+
+/// The size of the buffer in which writes via secureFs are gathered
+///
+/// Each full buffer is a single write to the secureFs handle, so larger
+/// buffers mean fewer calls, at the cost of memory. Defaults to 1MB.
+@property NSUInteger secureFsWriteBufferSize;
+
+/// Whether to open documents not held in secureFs via a memory mapping
+///
+/// Object data is then read directly from the OS page cache, rather than
+/// through stdio buffers. Documents that cannot be mapped are read from
+/// file as usual. Defaults to NO.
+@property BOOL mapLocalFiles;
+
+/// Whether to read the next block via secureFs in the background
+///
+/// This speeds up sequential scans of documents, such as when repairing a
+/// document or when searching. The handles returned by secureFs must
+/// then be usable from a thread other than the one on which they were
+/// created. Defaults to NO.
+@property BOOL secureFsReadAhead;
+
 @end
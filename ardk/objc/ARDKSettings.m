@@ -2,6 +2,22 @@
 
 #import "ARDKSettings.h"
 
+#define DEFAULT_READ_BLOCK_SIZE (256 * 1024)
+#define DEFAULT_BLOCK_CACHE_SIZE (8 * 1024 * 1024)
+#define DEFAULT_WRITE_BUFFER_SIZE (1024 * 1024)
+
 @implementation ARDKSettings
 
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _secureFsReadBlockSize = DEFAULT_READ_BLOCK_SIZE;
+        _secureFsBlockCacheSize = DEFAULT_BLOCK_CACHE_SIZE;
+        _secureFsWriteBufferSize = DEFAULT_WRITE_BUFFER_SIZE;
+    }
+    return self;
+}
+
 @end
@@ -3,7 +3,9 @@
 #import <Foundation/Foundation.h>
 #include "pdf_signer.h"
 
-#define BUF_LEN (4096)
+// Large enough that the per-chunk overhead of passing the data to
+// the Objective-C signer is insignificant
+#define BUF_LEN (1024 * 1024)
 #define SAFETY_NET (100)
 
 typedef struct
@@ -11,6 +13,7 @@ typedef struct
     pdf_pkcs7_signer base;
     fz_context *ctx;
     int refs;
+    size_t max_digest_size;
     void *objCSigner;
 } signer_internal;
 
@@ -60,45 +63,64 @@ static size_t signer_max_digest_size(fz_context *ctx, pdf_pkcs7_signer *signer)
 {
     signer_internal *isigner = (signer_internal *)signer;
     size_t res = 0;
+    if (isigner->max_digest_size)
+        return isigner->max_digest_size;
+
     @autoreleasepool
     {
         id<PKCS7Signer> objCSigner = (__bridge id<PKCS7Signer>)isigner->objCSigner;
-        [objCSigner begin];
+        if ([objCSigner respondsToSelector:@selector(maxSignatureSize)])
+            res = [objCSigner maxSignatureSize];
 
-        NSData *digestData = [objCSigner sign];
-        res = digestData.length;
+        // A signer unable to give a bound is sized by measurement instead
+        if (res == 0)
+        {
+            [objCSigner begin];
+
+            NSData *digestData = [objCSigner sign];
+            res = digestData.length;
+        }
     }
 
-    return res + SAFETY_NET;
+    // A failure to produce any signature is not cached, so that a
+    // later call can try again
+    if (res == 0)
+        return 0;
+
+    isigner->max_digest_size = res + SAFETY_NET;
+    return isigner->max_digest_size;
 }
 
 static int signer_create_digest(fz_context *ctx, pdf_pkcs7_signer *signer, fz_stream *in, unsigned char *digest, size_t digest_len)
 {
     signer_internal *isigner = (signer_internal *)signer;
     int res = 0;
+    size_t signature_len = 0;
     @autoreleasepool
     {
         id<PKCS7Signer> objCSigner = (__bridge id<PKCS7Signer>)isigner->objCSigner;
+        // One buffer serves for every chunk, each passed to the signer as a
+        // view that it must not retain beyond the call
+        NSMutableData *buf = [NSMutableData dataWithLength:BUF_LEN];
         [objCSigner begin];
         for (;;)
         {
-            NSMutableData *data = [NSMutableData dataWithLength:BUF_LEN];
             size_t n = 0;
             fz_try(ctx)
             {
-                n = fz_read(ctx, in, data.mutableBytes, BUF_LEN);
-                data.length = n;
+                n = fz_read(ctx, in, buf.mutableBytes, BUF_LEN);
             }
             fz_catch(ctx)
             {
             }
 
             if (n > 0)
-                [objCSigner data:data];
+                [objCSigner data:[NSData dataWithBytesNoCopy:buf.mutableBytes length:n freeWhenDone:NO]];
             else
                 break;
         }
         NSData *digestData = [objCSigner sign];
+        signature_len = digestData.length;
         if (digestData.length <= digest_len)
         {
             memcpy(digest, digestData.bytes, digestData.length);
@@ -106,6 +128,11 @@ static int signer_create_digest(fz_context *ctx, pdf_pkcs7_signer *signer, fz_st
         }
     }
 
+    // Rather than write a truncated or empty signature, fail the save. Thrown
+    // outside the autorelease pool, which must not be jumped out of
+    if (signature_len > digest_len)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "signature of %d bytes exceeds the %d reserved", (int)signature_len, (int)digest_len);
+
     return res;
 }
 
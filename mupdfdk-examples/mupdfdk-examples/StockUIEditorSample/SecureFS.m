@@ -38,6 +38,12 @@
     [_fh writeData:data];
 }
 
+- (void)ARDKSecureFS_writeTransientData:(NSData *)data
+{
+    // NSFileHandle writes synchronously, without keeping the data
+    [_fh writeData:data];
+}
+
 - (void)ARDKSecureFS_seekToFileOffset:(unsigned long long)offset
 {
     [_fh seekToFileOffset:offset];
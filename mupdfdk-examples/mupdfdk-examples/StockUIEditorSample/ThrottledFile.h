@@ -0,0 +1,24 @@
+//
+//  ThrottledFile.h
+//  smart-office-nui
+//
+//  Example progressive source that reveals a local file gradually, at
+//  a fixed rate, as a stand-in for a slow copy or download when
+//  exercising progressive loading.
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import <mupdfdk/mupdfdk.h>
+
+NS_ASSUME_NONNULL_BEGIN
+
+@interface ThrottledFile : NSObject<MuPDFDKProgressiveSource>
+
+/// Create a source for a file, which starts arriving immediately, at the
+/// specified number of bytes per second. Returns nil if the file cannot be read.
+- (nullable instancetype)initWithPath:(NSString *)path bytesPerSecond:(NSUInteger)rate;
+
+@end
+
+NS_ASSUME_NONNULL_END
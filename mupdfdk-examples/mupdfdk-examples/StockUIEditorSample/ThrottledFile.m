@@ -0,0 +1,67 @@
+//
+//  ThrottledFile.m
+//  smart-office-nui
+//
+//  Copyright © 2020 Artifex Software Inc. All rights reserved.
+//
+
+#import "ThrottledFile.h"
+
+@interface ThrottledFile ()
+@property NSFileHandle *handle;
+@property NSUInteger rate;
+@property NSDate *start;
+@end
+
+@implementation ThrottledFile
+
+@synthesize length = _length;
+
+- (instancetype)initWithPath:(NSString *)path bytesPerSecond:(NSUInteger)rate
+{
+    self = [super init];
+    if (self)
+    {
+        _handle = [NSFileHandle fileHandleForReadingAtPath:path];
+        if (_handle == nil || rate == 0)
+            return nil;
+
+        _length = (int64_t)[_handle seekToEndOfFile];
+        _rate = rate;
+        _start = [NSDate date];
+    }
+
+    return self;
+}
+
+- (int64_t)bytesAvailable
+{
+    double arrived = -self.start.timeIntervalSinceNow * self.rate;
+    return (int64_t)MIN(arrived, (double)self.length);
+}
+
+- (NSData *)readDataAtOffset:(int64_t)offset length:(NSUInteger)length
+{
+    @synchronized (self.handle)
+    {
+        [self.handle seekToFileOffset:offset];
+        return [self.handle readDataOfLength:length];
+    }
+}
+
+- (void)whenMoreThan:(int64_t)count call:(void (^)(void))block
+{
+    if (self.bytesAvailable > count || count >= self.length)
+    {
+        block();
+        return;
+    }
+
+    NSTimeInterval due = (double)(count + 1) / self.rate + self.start.timeIntervalSinceNow;
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MAX(due, 0) * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        [self whenMoreThan:count call:block];
+    });
+}
+
+@end
@@ -98,7 +98,10 @@ typedef enum
 /// Class representing the positions of the characters within a line of text
 @interface MuPDFDKTextLayoutLine : NSObject
 @property(readonly) CGRect lineRect;
-@property(readonly) NSArray<NSValue *> *charRects;
+/// The character rectangles, packed as an array of CGRect
+@property(readonly) NSData *charRectData;
+@property(readonly) NSInteger charCount;
+- (CGRect)charRectAt:(NSInteger)index;
 @end
 
 /// Class representing an annotations positon and type
@@ -140,6 +143,11 @@ typedef enum
 // applied only on the final update.
 @property (nonnull, copy) BOOL (^setText)(NSString *text, BOOL final);
 @property (nonnull, copy) NSArray<MuPDFDKTextLayoutLine *> *(^getTextLayout)(void);
+// Non-final update of the widget's text followed by layout of the result, performed
+// asynchronously so that typing isn't held up while the background queue is busy
+// rendering. The layout is passed to the block on the main queue. The whole text
+// is laid out on each update.
+@property (nonnull, copy) void (^updateTextAndLayout)(NSString *text, void (^result)(NSArray<MuPDFDKTextLayoutLine *> *layout));
 @end
 
 /// Class representing list and choice widgets
@@ -262,6 +270,23 @@ typedef enum
 
 @end
 
+/// Protocol for sources of documents whose content arrives progressively,
+/// from the start of the file onwards, such as those being copied or
+/// downloaded. Linearized PDF files can then be displayed, a page at a
+/// time, before they have fully arrived.
+@protocol MuPDFDKProgressiveSource <NSObject>
+/// The length of the file, once it has fully arrived
+@property(readonly) int64_t length;
+/// The number of bytes, from the start of the file, available so far
+@property(readonly) int64_t bytesAvailable;
+/// Read part of the file, which must lie within the bytes available.
+/// Called on a background thread.
+- (NSData *)readDataAtOffset:(int64_t)offset length:(NSUInteger)length;
+/// Call a block, on any thread, once more than count bytes are available,
+/// or once the file has fully arrived
+- (void)whenMoreThan:(int64_t)count call:(void (^)(void))block;
+@end
+
 /// Class representing a PDF document while being viewed or altered
 @interface MuPDFDKDoc : NSObject<ARDKDoc>
 /// Author string used when creating annotations
@@ -276,6 +301,32 @@ typedef enum
 @property MuPDFPrintProfile printProfile;
 /// The soft profile currently in use
 @property ARDKSoftProfile softProfile;
+/// Whether incremental saves back to the document's own file append the
+/// changes to it in place, rather than appending them to a copy that then
+/// replaces the original. The cost of such saves is then proportional to
+/// the size of the changes since the last save. Should the document be
+/// edited while a save is in progress, though, the next save appends again
+/// the changes that one saved, along with the new ones. A journal kept
+/// alongside the file allows an interrupted save to be rolled back when the
+/// document is next opened. Defaults to NO.
+@property BOOL saveInPlace;
+/// Whether to record edits, shortly after they are made, in a journal held in
+/// the temporary directory. Should the session end without the edits being
+/// saved, they are recovered when the document is next loaded. Edits are
+/// recorded as the incremental update that saving them would append, each
+/// record holding all those not yet saved, so the cost of recording grows
+/// with the size of the unsaved edits, not just the latest. Signatures are
+/// applied only on saving, and so are not recorded. Edits to a document
+/// within the secure FS are recorded only if the temporary directory is also
+/// within it. Must be set before the document is loaded. Defaults to NO.
+@property BOOL journalEdits;
+/// Whether edits from a previous session were recovered from the journal on
+/// loading, in which case the document is marked as modified
+@property(readonly) BOOL recoveredFromJournal;
+/// Whether to index the form fields of every page as the document loads, so
+/// that formFieldQuads: can answer without visiting each page. Must be set
+/// before the document is loaded. Defaults to NO.
+@property BOOL indexFormFields;
 /// Callback that can be set so as to monitor changes
 /// in what is currently selected
 @property(nullable, copy) void (^onSelectionChanged)(void);
@@ -306,6 +357,47 @@ typedef enum
 /// by Javascript code within the document
 @property(nullable, copy) void (^onAlert)(MuPDFAlert *alert);
 
+/// Start a save operation, reporting progress as the fraction of the file
+/// written. The changes are snapshotted up front, so rendering and editing
+/// can continue while the file is written. Edits made meanwhile are left
+/// for the next save.
+- (void)saveTo:(NSString *)path
+      progress:(nullable void (^)(CGFloat fraction))progress
+    completion:(void (^)(ARDKSaveResult res, ARError err))block;
+
+/// Save a compacted copy of the document, rewriting the whole file: unused
+/// objects are dropped, duplicates merged, and uncompressed streams deflated,
+/// with the compression spread across cores. Useful for shrinking documents
+/// before sharing. The size of the file written and the time taken are
+/// reported. Rewriting invalidates any existing signatures.
+- (void)compactTo:(NSString *)path
+       completion:(void (^)(ARDKSaveResult res, ARError err, unsigned long long size, NSTimeInterval time))block;
+
+/// Verify every signed signature field of the document, each with its own
+/// verifier obtained from makeVerifier, which is called on a background
+/// thread. The document is read once, with the data feeding every signature
+/// whose byte range covers it, and the signatures are then checked
+/// concurrently. Results are reported on the UI thread as each check
+/// completes, identified by page number and field rectangle, followed by a
+/// call to completion.
+- (void)verifyAllSignatures:(id<PKCS7Verifier> (^)(void))makeVerifier
+                   onResult:(void (^)(NSInteger pageNumber,
+                                      CGRect rect,
+                                      PKCS7VerifyResult r,
+                                      int invalidChangePoint,
+                                      id<PKCS7DesignatedName> _Nullable name,
+                                      id<PKCS7Description> _Nullable description))result
+                 completion:(void (^)(void))completion;
+
+/// Abandon the save in progress, if any, which then completes with
+/// ARDKSave_Cancelled, leaving the file as it was. Has no effect once
+/// the file has been replaced.
+- (void)cancelSave;
+
+/// Obtain the quads bounding the active form fields of every page that has
+/// any, keyed by page number. The block is called on the UI thread.
+- (void)formFieldQuads:(void (^)(NSDictionary<NSNumber *, NSArray<MuPDFDKQuad *> *> *quadsByPage))block;
+
 /// Remove the focus from the current focussed form field, if
 /// any
 - (void)clearFocus;
@@ -372,6 +464,16 @@ typedef enum
 
 /// Class representing the MuPDF render library
 @interface MuPDFDKLib : NSObject<ARDKLib>
+
+/// Create a document whose content is arriving progressively. Pages are
+/// reported as they become available, rather than once the whole file has
+/// arrived, which for linearized PDF files means the first page can be shown
+/// almost immediately. path is the location at which the file will be once
+/// complete. The document must not be saved until loading has completed.
+- (MuPDFDKDoc *)docForSource:(id<MuPDFDKProgressiveSource>)source
+                      atPath:(NSString *)path
+                      ofType:(ARDKDocType)docType;
+
 @end
 
 NS_ASSUME_NONNULL_END
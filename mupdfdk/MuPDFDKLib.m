@@ -15,6 +15,9 @@
 #import "MuPDFDKLib.h"
 
 #include "TargetConditionals.h"
+#include <pthread.h>
+#include <zlib.h>
+#include <CommonCrypto/CommonDigest.h>
 
 #if (TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR)
 #if !defined(SODK_EXCLUDE_OPENSSL_PDF_SIGNING)
@@ -25,6 +28,23 @@
 #import <openssl/err.h>
 #pragma clang diagnostic pop
 
+// OpenSSL 1.0.2 relies on the application for locking, without which separate
+// verifiers can't safely be used on separate threads at the same time
+static pthread_mutex_t *openssl_mutexes;
+
+static void openssl_lock(int mode, int type, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&openssl_mutexes[type]);
+    else
+        pthread_mutex_unlock(&openssl_mutexes[type]);
+}
+
+static void openssl_thread_id(CRYPTO_THREADID *tid)
+{
+    CRYPTO_THREADID_set_pointer(tid, pthread_self());
+}
+
 #endif // SODK_EXCLUDE_OPENSSL_PDF_SIGNING
 #endif // (TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR)
 
@@ -38,12 +58,54 @@
 #define SEMI_TRANSPARENT (0.5)
 
 #define UPDATE_BITMAP_PROPORTION (6)
+// Drafts are rendered at reduced resolution, with fewer bits of antialiasing,
+// and then scaled up. Rendering at the lower resolution also has the draw
+// device pick subsampled versions of images.
+#define DRAFT_RESOLUTION_PROPORTION (0.5)
+#define DRAFT_AA_LEVEL (2)
+// Size of the blocks in which files are copied when saving
+#define SAVE_COPY_BLOCK_SIZE (1024 * 1024)
+// Delay after an edit before it is recorded in the edit journal, so
+// that bursts of edits are recorded together
+#define JOURNAL_DELAY (1.0)
+// Size beyond which the edit journal is restarted from its latest record
+#define JOURNAL_COMPACT_SIZE (1024 * 1024)
+#define JOURNAL_MAGIC "MJN2"
+// Identity of the file to which a journal record applies: its length,
+// modification time, and a SHA-256 digest of its final bytes
+#define JOURNAL_IDENTITY_SIZE (8 + 8 + CC_SHA256_DIGEST_LENGTH)
+// Number of bytes at the end of the file digested for its identity. These
+// include the file's final xref and trailer, which any change would alter.
+#define JOURNAL_IDENTITY_SPAN (64 * 1024)
+// Magic, base file identity and update length
+#define JOURNAL_HEADER_SIZE (4 + JOURNAL_IDENTITY_SIZE + 8)
+// Maximum bytes of uncompressed stream data held at once while compacting
+#define COMPACT_BATCH_SIZE (32 * 1024 * 1024)
 #define INITIAL_FZPAGE_CACHE_SIZE (500)
+// Size of the reads made while feeding document data to signature verifiers
+#define VERIFY_BLOCK_SIZE (1024 * 1024)
 
 static float highlight_color[] = {1.0, 1.0, 0.0};
 
 static const char *queue_label = "com.artifex.mupdf.background";
 
+// Locking for the mupdf context. Most work is performed on the serial
+// queue above, but the context is cloned for use on other threads to
+// render strips of updates in parallel.
+static pthread_mutex_t mupdf_mutexes[FZ_LOCK_MAX];
+
+static void mupdf_lock(void *user, int lock)
+{
+    pthread_mutex_lock(&mupdf_mutexes[lock]);
+}
+
+static void mupdf_unlock(void *user, int lock)
+{
+    pthread_mutex_unlock(&mupdf_mutexes[lock]);
+}
+
+static fz_locks_context mupdf_locks = {NULL, mupdf_lock, mupdf_unlock};
+
 static NSString * const documentAuthorKey = @"DocAuthKey";
 
 
@@ -153,6 +215,329 @@ static fz_stext_page *stext_for_page(fz_context *ctx, fz_page *page)
     return text;
 }
 
+// Device used to find whether a display list starts with an opaque fill
+// (typically the page image of a scanned document, or a page-sized background
+// rectangle). Rendering is aborted, via the cookie, as soon as the first
+// content is seen, so the cost is that of interpreting a single node.
+typedef struct
+{
+    fz_device super;
+    fz_cookie *cookie;
+    fz_rect covered;
+} opaque_device;
+
+typedef struct
+{
+    int moves;
+    int lines;
+    int rects;
+    fz_point pts[5];
+} rect_walker_state;
+
+static void rect_walker_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+    rect_walker_state *s = arg;
+    if (s->moves++ == 0)
+        s->pts[0] = fz_make_point(x, y);
+}
+
+static void rect_walker_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+    rect_walker_state *s = arg;
+    if (++s->lines < 5)
+        s->pts[s->lines] = fz_make_point(x, y);
+}
+
+static void rect_walker_curveto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2, float x3, float y3)
+{
+    rect_walker_state *s = arg;
+    s->lines = 5; // Any curve disqualifies the path
+}
+
+static void rect_walker_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+    rect_walker_state *s = arg;
+    s->rects++;
+}
+
+static const fz_path_walker rect_walker =
+{
+    rect_walker_moveto,
+    rect_walker_lineto,
+    rect_walker_curveto,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    rect_walker_rectto
+};
+
+// Whether a path is a single axis-aligned rectangle of non-zero area, and so
+// entirely fills its bounds
+static int path_is_rect(fz_context *ctx, const fz_path *path)
+{
+    rect_walker_state s = {0};
+    fz_rect bounds;
+
+    fz_walk_path(ctx, path, &rect_walker, &s);
+    if (s.rects == 0 && s.moves == 0)
+        return 0;
+
+    bounds = fz_bound_path(ctx, path, NULL, fz_identity);
+    if (!(bounds.x0 < bounds.x1 && bounds.y0 < bounds.y1))
+        return 0;
+
+    if (s.rects == 1)
+        return s.moves <= 1 && s.lines == 0;
+
+    if (s.rects != 0 || s.moves != 1 || s.lines < 3 || s.lines > 4)
+        return 0;
+
+    // A fifth point must return to the first, leaving four corners. Filling
+    // closes the path implicitly, from the last corner back to the first.
+    if (s.lines == 4 && (s.pts[4].x != s.pts[0].x || s.pts[4].y != s.pts[0].y))
+        return 0;
+
+    // The corners must be the four distinct corners of the bounds
+    int seen = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int xi = s.pts[i].x == bounds.x0 ? 0 : s.pts[i].x == bounds.x1 ? 1 : -1;
+        int yi = s.pts[i].y == bounds.y0 ? 0 : s.pts[i].y == bounds.y1 ? 2 : -1;
+        if (xi < 0 || yi < 0 || (seen & (1 << (xi + yi))))
+            return 0;
+        seen |= 1 << (xi + yi);
+    }
+
+    // Each edge, including the closing one, must be horizontal or vertical
+    for (int i = 0; i < 4; i++)
+    {
+        fz_point a = s.pts[i], b = s.pts[(i + 1) % 4];
+        if (a.x != b.x && a.y != b.y)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int matrix_is_rectilinear(fz_matrix m)
+{
+    return (m.b == 0 && m.c == 0) || (m.a == 0 && m.d == 0);
+}
+
+static void opaque_dev_stop(fz_context *ctx, fz_device *dev)
+{
+    ((opaque_device *)dev)->cookie->abort = 1;
+}
+
+static void opaque_dev_fill_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opaque_device *odev = (opaque_device *)dev;
+    if (alpha == 1 && matrix_is_rectilinear(ctm) && path_is_rect(ctx, path))
+        odev->covered = fz_bound_path(ctx, path, NULL, ctm);
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_fill_image(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opaque_device *odev = (opaque_device *)dev;
+    if (alpha == 1 && matrix_is_rectilinear(ctm)
+        && image->mask == NULL && !image->use_colorkey && !image->imagemask
+        && image->colorspace && image->n == fz_colorspace_n(ctx, image->colorspace))
+        odev->covered = fz_transform_rect(fz_unit_rect, ctm);
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_clip_path(fz_context *ctx, fz_device *dev, const fz_path *path, int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_clip_stroke_path(fz_context *ctx, fz_device *dev, const fz_path *path, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_fill_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_clip_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm, fz_rect scissor)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_clip_stroke_text(fz_context *ctx, fz_device *dev, const fz_text *text, const fz_stroke_state *stroke, fz_matrix ctm, fz_rect scissor)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_ignore_text(fz_context *ctx, fz_device *dev, const fz_text *text, fz_matrix ctm)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_fill_shade(fz_context *ctx, fz_device *dev, fz_shade *shd, fz_matrix ctm, float alpha, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_fill_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_colorspace *cs, const float *color, float alpha, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_clip_image_mask(fz_context *ctx, fz_device *dev, fz_image *image, fz_matrix ctm, fz_rect scissor)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_begin_mask(fz_context *ctx, fz_device *dev, fz_rect area, int luminosity, fz_colorspace *cs, const float *bc, fz_color_params cp)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static void opaque_dev_begin_group(fz_context *ctx, fz_device *dev, fz_rect area, fz_colorspace *cs, int isolated, int knockout, int blendmode, float alpha)
+{
+    opaque_dev_stop(ctx, dev);
+}
+
+static int opaque_dev_begin_tile(fz_context *ctx, fz_device *dev, fz_rect area, fz_rect view, float xstep, float ystep, fz_matrix ctm, int id)
+{
+    opaque_dev_stop(ctx, dev);
+    return 1;
+}
+
+// Return the area of the page, in page space, that is completely covered
+// by the first item of the display list, or an empty rect if there is no
+// such opaque item.
+static fz_rect opaque_area_for_list(fz_context *ctx, fz_display_list *list)
+{
+    fz_cookie cookie = {0};
+    opaque_device *dev = NULL;
+    fz_rect covered = fz_empty_rect;
+
+    fz_var(dev);
+    fz_try(ctx)
+    {
+        dev = fz_new_derived_device(ctx, opaque_device);
+        dev->cookie = &cookie;
+        dev->covered = fz_empty_rect;
+        dev->super.fill_path = opaque_dev_fill_path;
+        dev->super.stroke_path = opaque_dev_stroke_path;
+        dev->super.clip_path = opaque_dev_clip_path;
+        dev->super.clip_stroke_path = opaque_dev_clip_stroke_path;
+        dev->super.fill_text = opaque_dev_fill_text;
+        dev->super.stroke_text = opaque_dev_stroke_text;
+        dev->super.clip_text = opaque_dev_clip_text;
+        dev->super.clip_stroke_text = opaque_dev_clip_stroke_text;
+        dev->super.ignore_text = opaque_dev_ignore_text;
+        dev->super.fill_shade = opaque_dev_fill_shade;
+        dev->super.fill_image = opaque_dev_fill_image;
+        dev->super.fill_image_mask = opaque_dev_fill_image_mask;
+        dev->super.clip_image_mask = opaque_dev_clip_image_mask;
+        dev->super.begin_mask = opaque_dev_begin_mask;
+        dev->super.begin_group = opaque_dev_begin_group;
+        dev->super.begin_tile = opaque_dev_begin_tile;
+        fz_run_display_list(ctx, list, &dev->super, fz_identity, fz_infinite_rect, &cookie);
+        fz_close_device(ctx, &dev->super);
+        covered = dev->covered;
+    }
+    fz_always(ctx)
+    {
+        fz_drop_device(ctx, &dev->super);
+    }
+    fz_catch(ctx)
+    {
+        covered = fz_empty_rect;
+    }
+
+    return covered;
+}
+
+// Clear to white the parts of a pixmap not covered by a page-space area
+static void clear_pixmap_outside(fz_context *ctx, fz_pixmap *pixmap, fz_rect covered, fz_matrix ctm)
+{
+    fz_irect whole = fz_pixmap_bbox(ctx, pixmap);
+    fz_irect inner = fz_empty_irect;
+
+    if (!fz_is_empty_rect(covered))
+    {
+        covered = fz_intersect_rect(fz_transform_rect(covered, ctm), fz_rect_from_irect(whole));
+        // Round inwards so that antialiased edge pixels are still cleared
+        if (!fz_is_empty_rect(covered))
+            inner = fz_make_irect(ceilf(covered.x0), ceilf(covered.y0), floorf(covered.x1), floorf(covered.y1));
+    }
+
+    if (fz_is_empty_irect(inner))
+    {
+        fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
+        return;
+    }
+
+    if (inner.y0 > whole.y0)
+        fz_clear_pixmap_rect_with_value(ctx, pixmap, 0xFF, fz_make_irect(whole.x0, whole.y0, whole.x1, inner.y0));
+    if (inner.y1 < whole.y1)
+        fz_clear_pixmap_rect_with_value(ctx, pixmap, 0xFF, fz_make_irect(whole.x0, inner.y1, whole.x1, whole.y1));
+    if (inner.x0 > whole.x0)
+        fz_clear_pixmap_rect_with_value(ctx, pixmap, 0xFF, fz_make_irect(whole.x0, inner.y0, inner.x0, inner.y1));
+    if (inner.x1 < whole.x1)
+        fz_clear_pixmap_rect_with_value(ctx, pixmap, 0xFF, fz_make_irect(inner.x1, inner.y0, whole.x1, inner.y1));
+}
+
+// Render a display list into a bitmap. opaque is the area of the page
+// known to be covered by opaque content, as returned by opaque_area_for_list
+static int render_list(fz_context *ctx, fz_display_list *list, fz_rect opaque, float zoom, CGPoint orig, ARDKBitmapInfo bmInfo)
+{
+    fz_pixmap *pixmap = NULL;
+    fz_device *dev = NULL;
+    fz_matrix matrix;
+    int err = 0;
+
+    fz_var(pixmap);
+    fz_var(dev);
+    fz_var(err);
+
+    fz_try(ctx)
+    {
+        // FIXME: Make render account for profiles
+        // MuPDFPrintProfile printProfile = self.doc.printProfile;
+        // ARDKSoftProfile softProfile = self.doc.softProfile;
+
+        pixmap = fz_new_pixmap_with_data(ctx, fz_device_rgb(ctx), bmInfo.width, bmInfo.height, NULL, 1, bmInfo.lineSkip, bmInfo.memptr);
+        matrix = fz_pre_scale(fz_translate(orig.x, orig.y), zoom, zoom);
+        // Pages that start with an opaque fill, e.g. scanned pages, overwrite
+        // most of the bitmap anyway, so clear only the parts left uncovered
+        clear_pixmap_outside(ctx, pixmap, opaque, matrix);
+        dev = fz_new_draw_device(ctx, matrix, pixmap);
+        fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, NULL);
+        fz_close_device(ctx, dev);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_pixmap(ctx, pixmap);
+        fz_drop_device(ctx, dev);
+    }
+    fz_catch(ctx)
+    {
+        err = 1;
+    }
+
+    return err;
+}
+
 static int widget_is_visible(fz_context *ctx, pdf_widget *widget)
 {
     return pdf_signature_is_signed(ctx, widget->page->doc, widget->obj)
@@ -186,67 +571,172 @@ static pdf_obj *get_fields(fz_context *ctx, pdf_document *doc)
     return fields;
 }
 
-static pdf_obj *get_field_names(fz_context *ctx, pdf_document *doc)
+static NSString *string_from_utf8(const char *str)
 {
-    pdf_obj *fields = get_fields(ctx, doc);
-    int n = pdf_array_len(ctx, fields);
-    pdf_obj *field_names = NULL;
-    char *name = NULL;
-    fz_var(field_names);
-    fz_var(name);
-    fz_try(ctx)
+    NSString *string = str ? [NSString stringWithUTF8String:str] : nil;
+    return string ? string : @"";
+}
+
+// Hashed index of the fully-qualified names of a document's form fields,
+// giving the object numbers of each field's widgets. Built with one walk of
+// the field tree, and thereafter kept up to date as fields are created and
+// deleted. Used only on the mupdf queue.
+@interface MuPDFDKFieldIndex : NSObject
+@end
+
+@implementation MuPDFDKFieldIndex
+{
+    NSMutableDictionary<NSString *, NSMutableArray<NSNumber *> *> *_widgetsByName;
+    NSMutableDictionary<NSNumber *, NSString *> *_namesByWidget;
+}
+
+- (instancetype)initForDoc:(pdf_document *)doc ctx:(fz_context *)ctx
+{
+    self = [super init];
+    if (self)
     {
-        int i;
-        field_names = pdf_new_array(ctx, doc, n);
-        for (i = 0; i < n; i++)
+        _widgetsByName = [NSMutableDictionary dictionary];
+        _namesByWidget = [NSMutableDictionary dictionary];
+
+        pdf_obj *fields = get_fields(ctx, doc);
+        fz_try(ctx)
         {
-            name = pdf_field_name(ctx, pdf_array_get(ctx, fields, i));
-            pdf_array_push_drop(ctx, field_names, pdf_new_name(ctx, name));
-            fz_free(ctx, name);
-            name = NULL;
+            int n = pdf_array_len(ctx, fields);
+            for (int i = 0; i < n; i++)
+                [self addWidget:pdf_array_get(ctx, fields, i) ctx:ctx];
+        }
+        fz_always(ctx)
+        {
+            pdf_drop_obj(ctx, fields);
+        }
+        fz_catch(ctx)
+        {
+            fz_rethrow(ctx);
         }
     }
-    fz_always(ctx)
+    return self;
+}
+
+- (void)addWidget:(pdf_obj *)widget ctx:(fz_context *)ctx
+{
+    NSNumber *num = @(pdf_to_num(ctx, widget));
+    char *str = pdf_field_name(ctx, widget);
+    NSString *name = string_from_utf8(str);
+    fz_free(ctx, str);
+
+    if (_widgetsByName[name] == nil)
+        _widgetsByName[name] = [NSMutableArray array];
+    [_widgetsByName[name] addObject:num];
+    _namesByWidget[num] = name;
+}
+
+// Forget a widget that is being deleted. Its name remains reserved even once no
+// widgets have it, since deleting a widget removes it from the page's /Annots
+// but not from /AcroForm/Fields, where the field still holds the name
+- (void)removeWidget:(pdf_obj *)widget ctx:(fz_context *)ctx
+{
+    NSNumber *num = @(pdf_to_num(ctx, widget));
+    NSString *name = _namesByWidget[num];
+    if (name == nil)
+        return;
+
+    [_namesByWidget removeObjectForKey:num];
+    [_widgetsByName[name] removeObject:num];
+}
+
+- (BOOL)containsName:(NSString *)name
+{
+    return _widgetsByName[name] != nil;
+}
+
+// The fully-qualified name of the field of "widget"
+- (NSString *)nameOfWidget:(pdf_obj *)widget ctx:(fz_context *)ctx
+{
+    NSString *name = _namesByWidget[@(pdf_to_num(ctx, widget))];
+    if (name == nil)
     {
-        pdf_drop_obj(ctx, fields);
+        char *str = pdf_field_name(ctx, widget);
+        name = string_from_utf8(str);
+        fz_free(ctx, str);
+    }
+
+    return name;
+}
+
+// The state of each widget that scripts may change: the value of its field
+// and its annotation flags, which determine whether it is shown
+- (NSDictionary<NSNumber *, NSString *> *)widgetStatesInDoc:(pdf_document *)doc ctx:(fz_context *)ctx
+{
+    NSMutableDictionary<NSNumber *, NSString *> *states = [NSMutableDictionary dictionary];
+    pdf_obj *obj = NULL;
+
+    fz_var(obj);
+    fz_try(ctx)
+    {
+        for (NSNumber *num in _namesByWidget)
+        {
+            obj = pdf_new_indirect(ctx, doc, num.intValue, 0);
+            const char *value = pdf_field_value(ctx, obj);
+            int flags = pdf_to_int(ctx, pdf_dict_get(ctx, obj, PDF_NAME(F)));
+            states[num] = [NSString stringWithFormat:@"%d:%@", flags, string_from_utf8(value)];
+            pdf_drop_obj(ctx, obj);
+            obj = NULL;
+        }
     }
     fz_catch(ctx)
     {
-        fz_free(ctx, name);
-        pdf_drop_obj(ctx, field_names);
+        pdf_drop_obj(ctx, obj);
         fz_rethrow(ctx);
     }
-    return field_names;
+
+    return states;
 }
 
-static void make_unused_field_name(fz_context *ctx, pdf_document *doc, const char *fmt, char *buffer)
+// The object numbers of the widgets of the fields named
+- (NSMutableSet<NSNumber *> *)widgetsOfFields:(NSSet<NSString *> *)names
 {
-    pdf_obj *field_names = get_field_names(ctx, doc);
-    fz_try(ctx)
+    NSMutableSet<NSNumber *> *widgets = [NSMutableSet set];
+    for (NSString *name in names)
     {
-        int x = 0;
-        for (;;)
-        {
-            int i, n = pdf_array_len(ctx, field_names);
-            sprintf(buffer, fmt, x);
-            for (i = 0; i < n; i++)
-            {
-                if (strcmp(buffer, pdf_to_name(ctx, pdf_array_get(ctx, field_names, i))) == 0)
-                    break;
-            }
-            if (i == n)
-                break;
-            ++x;
-        }
+        NSArray<NSNumber *> *nums = _widgetsByName[name];
+        if (nums)
+            [widgets addObjectsFromArray:nums];
     }
-    fz_always(ctx)
+
+    return widgets;
+}
+
+@end
+
+// Whether any of the actions of a widget, or those it inherits from its
+// field, is a script
+static int widget_has_scripts(fz_context *ctx, pdf_obj *obj)
+{
+    for (int depth = 0; obj && depth < 32; depth++, obj = pdf_dict_get(ctx, obj, PDF_NAME(Parent)))
     {
-        pdf_drop_obj(ctx, field_names);
+        if (pdf_name_eq(ctx, pdf_dict_getp(ctx, obj, "A/S"), PDF_NAME(JavaScript)))
+            return 1;
+
+        pdf_obj *aa = pdf_dict_get(ctx, obj, PDF_NAME(AA));
+        int n = pdf_dict_len(ctx, aa);
+        for (int i = 0; i < n; i++)
+        {
+            if (pdf_name_eq(ctx, pdf_dict_get(ctx, pdf_dict_get_val(ctx, aa, i), PDF_NAME(S)), PDF_NAME(JavaScript)))
+                return 1;
+        }
     }
-    fz_catch(ctx)
+
+    return 0;
+}
+
+static void make_unused_field_name(MuPDFDKFieldIndex *index, const char *fmt, char *buffer)
+{
+    int x = 0;
+    do
     {
-        fz_rethrow(ctx);
+        sprintf(buffer, fmt, x++);
     }
+    while ([index containsName:@(buffer)]);
 }
 
 #define MAX_HITS (500)
@@ -711,13 +1201,19 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 @interface MuPDFDKLib ()
 @property dispatch_queue_t queue;
 @property(readonly) fz_context *ctx;
-@property ARDKBitmap *updateBm;
+@property NSMutableArray<ARDKBitmap *> *updateBmPool;
+@property NSMutableArray<ARDKBitmap *> *draftBmPool;
+- (ARDKBitmap *)takeUpdateBitmap;
+- (void)returnUpdateBitmap:(ARDKBitmap *)bm;
+- (ARDKBitmap *)takeDraftBitmapAtSize:(CGSize)size;
+- (void)returnDraftBitmap:(ARDKBitmap *)bm;
 @end
 
 @interface MuPDFDKDoc ()
 @property NSMutableSet<NSNumber *> *pagesWithRedactions;
 @property(readonly) MuPDFDKLib *mulib;
 @property(readonly) NSString *path;
+@property(readonly) NSString *loadedPath;
 @property(readonly) fz_stream *stream;
 @property(readonly) fz_document *fzdoc;
 @property(readonly) NSMutableArray<NSValue *> *pageSizes;
@@ -731,6 +1227,12 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 @property BOOL loadAborted;
 @property NSInteger focusPageNumber;
 
+// Save state
+@property(readonly) dispatch_queue_t saveQueue;
+@property(readwrite) BOOL recoveredFromJournal;
+@property BOOL saveCancelled;
+@property NSUInteger modificationCount;
+
 // Search state
 @property NSString *searchText;
 @property NSInteger searchStartPage;
@@ -746,9 +1248,17 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 - (FzPage *)getFzPage:(NSInteger)pageNumber;
 - (void)selectionChangedForPage:(NSInteger)pageNo;
 - (void)updatePageNumbered:(NSInteger)pageNo changedRects:(NSArray<NSValue *> *)rects;
+- (void)pageNumberedIsIncomplete:(NSInteger)pageNo;
 - (void)updatePages;
 - (void)updatePagesRecalc:(BOOL)recalc;
+- (void)updatePagesForField:(pdf_obj *)field recalc:(BOOL)recalc;
+- (MuPDFDKFieldIndex *)fieldIndexForDoc:(pdf_document *)pdoc;
 - (void)findFormFields;
+- (NSArray<MuPDFDKQuad *> *)formFieldQuadsForPage:(NSInteger)pageNumber;
+- (void)forgetFormFieldsOnPage:(NSInteger)pageNumber;
+- (void)invalidateAllPages;
+- (NSDictionary<NSNumber *, NSString *> *)widgetStatesBeforeEventsOn:(pdf_widget *)widget;
+- (void)widgetEventsRanOn:(pdf_widget *)widget withStatesBefore:(NSDictionary<NSNumber *, NSString *> *)before;
 - (void)setSelectionIsRedaction:(BOOL)isRedaction;
 - (void)selectAnnotation:(MuPDFDKAnnotation *)annot onPage:(NSInteger)pageNum;
 @end
@@ -788,20 +1298,35 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 @end
 
 @implementation MuPDFDKTextLayoutLine
-- (instancetype)initWithLineRect:(CGRect)lineRect andCharRects:(NSArray<NSValue *> *)charRects
+- (instancetype)initWithLineRect:(CGRect)lineRect andCharRects:(NSData *)charRects
 {
     self = [super init];
     if (self)
     {
         self->_lineRect = lineRect;
-        self->_charRects = charRects;
+        self->_charRectData = charRects;
     }
     return self;
 }
-+ (MuPDFDKTextLayoutLine *)layoutWithLineRect:(CGRect)lineRect andCharRects:(NSArray<NSValue *> *)charRects
++ (MuPDFDKTextLayoutLine *)layoutWithLineRect:(CGRect)lineRect andCharRects:(NSData *)charRects
 {
     return [[MuPDFDKTextLayoutLine alloc] initWithLineRect:lineRect andCharRects:charRects];
 }
+- (NSInteger)charCount
+{
+    return _charRectData.length / sizeof(CGRect);
+}
+- (CGRect)charRectAt:(NSInteger)index
+{
+    assert(index >= 0 && index < self.charCount);
+    return ((const CGRect *)_charRectData.bytes)[index];
+}
+- (BOOL)matchesLineRect:(CGRect)lineRect andCharRects:(const CGRect *)charRects count:(NSInteger)count
+{
+    return CGRectEqualToRect(_lineRect, lineRect)
+        && self.charCount == count
+        && memcmp(_charRectData.bytes, charRects, count * sizeof(CGRect)) == 0;
+}
 @end
 
 @interface MuPDFDKPage ()
@@ -820,6 +1345,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
     FzPage *_fzpageobj;
     fz_display_list *_list;
     fz_stext_page *_text;
+    // The most recent layout of a text widget, from which unchanged lines
+    // are reused. Accessed only on the mupdf queue
+    pdf_obj *_textLayoutObj;
+    NSArray<MuPDFDKTextLayoutLine *> *_textLayout;
 }
 
 @synthesize size = _size;
@@ -838,7 +1367,40 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 - (fz_display_list *)list
 {
     if (_list == NULL)
-        _list = fz_new_display_list_from_page(self.doc.mulib.ctx, self.fzpage);
+    {
+        fz_context *ctx = self.doc.mulib.ctx;
+        fz_page *page = self.fzpage;
+        fz_display_list *list = NULL;
+        fz_device *dev = NULL;
+        // Content of a progressively arriving document that is yet to arrive
+        // is left out, rather than failing the render, and the page rendered
+        // again once more has arrived
+        fz_cookie cookie = {0};
+        cookie.incomplete_ok = 1;
+
+        fz_var(list);
+        fz_var(dev);
+        fz_try(ctx)
+        {
+            list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+            dev = fz_new_list_device(ctx, list);
+            fz_run_page(ctx, page, dev, fz_identity, &cookie);
+            fz_close_device(ctx, dev);
+        }
+        fz_always(ctx)
+        {
+            fz_drop_device(ctx, dev);
+        }
+        fz_catch(ctx)
+        {
+            fz_drop_display_list(ctx, list);
+            fz_rethrow(ctx);
+        }
+
+        _list = list;
+        if (cookie.incomplete)
+            [self.doc pageNumberedIsIncomplete:_pageNum];
+    }
 
     return _list;
 }
@@ -887,25 +1449,7 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 - (void)findFormFields
 {
     dispatch_async(self.doc.mulib.queue, ^{
-        NSMutableArray<MuPDFDKQuad *> *quads = [NSMutableArray array];
-        fz_context *ctx = self.doc.mulib.ctx;
-        fz_try(ctx)
-        {
-            pdf_widget *widget;
-            pdf_document *idoc = pdf_document_from_fz_document(ctx, self.doc.fzdoc);
-            if (idoc)
-            {
-                for (widget = pdf_first_widget(ctx, (pdf_page *)self.fzpage); widget; widget = pdf_next_widget(ctx, widget))
-                {
-                    if (widget_is_visible(ctx, widget)
-                        && !widget->is_hot)
-                        [quads addObject:[MuPDFDKQuad quadFromRect:rect_from_fz(pdf_bound_widget(ctx, widget))]];
-                }
-            }
-        }
-        fz_catch(ctx)
-        {
-        }
+        NSArray<MuPDFDKQuad *> *quads = [self.doc formFieldQuadsForPage:self->_pageNum];
 
         dispatch_async(dispatch_get_main_queue(), ^{
             self->_formFieldQuads = quads;
@@ -918,15 +1462,9 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 - (ARError)doRenderAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm
 {
     assert (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
-    ARDKBitmapInfo bmInfo = bm.asBitmap;
     fz_context *ctx = self.doc.mulib.ctx;
-    fz_pixmap *pixmap = NULL;
-    fz_device *dev = NULL;
-    fz_matrix matrix;
     ARError err = 0;
 
-    fz_var(pixmap);
-    fz_var(dev);
     fz_var(err);
 
     fz_try(ctx)
@@ -937,22 +1475,8 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
             self.displayListDirty = NO;
         }
 
-        // FIXME: Make render account for profiles
-        // MuPDFPrintProfile printProfile = self.doc.printProfile;
-        // ARDKSoftProfile softProfile = self.doc.softProfile;
-
-        pixmap = fz_new_pixmap_with_data(ctx, fz_device_rgb(ctx), bmInfo.width, bmInfo.height, NULL, 1, bmInfo.lineSkip, bmInfo.memptr);
-        matrix = fz_pre_scale(fz_translate(orig.x, orig.y), zoom, zoom);
-        fz_clear_pixmap_with_value(ctx, pixmap, 0xFF);
-        dev = fz_new_draw_device(ctx, matrix, pixmap);
-        fz_run_display_list(ctx, self.list, dev, fz_identity, fz_infinite_rect, NULL);
+        err = render_list(ctx, self.list, opaque_area_for_list(ctx, self.list), zoom, orig, bm.asBitmap);
         [self drop_list];
-        fz_close_device(ctx, dev);
-    }
-    fz_always(ctx)
-    {
-        fz_drop_pixmap(ctx, pixmap);
-        fz_drop_device(ctx, dev);
     }
     fz_catch(ctx)
     {
@@ -961,40 +1485,100 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 
     return err;
 }
-- (ARError)doRenderAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm usingUpdateBuffer:(BOOL)update
+
+/// Render in strips, in parallel, each to its own intermediate buffer, and copy
+/// each strip to the target as it completes. Because only finished content
+/// is written to the target, a live bitmap can be updated without flicker.
+- (ARError)doUpdateAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm
 {
-    if (update)
-    {
-        ARError err = 0;
-        MuPDFDKLib *lib = self.doc.mulib;
+    assert (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    MuPDFDKLib *lib = self.doc.mulib;
+    fz_context *ctx = lib.ctx;
+    fz_display_list *list = NULL;
+    fz_rect opaque = fz_empty_rect;
+    ARError err = 0;
 
-        if (!lib.updateBm)
+    fz_var(list);
+
+    fz_try(ctx)
+    {
+        if (self.displayListDirty)
         {
-            UIScreen *screen = [UIScreen mainScreen];
-            CGSize size = ARCGSizeScale(screen.bounds.size, screen.scale);
-            lib.updateBm = [ARDKBitmap bitmapAtSize:CGSizeMake(size.width, size.height/UPDATE_BITMAP_PROPORTION) ofType:ARDKBitmapType_RGBA8888];
+            [self drop_list];
+            self.displayListDirty = NO;
         }
 
-        [lib.updateBm adjustToWidth:bm.width];
+        list = fz_keep_display_list(ctx, self.list);
+        opaque = opaque_area_for_list(ctx, list);
+    }
+    fz_catch(ctx)
+    {
+        return 1;
+    }
+
+    // All update buffers are of the same capacity. Find the number of rows
+    // they each hold at this width
+    ARDKBitmap *probe = [lib takeUpdateBitmap];
+    [probe adjustToWidth:bm.width];
+    NSInteger stripHeight = probe.height;
+    [lib returnUpdateBitmap:probe];
 
-        NSInteger yOff = 0;
-        while (yOff < bm.height)
-        {
-            if (yOff + lib.updateBm.height > bm.height)
-                [lib.updateBm adjustToSize:CGSizeMake(bm.width, bm.height - yOff)];
-            err = [self doRenderAtZoom:zoom withDocOrigin:CGPointMake(orig.x, orig.y - yOff) intoBitmap:lib.updateBm];
-            if (err) break;
-            ARDKBitmap *sub = [ARDKBitmap bitmapFromSubarea:CGRectMake(0, yOff, lib.updateBm.width, lib.updateBm.height) ofBitmap:bm];
-            [sub copyFrom:lib.updateBm];
-            yOff += lib.updateBm.height;
-        }
+    if (stripHeight > 0)
+    {
+        size_t stripCount = (bm.height + stripHeight - 1) / stripHeight;
+        // Each strip records its own result, combined once all are complete
+        NSMutableData *stripErrs = [NSMutableData dataWithLength:stripCount * sizeof(ARError)];
+        ARError *errs = stripErrs.mutableBytes;
+        // The display list is immutable and can be run on several threads at once,
+        // each with its own clone of the context. The serial queue is held until
+        // all strips are complete, so the document isn't altered in the meantime.
+        dispatch_apply(stripCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_HIGH, 0), ^(size_t i) {
+            NSInteger yOff = i * stripHeight;
+            NSInteger height = MIN(stripHeight, bm.height - yOff);
+            fz_context *sctx = fz_clone_context(ctx);
+            if (sctx == NULL)
+            {
+                errs[i] = 1;
+                return;
+            }
+
+            ARDKBitmap *stripBm = [lib takeUpdateBitmap];
+            [stripBm adjustToSize:CGSizeMake(bm.width, height)];
+            if (stripBm && render_list(sctx, list, opaque, zoom, CGPointMake(orig.x, orig.y - yOff), stripBm.asBitmap) == 0)
+            {
+                ARDKBitmap *sub = [ARDKBitmap bitmapFromSubarea:CGRectMake(0, yOff, bm.width, height) ofBitmap:bm];
+                [sub copyFrom:stripBm];
+                [sub doDarkModeConversion]; // Does nothing if bm's darkMode flag isn't set
+            }
+            else
+            {
+                errs[i] = 1;
+            }
+
+            [lib returnUpdateBitmap:stripBm];
+            fz_drop_context(sctx);
+        });
 
-        return err;
+        for (size_t i = 0; i < stripCount; i++)
+            err |= errs[i];
     }
     else
     {
-         return [self doRenderAtZoom:zoom withDocOrigin:orig intoBitmap:bm];
+        err = 1;
     }
+
+    fz_drop_display_list(ctx, list);
+    [self drop_list];
+
+    return err;
+}
+
+- (ARError)doRenderAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm usingUpdateBuffer:(BOOL)update
+{
+    if (update)
+        return [self doUpdateAtZoom:zoom withDocOrigin:orig intoBitmap:bm];
+    else
+        return [self doRenderAtZoom:zoom withDocOrigin:orig intoBitmap:bm];
 }
 
 - (id<ARDKRender>)renderAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm progress:(void (^)(ARError))block
@@ -1012,7 +1596,45 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 - (id<ARDKRender>)updateAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm progress:(void (^)(ARError))block
 {
     dispatch_async(self.doc.mulib.queue, ^{
+        // Dark mode conversion is performed strip by strip
         ARError err = [self doRenderAtZoom:zoom withDocOrigin:orig intoBitmap:bm usingUpdateBuffer:YES];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block(err);
+        });
+    });
+    return [[MuPDFDKRender alloc] init];
+}
+
+- (ARError)doDraftAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm
+{
+    assert (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.doc.mulib.ctx;
+    MuPDFDKLib *lib = self.doc.mulib;
+    // Rounded up, so that the draft covers the whole of bm once scaled back
+    // up by exactly the inverse proportion
+    CGSize draftSize = CGSizeMake(ceil(bm.width * DRAFT_RESOLUTION_PROPORTION), ceil(bm.height * DRAFT_RESOLUTION_PROPORTION));
+    ARDKBitmap *draftBm = [lib takeDraftBitmapAtSize:draftSize];
+    if (draftBm == nil)
+        return 1;
+
+    int aaLevel = fz_aa_level(ctx);
+    fz_set_aa_level(ctx, MIN(aaLevel, DRAFT_AA_LEVEL));
+    ARError err = [self doRenderAtZoom:zoom * DRAFT_RESOLUTION_PROPORTION
+                         withDocOrigin:ARCGPointScale(orig, DRAFT_RESOLUTION_PROPORTION)
+                            intoBitmap:draftBm];
+    fz_set_aa_level(ctx, aaLevel);
+
+    if (!err)
+        [bm scaleFrom:draftBm byFactor:1 / DRAFT_RESOLUTION_PROPORTION];
+
+    [lib returnDraftBitmap:draftBm];
+    return err;
+}
+
+- (id<ARDKRender>)draftAtZoom:(CGFloat)zoom withDocOrigin:(CGPoint)orig intoBitmap:(ARDKBitmap *)bm progress:(void (^)(ARError))block
+{
+    dispatch_async(self.doc.mulib.queue, ^{
+        ARError err = [self doDraftAtZoom:zoom withDocOrigin:orig intoBitmap:bm];
         [bm doDarkModeConversion]; // Does nothing if bm's darkMode flag isn't set
         dispatch_async(dispatch_get_main_queue(), ^{
             block(err);
@@ -1407,8 +2029,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
             char name[80];
             pdf_widget *widget;
             CGSize pageSize = self.size;
-            make_unused_field_name(ctx, (pdf_document *)self.doc.fzdoc, "Signature%d", name);
+            MuPDFDKFieldIndex *fieldIndex = [self.doc fieldIndexForDoc:idoc];
+            make_unused_field_name(fieldIndex, "Signature%d", name);
             widget = pdf_create_signature_widget(ctx, (pdf_page *)self.fzpage, name);
+            [fieldIndex addWidget:widget->obj ctx:ctx];
             fz_rect rect = pdf_bound_annot(ctx, widget);
             fz_point fz_pt = pt_to_fz(pt);
             float width = rect.x1 - rect.x0;
@@ -1587,86 +2211,133 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
     return widget;
 }
 
-- (BOOL)setWidget:(pdf_obj *)obj text:(NSString *)text isFinal:(BOOL)final
+- (BOOL)setWidgetOnQueue:(pdf_obj *)obj text:(NSString *)text isFinal:(BOOL)final
 {
-    __block BOOL accepted = NO;
+    assert (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.doc.mulib.ctx;
+    BOOL accepted = NO;
 
-    dispatch_sync(self.doc.mulib.queue, ^{
-        fz_context *ctx = self.doc.mulib.ctx;
-        fz_var(accepted);
-        fz_try(ctx)
+    fz_var(accepted);
+    fz_try(ctx)
+    {
+        pdf_widget *widget = [self findWidget:obj];
+        if (widget)
         {
-            pdf_widget *widget = [self findWidget:obj];
-            if (widget)
-            {
-                pdf_set_widget_editing_state(ctx, widget, text.length == 0 || !final);
-                accepted = (pdf_set_text_field_value(ctx, widget, (char *)text.UTF8String) != 0);
-            }
+            pdf_set_widget_editing_state(ctx, widget, text.length == 0 || !final);
+            accepted = (pdf_set_text_field_value(ctx, widget, (char *)text.UTF8String) != 0);
+        }
 
-            if (accepted)
-                [self.doc updatePagesRecalc:final];
+        if (accepted)
+            [self.doc updatePagesForField:obj recalc:final];
 
-        }
-        fz_catch(ctx)
-        {
-            accepted = NO;
-        }
+    }
+    fz_catch(ctx)
+    {
+        accepted = NO;
+    }
+
+    return accepted;
+}
+
+- (BOOL)setWidget:(pdf_obj *)obj text:(NSString *)text isFinal:(BOOL)final
+{
+    __block BOOL accepted = NO;
+
+    dispatch_sync(self.doc.mulib.queue, ^{
+        accepted = [self setWidgetOnQueue:obj text:text isFinal:final];
     });
 
     return accepted;
 }
 
-- (NSArray<MuPDFDKTextLayoutLine *> *)getWidgetTextLayout:(pdf_obj *)obj
+- (NSArray<MuPDFDKTextLayoutLine *> *)layoutWidgetOnQueue:(pdf_obj *)obj
 {
+    assert (strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.doc.mulib.ctx;
     NSMutableArray<MuPDFDKTextLayoutLine *> *lines = [NSMutableArray array];
+    NSArray<MuPDFDKTextLayoutLine *> *previous = (obj == _textLayoutObj) ? _textLayout : nil;
+    NSMutableData *charRects = [NSMutableData data];
+    fz_layout_block *layout = NULL;
 
-    dispatch_sync(self.doc.mulib.queue, ^{
-        fz_context *ctx = self.doc.mulib.ctx;
-        fz_layout_block *layout = NULL;
+    fz_var(layout);
+    fz_try(ctx)
+    {
+        pdf_widget *widget = [self findWidget:obj];
 
-        fz_var(layout);
-        fz_try(ctx)
+        if (widget)
         {
-            pdf_widget *widget = [self findWidget:obj];
-
-            if (widget)
+            fz_rect bounds = pdf_bound_widget(ctx, widget);
+            layout = pdf_layout_text_widget(ctx, widget);
+            fz_matrix mat = fz_concat(layout->inv_matrix, fz_translate(-bounds.x0, -bounds.y0));
+            for (fz_layout_line *line = layout->head;
+                 line;
+                 line = line->next)
             {
-                fz_rect bounds = pdf_bound_widget(ctx, widget);
-                layout = pdf_layout_text_widget(ctx, widget);
-                fz_matrix mat = fz_concat(layout->inv_matrix, fz_translate(-bounds.x0, -bounds.y0));
-                for (fz_layout_line *line = layout->head;
-                     line;
-                     line = line->next)
-                {
-                    NSMutableArray<NSValue *> *charRects = [NSMutableArray array];
-                    float y = line->y - line->h * 0.2;
-                    fz_rect fzLineRect = fz_transform_rect(fz_make_rect(line->x, y, line->x, line->y + line->h), mat);
-                    CGRect lineRect = rect_from_fz(fzLineRect);
-
-                    for (fz_layout_char *ch = line->text; ch; ch = ch->next)
-                    {
-                        fz_rect fzCharRect = fz_transform_rect(fz_make_rect(ch->x, y, ch->x + ch->w, line->y + line->h), mat);
-                        CGRect charRect = rect_from_fz(fzCharRect);
-                        lineRect = CGRectUnion(lineRect, charRect);
-                        [charRects addObject:[NSValue valueWithCGRect:charRect]];
-                    }
+                float y = line->y - line->h * 0.2;
+                fz_rect fzLineRect = fz_transform_rect(fz_make_rect(line->x, y, line->x, line->y + line->h), mat);
+                CGRect lineRect = rect_from_fz(fzLineRect);
 
-                    [lines addObject:[MuPDFDKTextLayoutLine layoutWithLineRect:lineRect andCharRects:charRects]];
+                charRects.length = 0;
+                for (fz_layout_char *ch = line->text; ch; ch = ch->next)
+                {
+                    fz_rect fzCharRect = fz_transform_rect(fz_make_rect(ch->x, y, ch->x + ch->w, line->y + line->h), mat);
+                    CGRect charRect = rect_from_fz(fzCharRect);
+                    lineRect = CGRectUnion(lineRect, charRect);
+                    [charRects appendBytes:&charRect length:sizeof(charRect)];
                 }
+
+                // mupdf lays out the whole text each time, but typing usually
+                // affects only the line containing the caret and those after it,
+                // so the earlier lines can keep their objects
+                NSInteger count = charRects.length / sizeof(CGRect);
+                MuPDFDKTextLayoutLine *old = lines.count < previous.count ? previous[lines.count] : nil;
+                if (old && [old matchesLineRect:lineRect andCharRects:charRects.bytes count:count])
+                    [lines addObject:old];
+                else
+                    [lines addObject:[MuPDFDKTextLayoutLine layoutWithLineRect:lineRect andCharRects:[charRects copy]]];
             }
         }
-        fz_always(ctx)
-        {
-            fz_drop_layout(ctx, layout);
-        }
-        fz_catch(ctx)
-        {
-        }
+    }
+    fz_always(ctx)
+    {
+        fz_drop_layout(ctx, layout);
+    }
+    fz_catch(ctx)
+    {
+    }
+
+    _textLayoutObj = obj;
+    _textLayout = lines;
+
+    return lines;
+}
+
+- (NSArray<MuPDFDKTextLayoutLine *> *)getWidgetTextLayout:(pdf_obj *)obj
+{
+    __block NSArray<MuPDFDKTextLayoutLine *> *lines = nil;
+
+    dispatch_sync(self.doc.mulib.queue, ^{
+        lines = [self layoutWidgetOnQueue:obj];
     });
 
     return lines;
 }
 
+- (void)updateWidget:(pdf_obj *)obj text:(NSString *)text andLayout:(void (^)(NSArray<MuPDFDKTextLayoutLine *> *layout))result
+{
+    // The caller may go on to modify the text while we are queued
+    text = [text copy];
+
+    dispatch_async(self.doc.mulib.queue, ^{
+        [self setWidgetOnQueue:obj text:text isFinal:NO];
+        NSArray<MuPDFDKTextLayoutLine *> *lines = [self layoutWidgetOnQueue:obj];
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            result(lines);
+        });
+    });
+}
+
 - (void)setWidget:(pdf_obj *)obj option:(NSString *)opt onCheck:(void (^)(BOOL accepted))result
 {
     dispatch_async(self.doc.mulib.queue, ^{
@@ -1681,7 +2352,7 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                 const char *utf8opt = opt.UTF8String;
                 pdf_choice_widget_set_value(ctx, widget, 1, &utf8opt);
                 accepted = YES;
-                [self.doc updatePages];
+                [self.doc updatePagesForField:obj recalc:YES];
             }
         }
         fz_catch(ctx)
@@ -1705,7 +2376,7 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
             if (widget)
             {
                 pdf_toggle_widget(ctx, widget);
-                [self.doc updatePages];
+                [self.doc updatePagesForField:obj recalc:YES];
             }
         }
         fz_catch(ctx)
@@ -1740,7 +2411,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                     unsigned char buf[4096];
                     size_t n;
                     bytes = pdf_signature_hash_bytes(ctx, idoc, focus->obj);
-                    [verifier begin];
+                    if ([verifier respondsToSelector:@selector(begin:)])
+                        [verifier begin:sig];
+                    else
+                        [verifier begin];
                     while ((n = fz_read(ctx, bytes, buf, sizeof(buf))) > 0)
                     {
                         [verifier data:[NSData dataWithBytesNoCopy:buf length:n freeWhenDone:NO]];
@@ -1832,6 +2506,9 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                     twidget.getTextLayout = ^NSArray<MuPDFDKTextLayoutLine *> *{
                         return [self getWidgetTextLayout:focus_obj];
                     };
+                    twidget.updateTextAndLayout = ^(NSString *text, void (^result)(NSArray<MuPDFDKTextLayoutLine *> *layout)) {
+                        [self updateWidget:focus_obj text:text andLayout:result];
+                    };
 
                     widget = twidget;
                     break;
@@ -1952,8 +2629,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 
                     if (w->is_hot)
                     {
+                        NSDictionary<NSNumber *, NSString *> *states = [self.doc widgetStatesBeforeEventsOn:w];
                         w->is_hot = 0;
                         pdf_annot_event_blur(ctx, w);
+                        [self.doc widgetEventsRanOn:w withStatesBefore:states];
                     }
 
                     if (rect.x0 < fz_pt.x && fz_pt.x < rect.x1 && rect.y0 < fz_pt.y && fz_pt.y < rect.y1)
@@ -1971,10 +2650,12 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                 if (focus)
                 {
                     self.doc.focusPageNumber = self->_pageNum;
+                    NSDictionary<NSNumber *, NSString *> *states = [self.doc widgetStatesBeforeEventsOn:focus];
                     focus->is_hot = 1;
                     pdf_annot_event_focus(ctx, focus);
                     pdf_annot_event_down(ctx, focus);
                     pdf_annot_event_up(ctx, focus);
+                    [self.doc widgetEventsRanOn:focus withStatesBefore:states];
                     [self.doc updatePages];
                     widget = [self interpretWidget:focus withIndex:focusIndex];
                 }
@@ -2013,8 +2694,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                              type == PDF_WIDGET_TYPE_LISTBOX || type == PDF_WIDGET_TYPE_COMBOBOX ||
                              type == PDF_WIDGET_TYPE_RADIOBUTTON || type == PDF_WIDGET_TYPE_CHECKBOX) && widget_is_visible(ctx, focus))
                         {
+                            NSDictionary<NSNumber *, NSString *> *states = [self.doc widgetStatesBeforeEventsOn:focus];
                             focus->is_hot = 1;
                             pdf_annot_event_focus(ctx,  focus);
+                            [self.doc widgetEventsRanOn:focus withStatesBefore:states];
                             widget = [self interpretWidget:focus withIndex:index];
                             break;
                         }
@@ -2022,8 +2705,10 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
                     else if (focus->is_hot)
                     {
                         foundFocus = 1;
+                        NSDictionary<NSNumber *, NSString *> *states = [self.doc widgetStatesBeforeEventsOn:focus];
                         focus->is_hot = 0;
                         pdf_annot_event_blur(ctx, focus);
+                        [self.doc widgetEventsRanOn:focus withStatesBefore:states];
                     }
 
                     ++index;
@@ -2113,1445 +2798,3775 @@ static MuPDFDKTextSelection *selWord(fz_context *ctx, fz_stext_page *text, CGPoi
 
 @end
 
-@interface MuPDFDKDoc()
-@property BOOL isBeingSaved;
+// A signature found by verifyAllSignatures, holding what's needed to
+// complete its verification off the mupdf queue
+@interface MuPDFDKSignatureCheck : NSObject
+@property NSInteger pageNumber;
+@property CGRect rect;
+@property int invalidChangePoint;
+// The signature, and the array of fz_range over which it was calculated.
+// Both are nil if they couldn't be read
+@property NSData *contents;
+@property NSData *byteRanges;
+@property id<PKCS7Verifier> verifier;
+// The length of the start of the file whose data the verifier has by
+// having been forked from another, rather than by being sent it
+@property int64_t forkedLength;
 @end
 
-@implementation MuPDFDKDoc
-{
-    MuPDFPrintProfile _printProfile;
-    ARDKSoftProfile _softProfile;
-    NSInteger _reportedPageCount;
-    NSMutableDictionary<NSNumber *, FzPageHolder *> *_fzpages;
-    NSArray<MuPDFDKPageHolder *> *_pages;
-    BOOL _pdfFormFillingEnabled;
-}
-
-@synthesize progressBlock=_progressBlock, successBlock=_successBlock, errorBlock=_errorBlock,
-            docType = _docType, hasBeenModified = _hasBeenModified, loadingComplete = _loadingComplete,
-            pageCount = _pageCount, pdfFormSigningEnabled = _pdfFormSigningEnabled, pasteboard = _pasteboard;
+@implementation MuPDFDKSignatureCheck
+@end
 
-+ (ARDKDocType)docTypeFromFileExtension:(NSString *)filePath
+static const char *skip_space(const char *p)
 {
-    NSString *ext = [filePath pathExtension].uppercaseString;
-    if ([ext isEqualToString:@"PDF"])
-        return ARDKDocType_PDF;
-    else if ([ext isEqualToString:@"CBZ"]
-        || [ext isEqualToString:@"CBT"])
-        return ARDKDocType_CBZ;
-    else if ([ext isEqualToString:@"FB2"]
-             || [ext isEqualToString:@"XHTML"])
-        return ARDKDocType_FB2;
-    else if ([ext isEqualToString:@"SVG"])
-        return ARDKDocType_SVG;
-    else if ([ext isEqualToString:@"XPS"]
-             || [ext isEqualToString:@"OXPS"])
-        return ARDKDocType_XPS;
-    else if ([ext isEqualToString:@"EPUB"])
-        return ARDKDocType_EPUB;
-    return ARDKDocType_Other;
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
 }
 
-- (instancetype)initForPath:(NSString *)path ofType:(ARDKDocType)docType lib:(MuPDFDKLib *)lib
+// Read the javascript string literal starting at "p", adding its contents to
+// "names", if not nil. Returns the position following the literal
+static const char *scan_literal(const char *p, NSMutableSet<NSString *> *names)
 {
-    self = [super init];
-    if (self)
+    NSMutableData *literal = [NSMutableData data];
+    char quote = *p++;
+
+    while (*p && *p != quote)
     {
-        _mulib = lib;
-        _docType = docType;
-        _path = path;
-        _pageSizes = [NSMutableArray array];
-        _pages = [NSArray array];
-        _selections = [NSMutableDictionary dictionary];
-        _pagesWithRedactions = [NSMutableSet set];
-        _eventTargets = [NSMutableArray array];
-        _fzpages = [NSMutableDictionary dictionaryWithCapacity:INITIAL_FZPAGE_CACHE_SIZE];
+        if (*p == '\\' && p[1])
+            p++;
+        [literal appendBytes:p length:1];
+        p++;
     }
-    return self;
+
+    NSString *name = [[NSString alloc] initWithData:literal encoding:NSUTF8StringEncoding];
+    if (name)
+        [names addObject:name];
+
+    return *p ? p + 1 : p;
 }
 
-- (void)dealloc
+static BOOL is_ident_start(char c)
 {
-    fz_context *ctx = _mulib.ctx;
-    fz_stream *stream = _stream;
-    fz_document *doc = _fzdoc;
-    dispatch_async_if_needed(_mulib.queue, ^{
-        fz_drop_document(ctx, doc);
-        fz_drop_stream(ctx, stream);
-    });
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '$';
 }
 
-- (void)doAfterBackgroundTasks:(void (^)(void))block
+static BOOL is_ident_char(char c)
 {
-    dispatch_async(self.mulib.queue, ^{
-        dispatch_async(dispatch_get_main_queue(), ^{
-            block();
-        });
-    });
+    return is_ident_start(c) || (c >= '0' && c <= '9');
 }
-- (void)addTarget:(id<ARDKDocumentEventTarget>)target
+
+static BOOL is_listed(const char *ident, size_t len, const char * const *list)
 {
-    [_eventTargets addObject:[MuPDFDKWeakEventTarget weakHolder:target]];
-    if (self.loadingComplete)
+    for (; *list; list++)
     {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            [target updatePageCount:self.pageCount andLoadingComplete:YES];
-        });
+        if (strlen(*list) == len && strncmp(ident, *list, len) == 0)
+            return YES;
     }
+
+    return NO;
 }
 
-- (NSInteger)pageCount
+// Functions that a script may call without affecting the analysis of its
+// dependencies, together with the keywords that can precede a parenthesis
+static const char * const plain_functions[] = {
+    "if", "for", "while", "switch", "return", "typeof", "catch", "function",
+    "Number", "String", "Boolean", "Array", "Date", "RegExp",
+    "parseInt", "parseFloat", "isNaN", "isFinite",
+    NULL
+};
+
+// Methods that reach fields other than by a literal name
+static const char * const field_methods[] = {
+    "getNthFieldName", "resetForm", "calculateNow",
+    NULL
+};
+
+static const char *scan_literal_list(const char *p, char close, NSMutableSet<NSString *> *names);
+
+// Read a literal function argument: a string, a number, or an array of literals,
+// adding any strings to "names". Returns NULL if the argument is anything else.
+static const char *scan_literal_argument(const char *p, NSMutableSet<NSString *> *names)
 {
-    @synchronized (self.pageSizes) {
-        return self.pageSizes.count;
-    }
-}
+    if (*p == '"' || *p == '\'')
+        return scan_literal(p, names);
 
-- (id<ARDKLib>)lib
+    if (*p == '-' || *p == '.' || (*p >= '0' && *p <= '9'))
+    {
+        p++;
+        while (is_ident_char(*p) || *p == '.')
+            p++;
+        return p;
+    }
+
+    if (*p == '[')
+        return scan_literal_list(skip_space(p + 1), ']', names);
+
+    if (strncmp(p, "new", 3) == 0 && !is_ident_char(p[3]))
+    {
+        p = skip_space(p + 3);
+        if (strncmp(p, "Array", 5) != 0)
+            return NULL;
+
+        p = skip_space(p + 5);
+        if (*p != '(')
+            return NULL;
+
+        return scan_literal_list(skip_space(p + 1), ')', names);
+    }
+
+    return NULL;
+}
+
+// Read a list of literal arguments or array elements, up to and including
+// "close". Returns NULL if any is not a literal.
+static const char *scan_literal_list(const char *p, char close, NSMutableSet<NSString *> *names)
 {
-    return _mulib;
+    if (*p == close)
+        return p + 1;
+
+    for (;;)
+    {
+        p = scan_literal_argument(p, names);
+        if (p == NULL)
+            return NULL;
+
+        p = skip_space(p);
+        if (*p == close)
+            return p + 1;
+
+        if (*p != ',')
+            return NULL;
+
+        p = skip_space(p + 1);
+    }
 }
 
-- (void)enableJS:(BOOL)enable
+// Collect the names of the fields a calculation script reads. Returns NO if the
+// script may reach fields other than by getField("literal"), or by an AF function
+// whose arguments are all literals, in which case its dependencies can't be
+// determined. Calls to any other function, such as a document-level helper,
+// make the script opaque, as do field lookups by computed names.
+static BOOL scan_calculation_script(const char *js, NSMutableSet<NSString *> *names)
 {
-    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
-    fz_context *ctx = self.mulib.ctx;
-    pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
-    if (idoc)
+    const char *p = js;
+    char last = 0;
+
+    while (*p)
     {
-        if (enable)
+        if (*p == '"' || *p == '\'')
         {
-            pdf_enable_js(ctx, idoc);
-            // Pass self into the mupdf library. This is safe because the callback
-            // is triggered only by calls that we make, for which we ensure a reference
-            // is kept.
-            pdf_set_doc_event_callback(ctx, idoc, event_cb, (__bridge void *)self);
+            // A string not passed to getField or an AF function can only
+            // name a field by way of some other call, which makes the
+            // script opaque anyway
+            p = scan_literal(p, nil);
+            last = '"';
+        }
+        else if (p[0] == '/' && p[1] == '/')
+        {
+            while (*p && *p != '\n')
+                p++;
+        }
+        else if (p[0] == '/' && p[1] == '*')
+        {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+        }
+        else if (is_ident_start(*p))
+        {
+            const char *ident = p;
+            while (is_ident_char(*p))
+                p++;
+
+            size_t len = (size_t)(p - ident);
+            BOOL member = (last == '.');
+            const char *q = skip_space(p);
+            last = 'a';
+            if (*q != '(')
+                continue;
+
+            if (len == 8 && strncmp(ident, "getField", 8) == 0)
+            {
+                q = skip_space(q + 1);
+                if (*q != '"' && *q != '\'')
+                    return NO;
+
+                q = skip_space(scan_literal(q, names));
+                if (*q != ')')
+                    return NO;
+
+                p = q + 1;
+                last = ')';
+            }
+            else if (!member && len > 2 && strncmp(ident, "AF", 2) == 0)
+            {
+                p = scan_literal_list(skip_space(q + 1), ')', names);
+                if (p == NULL)
+                    return NO;
+
+                last = ')';
+            }
+            else if (member ? is_listed(ident, len, field_methods) : !is_listed(ident, len, plain_functions))
+            {
+                return NO;
+            }
+        }
+        else if (*p >= '0' && *p <= '9')
+        {
+            // Skip numbers whole, so that their digits and exponents
+            // aren't taken for identifiers
+            while (is_ident_char(*p) || *p == '.')
+                p++;
+            last = '0';
         }
         else
         {
-            pdf_disable_js(ctx, idoc);
-            pdf_set_doc_event_callback(ctx, idoc, NULL, NULL);
+            // A call of the result of an expression, such as this["getField"](n),
+            // can't be analysed
+            if (*p == '(' && (last == ')' || last == ']'))
+                return NO;
+
+            if (*p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+                last = *p;
+            p++;
         }
     }
+
+    return names.count > 0;
 }
 
-- (NSString *)documentAuthor
+// Whether any of "names", or any of their ancestors, is among "dependencies"
+static BOOL depends_on_names(NSSet<NSString *> *dependencies, NSSet<NSString *> *names)
 {
-    NSString *author = [[NSUserDefaults standardUserDefaults] stringForKey:documentAuthorKey];
-    if (!author)
-        author = [[NSBundle mainBundle] objectForInfoDictionaryKey:@"CFBundleName"];
-    return author;
+    for (NSString *name in names)
+    {
+        NSString *n = name;
+        for (;;)
+        {
+            if ([dependencies containsObject:n])
+                return YES;
+
+            NSRange dot = [n rangeOfString:@"." options:NSBackwardsSearch];
+            if (dot.location == NSNotFound)
+                break;
+
+            n = [n substringToIndex:dot.location];
+        }
+    }
+
+    return NO;
 }
 
-- (void)setDocumentAuthor:(NSString *)documentAuthor
+static pdf_obj *calculation_order(fz_context *ctx, pdf_document *doc)
 {
-    [[NSUserDefaults standardUserDefaults] setObject:documentAuthor forKey:documentAuthorKey];
+    return pdf_dict_getp(ctx, pdf_trailer(ctx, doc), "Root/AcroForm/CO");
 }
 
-- (void)setSelectionIsRedaction:(BOOL)isRedaction
+// A field listed in the form's calculation order (/CO)
+@interface MuPDFDKFormCalculation : NSObject
+@property int num;
+@property NSString *name;
+// The names of the fields read by the field's calculation script, with
+// the other literal arguments of the AF functions it calls
+@property NSSet<NSString *> *dependencies;
+// Set if the script refers to fields in ways that can't be determined from
+// its text, in which case the field is recalculated on every change
+@property BOOL opaque;
+@end
+
+@implementation MuPDFDKFormCalculation
+@end
+
+// The dependencies between the fields of a form, derived from the calculation
+// order and the calculation scripts. Built once, so that a change to a field
+// need recalculate only the fields that depend on it. Used only on the mupdf
+// queue.
+@interface MuPDFDKFormGraph : NSObject
+@end
+
+@implementation MuPDFDKFormGraph
 {
-    self->_selectionIsRedaction = isRedaction;
+    NSArray<MuPDFDKFormCalculation *> *_calculations;
 }
 
-- (BOOL)pdfFormFillingEnabled
+- (instancetype)initForDoc:(pdf_document *)doc ctx:(fz_context *)ctx
 {
-    return _pdfFormFillingEnabled;
+    self = [super init];
+    if (self)
+    {
+        NSMutableArray<MuPDFDKFormCalculation *> *calculations = [NSMutableArray array];
+        char *str = NULL;
+
+        fz_var(str);
+        fz_try(ctx)
+        {
+            pdf_obj *co = calculation_order(ctx, doc);
+            int n = pdf_array_len(ctx, co);
+            for (int i = 0; i < n; i++)
+            {
+                pdf_obj *field = pdf_array_get(ctx, co, i);
+                pdf_obj *js = pdf_dict_getp(ctx, field, "AA/C/JS");
+                MuPDFDKFormCalculation *calc = [[MuPDFDKFormCalculation alloc] init];
+                NSMutableSet<NSString *> *dependencies = [NSMutableSet set];
+
+                calc.num = pdf_to_num(ctx, field);
+                str = pdf_field_name(ctx, field);
+                calc.name = string_from_utf8(str);
+                fz_free(ctx, str);
+                str = NULL;
+
+                if (js)
+                {
+                    str = pdf_load_stream_or_string_as_utf8(ctx, js);
+                    calc.opaque = !scan_calculation_script(str, dependencies);
+                    fz_free(ctx, str);
+                    str = NULL;
+                }
+
+                calc.dependencies = dependencies;
+                [calculations addObject:calc];
+            }
+        }
+        fz_always(ctx)
+        {
+            fz_free(ctx, str);
+        }
+        fz_catch(ctx)
+        {
+            fz_rethrow(ctx);
+        }
+
+        _calculations = calculations;
+    }
+    return self;
 }
 
-- (void)setPdfFormFillingEnabled:(BOOL)pdfFormFillingEnabled
+// Whether the calculation order is as it was when the graph was built
+- (BOOL)isCurrentForDoc:(pdf_document *)doc ctx:(fz_context *)ctx
 {
-    _pdfFormFillingEnabled = pdfFormFillingEnabled;
-    dispatch_async(self.mulib.queue, ^{
-        [self enableJS:pdfFormFillingEnabled];
-    });
+    pdf_obj *co = calculation_order(ctx, doc);
+    int n = (int)_calculations.count;
+    if (pdf_array_len(ctx, co) != n)
+        return NO;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (pdf_to_num(ctx, pdf_array_get(ctx, co, i)) != _calculations[i].num)
+            return NO;
+    }
+
+    return YES;
 }
 
-- (BOOL)pdfFormSigningEnabled
+// Run, in calculation order, the calculations affected by a change to the value
+// of "field", named "name", each at most once. A calculation that changes the value
+// of its own field may affect those that follow. Returns the names of "field" and of
+// the fields whose values changed.
+- (NSSet<NSString *> *)recalculateFromField:(pdf_obj *)field named:(NSString *)name inDoc:(pdf_document *)doc ctx:(fz_context *)ctx
 {
-    return _pdfFormSigningEnabled;
+    NSMutableSet<NSString *> *changed = [NSMutableSet setWithObject:name];
+    [self recalculate:changed all:NO inDoc:doc ctx:ctx];
+    return changed;
 }
 
-- (void)setPdfFormSigningEnabled:(BOOL)pdfFormSigningEnabled
+// Run every calculation, in calculation order, as does pdf_calculate_form, but
+// returning the names of the fields whose values changed
+- (NSSet<NSString *> *)recalculateAllInDoc:(pdf_document *)doc ctx:(fz_context *)ctx
 {
-    _pdfFormSigningEnabled = pdfFormSigningEnabled;
+    NSMutableSet<NSString *> *changed = [NSMutableSet set];
+    [self recalculate:changed all:YES inDoc:doc ctx:ctx];
+    return changed;
 }
 
-- (ARDKBitmap *)bitmapAtSize:(CGSize)size
+// Run the calculations affected by changes to the fields named in "changed", or
+// all of them if "all" is set, adding to "changed" the names of the fields whose
+// values the calculations change
+- (void)recalculate:(NSMutableSet<NSString *> *)changed all:(BOOL)all inDoc:(pdf_document *)doc ctx:(fz_context *)ctx
 {
-    return [ARDKBitmap bitmapAtSize:size ofType:ARDKBitmapType_RGBA8888];
+    pdf_obj *co = calculation_order(ctx, doc);
+    int n = (int)_calculations.count;
+    for (int i = 0; i < n; i++)
+    {
+        MuPDFDKFormCalculation *calc = _calculations[i];
+        if (!all && !calc.opaque && !depends_on_names(calc.dependencies, changed))
+            continue;
+
+        pdf_obj *calcField = pdf_array_get(ctx, co, i);
+        char *value = pdf_field_event_calculate(ctx, doc, calcField);
+        if (value)
+        {
+            fz_try(ctx)
+            {
+                const char *oldValue = pdf_field_value(ctx, calcField);
+                if (strcmp(value, oldValue ? oldValue : "") != 0)
+                {
+                    pdf_set_field_value(ctx, doc, calcField, value, 0);
+                    [changed addObject:calc.name];
+                }
+            }
+            fz_always(ctx)
+            {
+                fz_free(ctx, value);
+            }
+            fz_catch(ctx)
+            {
+                fz_rethrow(ctx);
+            }
+        }
+    }
 }
 
-static NSMutableArray<id<ARDKTocEntry>> *tocFromOutline(fz_outline *outline, int depth)
+@end
+
+/// The quad of a visible widget, as cached by formFieldQuadsForPage:, with the
+/// number of the widget's object so that it can be recognised when focused
+@interface MuPDFDKWidgetQuad : NSObject
+@property MuPDFDKQuad *quad;
+@property int num;
+@end
+
+@implementation MuPDFDKWidgetQuad
+@end
+
+@interface MuPDFDKDoc()
+@property BOOL isBeingSaved;
+@end
+
+/// Find the offset of a file's last xref section, from the startxref keyword near its end
+static int64_t read_startxref(fz_context *ctx, fz_stream *stm, int64_t length)
 {
-    NSMutableArray<id<ARDKTocEntry>> *arr = [NSMutableArray array];
+    unsigned char buf[1024];
+    int64_t start = MAX(0, length - (int64_t)sizeof(buf));
+    fz_seek(ctx, stm, start, SEEK_SET);
+    size_t n = fz_read(ctx, stm, buf, (size_t)(length - start));
 
-    for (;outline; outline = outline->next)
+    for (int64_t i = (int64_t)n - 9; i >= 0; i--)
     {
-        MuPDFDKTocEntry *tocEntry = [[MuPDFDKTocEntry alloc] init];
-        if (outline->title)
-            tocEntry.label = @(outline->title);
-        if (outline->uri)
-            tocEntry.url = @(outline->uri);
-        tocEntry.page = outline->page;
-        tocEntry.rect = CGRectMake(outline->x, outline->y, 0, 0);
-        tocEntry.depth = depth;
-        tocEntry.open = outline->is_open != 0;
-        tocEntry.children = tocFromOutline(outline->down, depth+1);
+        if (memcmp(buf + i, "startxref", 9) == 0)
+        {
+            size_t j = (size_t)i + 9;
+            while (j < n && (buf[j] == ' ' || buf[j] == '\r' || buf[j] == '\n' || buf[j] == '\t'))
+                j++;
 
-        [arr addObject:tocEntry];
+            int64_t offset = 0;
+            size_t digits = j;
+            while (j < n && buf[j] >= '0' && buf[j] <= '9')
+                offset = offset * 10 + (buf[j++] - '0');
+
+            if (j > digits)
+                return offset;
+
+            break;
+        }
     }
 
-    return arr;
+    fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find startxref");
 }
 
-- (void)loadToc
+/// Read the trailer dictionary of the xref section at an offset, which may be
+/// either an xref table or an xref stream
+static pdf_obj *read_xref_trailer(fz_context *ctx, pdf_document *idoc, fz_stream *stm, int64_t offset)
 {
-    dispatch_async(self.mulib.queue, ^{
-        fz_context *ctx = self.mulib.ctx;
-        fz_outline *outline = NULL;
-        pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
-        if (!idoc)
-            return;
+    pdf_lexbuf buf;
+    pdf_obj *trailer = NULL;
+    pdf_lexbuf_init(ctx, &buf, PDF_LEXBUF_LARGE);
+    fz_try(ctx)
+    {
+        fz_seek(ctx, stm, offset, SEEK_SET);
+        if (pdf_lex(ctx, stm, &buf) == PDF_TOK_XREF)
+        {
+            // Skip the table's entries
+            pdf_token tok;
+            do
+                tok = pdf_lex(ctx, stm, &buf);
+            while (tok != PDF_TOK_TRAILER && tok != PDF_TOK_EOF && tok != PDF_TOK_ERROR);
 
-        NSArray<id<ARDKTocEntry>> *toc;
+            if (tok != PDF_TOK_TRAILER || pdf_lex(ctx, stm, &buf) != PDF_TOK_OPEN_DICT)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find trailer");
 
-        fz_var(outline);
-        fz_try(ctx)
-        {
-            outline = pdf_load_outline(ctx, idoc);
-            toc = tocFromOutline(outline, 0);
-        }
-        fz_always(ctx)
-        {
-            fz_drop_outline(ctx, outline);
-        }
-        fz_catch(ctx)
-        {
+            trailer = pdf_parse_dict(ctx, idoc, stm, &buf);
         }
-
-        if(toc)
+        else
         {
-            dispatch_async(dispatch_get_main_queue(), ^{
-                self->_toc = toc;
-                // Trick: report a selection change so that the app updates the UI
-                if (self.onSelectionChanged)
-                    self.onSelectionChanged();
-                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
-                    if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-                        [weakTarget.target selectionHasChanged];
-            });
+            int num, gen, try_repair = 0;
+            int64_t stm_ofs;
+            fz_seek(ctx, stm, offset, SEEK_SET);
+            trailer = pdf_parse_ind_obj(ctx, idoc, stm, &buf, &num, &gen, &stm_ofs, &try_repair);
+            if (!pdf_name_eq(ctx, pdf_dict_get(ctx, trailer, PDF_NAME(Type)), PDF_NAME(XRef)))
+                fz_throw(ctx, FZ_ERROR_GENERIC, "cannot find xref stream");
         }
-    });
-}
-
-- (void)loadSomePages
-{
-    assert([NSThread isMainThread]);
-    if (self->_pageCount >= self->_reportedPageCount)
+    }
+    fz_always(ctx)
     {
-        _loadingComplete = YES;
-        if (self.progressBlock)
-            self.progressBlock(self->_pageCount, YES);
-        if (self.successBlock)
-            self.successBlock();
-        for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
-            [weakTarget.target updatePageCount:self->_pageCount andLoadingComplete:YES];
-        [self loadToc];
+        pdf_lexbuf_fin(ctx, &buf);
     }
-    else
+    fz_catch(ctx)
     {
-        dispatch_async(self.mulib.queue, ^{
-            fz_context *ctx = self.mulib.ctx;
-            NSMutableArray<NSNumber *> *pagesWithRedactions = [NSMutableArray array];
-            NSInteger count = MIN(16, self->_reportedPageCount - self->_pageCount);
-            while (count--)
-            {
-                FzPage *page = [self getFzPage:self->_pageCount];
-                fz_try(ctx)
-                {
-                    pdf_document *pdf;
-                    pdf_annot *annot;
-                    fz_rect rect = page.fzpage ? fz_bound_page(ctx, page.fzpage) : fz_empty_rect;
-                    @synchronized (self.pageSizes) {
-                        self.pageSizes[self->_pageCount] = [NSValue valueWithCGSize:CGSizeMake(rect.x1 - rect.x0, rect.y1 - rect.y0)];
-                    }
+        pdf_drop_obj(ctx, trailer);
+        fz_rethrow(ctx);
+    }
 
-                    pdf = pdf_document_from_fz_document(ctx, self.fzdoc);
-                    if (pdf)
-                    {
-                        pdf_page *ppage = (pdf_page *)page.fzpage;
-                        if (ppage)
-                        {
-                            for (annot = pdf_first_annot(ctx, ppage); annot; annot = pdf_next_annot(ctx, annot))
-                            {
-                                if (pdf_annot_type(ctx, annot) == PDF_ANNOT_REDACT)
-                                    [pagesWithRedactions addObject:[NSNumber numberWithInteger:self->_pageCount]];
-                            }
-                        }
-                    }
+    return trailer;
+}
 
-                    self->_pageCount++;
-                }
-                fz_catch(ctx)
-                {
-                }
-            }
-            __weak typeof(self) weakSelf = self;
-            dispatch_async(dispatch_get_main_queue(), ^{
-                typeof(self) strongSelf = weakSelf;
-                if (strongSelf)
-                {
-                    [strongSelf->_pagesWithRedactions addObjectsFromArray:pagesWithRedactions];
-                    if (strongSelf.progressBlock)
-                        strongSelf.progressBlock(strongSelf.pageCount, NO);
-                    for (MuPDFDKWeakEventTarget *weakTarget in strongSelf.eventTargets)
-                        [weakTarget.target updatePageCount:strongSelf.pageCount andLoadingComplete:NO];
-                    [strongSelf loadSomePages];
-                }
-            });
-        });
-    }
+@implementation MuPDFDKDoc
+{
+    MuPDFPrintProfile _printProfile;
+    ARDKSoftProfile _softProfile;
+    NSInteger _reportedPageCount;
+    NSMutableDictionary<NSNumber *, FzPageHolder *> *_fzpages;
+    NSArray<MuPDFDKPageHolder *> *_pages;
+    BOOL _pdfFormFillingEnabled;
+    // Set while the document's content is still arriving
+    id<MuPDFDKProgressiveSource> _source;
+    // Set, on the mupdf queue, when an operation fails for want of data
+    BOOL _awaitingData;
+    // The pages rendered without some of their content, for want of data, to
+    // be rendered again once more has arrived. Accessed on the mupdf queue
+    NSMutableIndexSet *_incompletePages;
+    // The file to which the edit journal's records apply, and the update
+    // recovered from the journal, if any. The document's own file is always
+    // the former with the latter appended. Accessed on the save queue.
+    NSString *_journalDocPath;
+    NSData *_journalPrefix;
+    // The temporary copy of the document's file, with the update recovered from
+    // the journal appended, from which it was loaded, until next saved
+    NSString *_recoveredPath;
+    // The identity of _journalDocPath recorded with each record, found when
+    // first needed
+    NSData *_journalDocIdentity;
+    // The quads of the visible form fields, per page, as found by
+    // formFieldQuadsForPage:, including that with the focus, which is left
+    // out only when read. Accessed on the mupdf queue.
+    NSMutableDictionary<NSNumber *, NSArray<MuPDFDKWidgetQuad *> *> *_formFieldQuads;
+    // The dependencies between form fields, and the index of their names,
+    // built when first needed. Accessed on the mupdf queue.
+    MuPDFDKFormGraph *_formGraph;
+    MuPDFDKFieldIndex *_fieldIndex;
 }
 
-- (ARError)loadDocument
+@synthesize progressBlock=_progressBlock, successBlock=_successBlock, errorBlock=_errorBlock,
+            docType = _docType, hasBeenModified = _hasBeenModified, loadingComplete = _loadingComplete,
+            pageCount = _pageCount, pdfFormSigningEnabled = _pdfFormSigningEnabled, pasteboard = _pasteboard;
+
++ (ARDKDocType)docTypeFromFileExtension:(NSString *)filePath
 {
-    BOOL jsEnable = _pdfFormFillingEnabled;
-    const char *magic = "file.pdf";
-    switch (_docType)
+    NSString *ext = [filePath pathExtension].uppercaseString;
+    if ([ext isEqualToString:@"PDF"])
+        return ARDKDocType_PDF;
+    else if ([ext isEqualToString:@"CBZ"]
+        || [ext isEqualToString:@"CBT"])
+        return ARDKDocType_CBZ;
+    else if ([ext isEqualToString:@"FB2"]
+             || [ext isEqualToString:@"XHTML"])
+        return ARDKDocType_FB2;
+    else if ([ext isEqualToString:@"SVG"])
+        return ARDKDocType_SVG;
+    else if ([ext isEqualToString:@"XPS"]
+             || [ext isEqualToString:@"OXPS"])
+        return ARDKDocType_XPS;
+    else if ([ext isEqualToString:@"EPUB"])
+        return ARDKDocType_EPUB;
+    return ARDKDocType_Other;
+}
+
+- (instancetype)initForPath:(NSString *)path ofType:(ARDKDocType)docType lib:(MuPDFDKLib *)lib
+{
+    self = [super init];
+    if (self)
     {
-        case ARDKDocType_EPUB: magic = "file.epub"; break;
-        case ARDKDocType_SVG: magic = "file.svg"; break;
-        case ARDKDocType_XPS: magic = "file.xps"; break;
-        case ARDKDocType_FB2: magic = "file.fb2"; break;
-        case ARDKDocType_CBZ: magic = "file.cbz"; break;
-        default: break;
+        _mulib = lib;
+        _docType = docType;
+        _path = path;
+        _pageSizes = [NSMutableArray array];
+        _pages = [NSArray array];
+        _selections = [NSMutableDictionary dictionary];
+        _pagesWithRedactions = [NSMutableSet set];
+        _eventTargets = [NSMutableArray array];
+        _fzpages = [NSMutableDictionary dictionaryWithCapacity:INITIAL_FZPAGE_CACHE_SIZE];
+        _formFieldQuads = [NSMutableDictionary dictionary];
+        _incompletePages = [NSMutableIndexSet indexSet];
+        _saveQueue = dispatch_queue_create("com.artifex.mupdf.save", NULL);
     }
-    dispatch_async(self.mulib.queue, ^{
-        fz_context *ctx = self.mulib.ctx;
-        pdf_document *pdoc = NULL;
-        NSInteger count = 0;
-        BOOL needsPassword = NO;
-        BOOL failed = NO;
-        BOOL acroForm = NO;
-        BOOL xfaForm = NO;
-        fz_var(count);
-        fz_var(needsPassword);
-        fz_var(failed);
-        fz_var(xfaForm);
-        fz_try(ctx)
-        {
-            if (MuPDFDKLib.secureFS && [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:@(self.path.UTF8String)])
-                self->_stream = secure_stream(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:@(self.path.UTF8String)]);
-            else
-                self->_stream = fz_open_file(ctx, self.path.UTF8String);
+    return self;
+}
 
-            self->_fzdoc = fz_open_document_with_stream(ctx, magic, self->_stream);
-            needsPassword = fz_needs_password(ctx, self->_fzdoc) != 0;
-            pdoc = pdf_document_from_fz_document(ctx, self->_fzdoc);
-            if (pdoc)
-            {
-                pdf_obj *fields = pdf_dict_getp(ctx, pdf_trailer(ctx, pdoc), "Root/AcroForm/Fields");
-                pdf_obj *xfa = pdf_dict_getp(ctx, pdf_trailer(ctx, pdoc), "Root/AcroForm/XFA");
-                xfaForm = (xfa != NULL);
-                acroForm = (fields != NULL && pdf_array_len(ctx, fields) > 0);
-            }
-            count = fz_count_pages(ctx, self.fzdoc);
-            [self enableJS:jsEnable];
-        }
-        fz_catch(ctx)
-        {
-            failed = YES;
-        }
-        dispatch_async(dispatch_get_main_queue(), ^{
-            if (failed)
-            {
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
-                return;
-            }
+- (instancetype)initForSource:(id<MuPDFDKProgressiveSource>)source atPath:(NSString *)path ofType:(ARDKDocType)docType lib:(MuPDFDKLib *)lib
+{
+    self = [self initForPath:path ofType:docType lib:lib];
+    if (self)
+        _source = source;
 
-            self->_reportedPageCount = count;
-            if (needsPassword)
-            {
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_PasswordRequest);
-            }
-            else if (count <= 0)
-            {
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
-                // A document may continue to load after an error, but
-                // not in this case, so signal loading compelete.
-                if (self.progressBlock)
-                    self.progressBlock(0, YES);
-                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
-                    [weakTarget.target updatePageCount:0 andLoadingComplete:YES];
-            }
-            else
-            {
-                self->_hasXFAForm = xfaForm;
+    return self;
+}
 
-                if (xfaForm && !acroForm)
-                {
-                    if (self.errorBlock)
-                        self.errorBlock(ARDKDocErrorType_XFAForm);
-                }
+- (void)dealloc
+{
+    fz_context *ctx = _mulib.ctx;
+    fz_stream *stream = _stream;
+    fz_document *doc = _fzdoc;
+    dispatch_async_if_needed(_mulib.queue, ^{
+        fz_drop_document(ctx, doc);
+        fz_drop_stream(ctx, stream);
+    });
+}
 
-                [self loadSomePages];
-            }
+- (void)doAfterBackgroundTasks:(void (^)(void))block
+{
+    dispatch_async(self.mulib.queue, ^{
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block();
         });
     });
-
-    return 0;
 }
-
-- (BOOL)haveTextSelection
+- (void)addTarget:(id<ARDKDocumentEventTarget>)target
 {
-    return [self.selections.allValues.firstObject isKindOfClass:MuPDFDKTextSelection.class];
+    [_eventTargets addObject:[MuPDFDKWeakEventTarget weakHolder:target]];
+    if (self.loadingComplete)
+    {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [target updatePageCount:self.pageCount andLoadingComplete:YES];
+        });
+    }
 }
 
-- (BOOL)haveAnnotationSelection
+- (NSInteger)pageCount
 {
-    return [self.selections.allValues.firstObject isKindOfClass:MuPDFDKAnnotationInternal.class];
+    @synchronized (self.pageSizes) {
+        return self.pageSizes.count;
+    }
 }
 
-- (void)selectAnnotation:(MuPDFDKAnnotation *)annot onPage:(NSInteger)pageNum
+- (id<ARDKLib>)lib
 {
-    self.selections[@(pageNum)] = (MuPDFDKAnnotationInternal *)annot;
-    [self selectionChangedForPage:pageNum];
-    [self setSelectionIsRedaction:(annot.type == MuPDFAnnotType_Redact)];
-
-    if (self.onSelectionChanged)
-        self.onSelectionChanged();
-    for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
-        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-            [weakTarget.target selectionHasChanged];
+    return _mulib;
 }
 
-- (BOOL)selectionIsTextHighlight
+- (void)enableJS:(BOOL)enable
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
-    {
-        return ((MuPDFDKAnnotationInternal *)selection).type == MuPDFAnnotType_Highlight;
-    }
-    else
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
+    if (idoc)
     {
-        return  NO;
+        if (enable)
+        {
+            pdf_enable_js(ctx, idoc);
+            // Pass self into the mupdf library. This is safe because the callback
+            // is triggered only by calls that we make, for which we ensure a reference
+            // is kept.
+            pdf_set_doc_event_callback(ctx, idoc, event_cb, (__bridge void *)self);
+        }
+        else
+        {
+            pdf_disable_js(ctx, idoc);
+            pdf_set_doc_event_callback(ctx, idoc, NULL, NULL);
+        }
     }
 }
 
-- (BOOL)selectionIsWidget
+- (NSString *)documentAuthor
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
-    {
-        return ((MuPDFDKAnnotationInternal *)selection).type == MuPDFAnnotType_Widget;
-    }
-    else
-    {
-        return  NO;
-    }
+    NSString *author = [[NSUserDefaults standardUserDefaults] stringForKey:documentAuthorKey];
+    if (!author)
+        author = [[NSBundle mainBundle] objectForInfoDictionaryKey:@"CFBundleName"];
+    return author;
 }
 
-- (BOOL)selectionIsAnnotationWithText
+- (void)setDocumentAuthor:(NSString *)documentAuthor
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] && ((MuPDFDKAnnotationInternal *)selection).hasText;
+    [[NSUserDefaults standardUserDefaults] setObject:documentAuthor forKey:documentAuthorKey];
 }
 
-- (NSString *)selectedAnnotationsText
+- (void)setSelectionIsRedaction:(BOOL)isRedaction
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).text : nil;
+    self->_selectionIsRedaction = isRedaction;
 }
 
-- (void)setText:(NSString *)text forAnnotIndex:(NSInteger)index onPage:(NSInteger)pageNo
+- (BOOL)pdfFormFillingEnabled
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections[@(pageNo)];
-    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
-    {
-        ((MuPDFDKAnnotationInternal *)selection).text = text;
-        dispatch_async(self.mulib.queue, ^{
-            fz_context *ctx = self.mulib.ctx;
-            FzPage *page = [self getFzPage:pageNo];
-
-            fz_var(page);
-            fz_try(ctx)
-            {
-                pdf_annot *annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
-                for (int i = 0; i < index && annot; i++)
-                    annot = pdf_next_annot(ctx, annot);
+    return _pdfFormFillingEnabled;
+}
 
-                if (annot)
-                {
-                    pdf_set_annot_contents(ctx, annot, text.UTF8String);
-                    dispatch_async(dispatch_get_main_queue(), ^{
-                        if (self.onSelectionChanged)
-                            self.onSelectionChanged();
-                        for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
-                            if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-                                [weakTarget.target selectionHasChanged];
-                    });
-                }
-            }
-            fz_catch(ctx)
-            {
-            }
-        });
-    }
-}
-
-- (void)setSelectedAnnotationsText:(NSString *)text
-{
-    NSNumber *p = self.selections.allKeys.firstObject;
-    NSObject<MuPDFDKSelection> *selection = self.selections[p];
-    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
-        [self setText:text forAnnotIndex:((MuPDFDKAnnotationInternal *)selection).index onPage:p.integerValue];
-}
-
-- (NSDate *)selectedAnnotationsDate
+- (void)setPdfFormFillingEnabled:(BOOL)pdfFormFillingEnabled
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).date : nil;
+    _pdfFormFillingEnabled = pdfFormFillingEnabled;
+    dispatch_async(self.mulib.queue, ^{
+        [self enableJS:pdfFormFillingEnabled];
+    });
 }
 
-- (NSString *)selectedAnnotationsAuthor
+- (BOOL)pdfFormSigningEnabled
 {
-    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
-    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).author : nil;
+    return _pdfFormSigningEnabled;
 }
 
-- (void)selectionChangedForPage:(NSInteger)pageNo
+- (void)setPdfFormSigningEnabled:(BOOL)pdfFormSigningEnabled
 {
-    for (MuPDFDKPageHolder *h in _pages)
-        if (h.pageNo == pageNo && h.page && h.page.onSelectionChanged)
-            h.page.onSelectionChanged();
+    _pdfFormSigningEnabled = pdfFormSigningEnabled;
 }
 
-- (void)clearSelection
+- (ARDKBitmap *)bitmapAtSize:(CGSize)size
 {
-    BOOL changed = NO;
-
-    for (NSNumber *n in self.selections)
-    {
-        changed = YES;
-        self.selections[n] = nil;
-        [self selectionChangedForPage:n.integerValue];
-    }
-
-    for (NSNumber *n in self.selections)
-    {
-        changed = YES;
-        self.selections[n] = nil;
-        [self selectionChangedForPage:n.integerValue];
-    }
-
-    [self setSelectionIsRedaction:NO];
-
-    if (changed)
-    {
-        if (_onSelectionChanged)
-            _onSelectionChanged();
-        for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
-            if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-                [weakTarget.target selectionHasChanged];
-    }
+    return [ARDKBitmap bitmapAtSize:size ofType:ARDKBitmapType_RGBA8888];
 }
 
-- (void)forSelectedPages:(void (^)(NSInteger, NSArray<MuPDFDKQuad *> *))block
+static NSMutableArray<id<ARDKTocEntry>> *tocFromOutline(fz_outline *outline, int depth)
 {
-    NSInteger first = NSIntegerMax;
-    NSInteger last = NSIntegerMin;
+    NSMutableArray<id<ARDKTocEntry>> *arr = [NSMutableArray array];
 
-    for (NSNumber *n in [self.selections.allKeys arrayByAddingObjectsFromArray:self.selections.allKeys])
+    for (;outline; outline = outline->next)
     {
-        if (n.integerValue < first)
-            first = n.integerValue;
-        if (n.integerValue > last)
-            last = n.integerValue;
-    }
+        MuPDFDKTocEntry *tocEntry = [[MuPDFDKTocEntry alloc] init];
+        if (outline->title)
+            tocEntry.label = @(outline->title);
+        if (outline->uri)
+            tocEntry.url = @(outline->uri);
+        tocEntry.page = outline->page;
+        tocEntry.rect = CGRectMake(outline->x, outline->y, 0, 0);
+        tocEntry.depth = depth;
+        tocEntry.open = outline->is_open != 0;
+        tocEntry.children = tocFromOutline(outline->down, depth+1);
 
-    for (NSInteger p = first; p <= last; p++)
-    {
-        block(p, selectionAsQuads(self.selections[@(p)]));
+        [arr addObject:tocEntry];
     }
-}
 
-- (void)findFormFields
-{
-    @synchronized(_pages)
-    {
-        for (MuPDFDKPageHolder *holder in _pages)
-            [holder.page findFormFields];
-    }
+    return arr;
 }
 
-- (void)clearFocus
+- (void)loadToc
 {
     dispatch_async(self.mulib.queue, ^{
         fz_context *ctx = self.mulib.ctx;
+        fz_outline *outline = NULL;
+        pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
+        if (!idoc)
+            return;
+
+        NSArray<id<ARDKTocEntry>> *toc;
+
+        fz_var(outline);
         fz_try(ctx)
         {
-            pdf_document *idoc = pdf_document_from_fz_document(ctx, self.fzdoc);
-            if (idoc)
-            {
-                FzPage *fzPage = [self getFzPage:self.focusPageNumber];
-                for (pdf_widget *w = pdf_first_widget(ctx, (pdf_page *)fzPage.fzpage)
-                     ; w
-                     ; w = pdf_next_widget(ctx, w))
-                {
-                    if (w->is_hot)
-                    {
-                        w->is_hot = 0;
-                        pdf_annot_event_blur(ctx, w);
-                    }
-                }
-            }
+            outline = pdf_load_outline(ctx, idoc);
+            toc = tocFromOutline(outline, 0);
+        }
+        fz_always(ctx)
+        {
+            fz_drop_outline(ctx, outline);
         }
         fz_catch(ctx)
         {
         }
 
-        dispatch_async(dispatch_get_main_queue(), ^{
-            [self findFormFields];
-        });
+        if(toc)
+        {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                self->_toc = toc;
+                // Trick: report a selection change so that the app updates the UI
+                if (self.onSelectionChanged)
+                    self.onSelectionChanged();
+                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
+                    if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+                        [weakTarget.target selectionHasChanged];
+            });
+        }
     });
 }
 
-- (void)annotateSelection:(enum pdf_annot_type)annot_type leaveSelected:(BOOL)leaveSelected
+/// Call a block on the UI thread once more of a progressively arriving document is
+/// available, or straight away if the document has since fully arrived on file
+- (void)whenMoreDataAvailable:(void (^)(void))block
 {
-    NSString *author = self.documentAuthor;
-    [self forSelectedPages:^(NSInteger pageNo, NSArray<MuPDFDKQuad *> *quads) {
-        if (quads.count > 0)
-        {
-            if (annot_type == PDF_ANNOT_REDACT)
-                [self->_pagesWithRedactions addObject:[NSNumber numberWithInteger:pageNo]];
+    id<MuPDFDKProgressiveSource> source = _source;
+    if (source == nil)
+    {
+        dispatch_async(dispatch_get_main_queue(), block);
+        return;
+    }
 
-            dispatch_async(self.mulib.queue, ^{
-                fz_context *ctx = self.mulib.ctx;
-                pdf_document *idoc;
-                FzPage *page = [self getFzPage:pageNo];
-                fz_quad *fzquads = NULL;
+    [source whenMoreThan:source.bytesAvailable call:^{
+        dispatch_async(dispatch_get_main_queue(), block);
+    }];
+}
 
-                idoc = pdf_specifics(ctx, self->_fzdoc);
-                if (!idoc)
-                    return;
+- (void)loadSomePages
+{
+    assert([NSThread isMainThread]);
+    if (self->_pageCount >= self->_reportedPageCount)
+    {
+        _loadingComplete = YES;
+        if (self.progressBlock)
+            self.progressBlock(self->_pageCount, YES);
+        if (self.successBlock)
+            self.successBlock();
+        for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
+            [weakTarget.target updatePageCount:self->_pageCount andLoadingComplete:YES];
+        [self loadToc];
+    }
+    else
+    {
+        dispatch_async(self.mulib.queue, ^{
+            fz_context *ctx = self.mulib.ctx;
+            NSMutableArray<NSNumber *> *pagesWithRedactions = [NSMutableArray array];
+            NSInteger count = MIN(16, self->_reportedPageCount - self->_pageCount);
+            self->_awaitingData = NO;
+            while (count--)
+            {
+                FzPage *page = [self getFzPage:self->_pageCount];
+                // Pages of a progressively arriving document are reported
+                // in order, as the data for each becomes available
+                if (self->_awaitingData)
+                    break;
 
-                fz_var(fzquads);
                 fz_try(ctx)
                 {
-                    int i;
+                    pdf_document *pdf;
                     pdf_annot *annot;
+                    fz_rect rect = page.fzpage ? fz_bound_page(ctx, page.fzpage) : fz_empty_rect;
+                    @synchronized (self.pageSizes) {
+                        self.pageSizes[self->_pageCount] = [NSValue valueWithCGSize:CGSizeMake(rect.x1 - rect.x0, rect.y1 - rect.y0)];
+                    }
 
-                    fzquads = fz_malloc_array(ctx, (int)quads.count, fz_quad);
-                    for (i = 0; i < quads.count; i++)
-                        fzquads[i] = quad_to_fz(quads[i]);
-
-                    if (page.fzpage)
+                    pdf = pdf_document_from_fz_document(ctx, self.fzdoc);
+                    if (pdf)
                     {
-                        annot = pdf_create_annot(ctx, (pdf_page *)page.fzpage, annot_type);
-                        pdf_set_annot_quad_points(ctx, annot, (int)quads.count, fzquads);
-                        if (annot_type == PDF_ANNOT_HIGHLIGHT)
-                            pdf_set_annot_color(ctx, annot, 3, highlight_color);
-
-                        if (author)
-                            pdf_set_annot_author(ctx, annot, author.UTF8String);
-                        pdf_set_annot_modification_date(ctx, annot, NSDate.date.timeIntervalSince1970);
-                        [self updatePages];
-
-                        if (leaveSelected)
+                        pdf_page *ppage = (pdf_page *)page.fzpage;
+                        if (ppage)
                         {
-                            // Look up the created annotation to find it's index.
-                            // Possibly we shouldn't be using indexs, but caching the annotations themselves
-                            // is risky when they may get deleted.
-                            NSInteger index = 0;
-                            for (pdf_annot *a = pdf_first_annot(ctx, (pdf_page *)page.fzpage); a; a = pdf_next_annot(ctx, a))
+                            for (annot = pdf_first_annot(ctx, ppage); annot; annot = pdf_next_annot(ctx, annot))
                             {
-                                if (a == annot)
-                                {
-                                    MuPDFDKAnnotationInternal *wannot = [MuPDFDKAnnotationInternal annotFromAnnot:a andIndex:index withCtx:ctx];
-                                    dispatch_async(dispatch_get_main_queue(), ^{
-                                        [self selectAnnotation:wannot onPage:pageNo];
-                                    });
-                                    break;
-                                }
-                                ++index;
+                                if (pdf_annot_type(ctx, annot) == PDF_ANNOT_REDACT)
+                                    [pagesWithRedactions addObject:[NSNumber numberWithInteger:self->_pageCount]];
                             }
-                        }
-                        else
-                        {
-                            dispatch_async(dispatch_get_main_queue(), ^{
-                                [self clearSelection];
-                            });
+
+                            if (self.indexFormFields)
+                                (void)[self formFieldQuadsForPage:self->_pageCount];
                         }
                     }
-                }
-                fz_always(ctx)
-                {
-                    fz_free(ctx, fzquads);
+
+                    self->_pageCount++;
                 }
                 fz_catch(ctx)
                 {
-                    NSLog(@"Annotation creation failed");
+                }
+            }
+            BOOL awaitingData = self->_awaitingData;
+            __weak typeof(self) weakSelf = self;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                typeof(self) strongSelf = weakSelf;
+                if (strongSelf)
+                {
+                    [strongSelf->_pagesWithRedactions addObjectsFromArray:pagesWithRedactions];
+                    if (strongSelf.progressBlock)
+                        strongSelf.progressBlock(strongSelf.pageCount, NO);
+                    for (MuPDFDKWeakEventTarget *weakTarget in strongSelf.eventTargets)
+                        [weakTarget.target updatePageCount:strongSelf.pageCount andLoadingComplete:NO];
+                    if (awaitingData)
+                        [strongSelf whenMoreDataAvailable:^{
+                            [weakSelf loadSomePages];
+                        }];
+                    else
+                        [strongSelf loadSomePages];
                 }
             });
-        }
-    }];
+        });
+    }
 }
 
-- (void)addHighlightAnnotationDelayedLeaveSelected:(BOOL)leaveSelected
+/// The file from which the document is loaded: its own, or the copy recovered
+/// from the edit journal
+- (NSString *)loadedPath
 {
-    [self annotateSelection:PDF_ANNOT_HIGHLIGHT leaveSelected:leaveSelected];
+    return _recoveredPath ? _recoveredPath : _path;
 }
 
-- (void)addHighlightAnnotationLeaveSelected:(BOOL)leaveSelected
+/// Open a stream on the document's file. Must be called on the mupdf queue.
+- (fz_stream *)openStream
 {
-    __weak typeof(self) weakSelf = self;
-    [self doAfterBackgroundTasks:^{
-        [weakSelf addHighlightAnnotationDelayedLeaveSelected:leaveSelected];
-    }];
-}
+    fz_context *ctx = self.mulib.ctx;
+    if (_source)
+        return progressive_stream(ctx, _source);
 
-- (void)addRedactAnnotation
-{
-    [self annotateSelection:PDF_ANNOT_REDACT leaveSelected:NO];
+    return [self openStreamOnFile:self.loadedPath ctx:ctx];
 }
 
-- (BOOL)hasRedactions
+/// Open a stream on a local file, using either the mupdf queue's context, or a
+/// clone of it for reading the file elsewhere
+- (fz_stream *)openStreamOnFile:(NSString *)path ctx:(fz_context *)ctx
 {
-    return _pagesWithRedactions.count > 0;
+    if (MuPDFDKLib.secureFS && [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:@(path.UTF8String)])
+        return secure_stream(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:@(path.UTF8String)]);
+
+    if (self.mulib.settings.mapLocalFiles)
+    {
+        // Saving either replaces the file or appends to it, so
+        // the mapped bytes are not disturbed by subsequent saves
+        fz_stream *stm = mapped_stream(ctx, path.UTF8String);
+        if (stm)
+            return stm;
+    }
+
+    return fz_open_file(ctx, path.UTF8String);
 }
 
-- (void)finalizeRedactAnnotations:(void (^)(void))onComplete
+- (ARError)loadDocument
 {
-    __block NSInteger numPages = _pagesWithRedactions.count;
-
-    if (numPages == 0)
+    BOOL jsEnable = _pdfFormFillingEnabled;
+    const char *magic = "file.pdf";
+    switch (_docType)
     {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            onComplete();
-        });
+        case ARDKDocType_EPUB: magic = "file.epub"; break;
+        case ARDKDocType_SVG: magic = "file.svg"; break;
+        case ARDKDocType_XPS: magic = "file.xps"; break;
+        case ARDKDocType_FB2: magic = "file.fb2"; break;
+        case ARDKDocType_CBZ: magic = "file.cbz"; break;
+        default: break;
     }
-    else
-    {
-        for (NSNumber *n in _pagesWithRedactions)
+    dispatch_async(self.mulib.queue, ^{
+        fz_context *ctx = self.mulib.ctx;
+        pdf_document *pdoc = NULL;
+        NSInteger count = 0;
+        BOOL needsPassword = NO;
+        BOOL failed = NO;
+        BOOL awaitingData = NO;
+        BOOL acroForm = NO;
+        BOOL xfaForm = NO;
+        fz_var(count);
+        fz_var(needsPassword);
+        fz_var(failed);
+        fz_var(awaitingData);
+        fz_var(xfaForm);
+        fz_try(ctx)
         {
-            dispatch_async(self.mulib.queue, ^{
-                fz_context *ctx = self.mulib.ctx;
-                fz_try(ctx)
-                {
-                    pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
-                    if (idoc)
-                    {
-                        pdf_redact_options opts = {1, PDF_REDACT_IMAGE_PIXELS};
-                        FzPage *fzPage = [self getFzPage:n.integerValue];
-                        pdf_redact_page(ctx, idoc, (pdf_page *)fzPage.fzpage, &opts);
-                        // pdf_redact_page doesn't mark any annotations as changed, so
-                        // calling updatePages wont work. Instead trigger an update for
-                        // the entire page.
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self updatePageNumbered:n.integerValue];
-                        });
-                    }
-                }
-                fz_catch(ctx)
+            // For progressively arriving documents, this may be a retry
+            if (self->_stream == NULL)
+            {
+                if (self->_source == nil)
                 {
+                    [self recoverInterruptedSave];
+                    [self recoverFromJournal];
                 }
+                self->_stream = [self openStream];
+            }
+            if (self->_fzdoc == NULL)
+                self->_fzdoc = fz_open_document_with_stream(ctx, magic, self->_stream);
+            needsPassword = fz_needs_password(ctx, self->_fzdoc) != 0;
+            pdoc = pdf_document_from_fz_document(ctx, self->_fzdoc);
+            if (pdoc)
+            {
+                pdf_obj *fields = pdf_dict_getp(ctx, pdf_trailer(ctx, pdoc), "Root/AcroForm/Fields");
+                pdf_obj *xfa = pdf_dict_getp(ctx, pdf_trailer(ctx, pdoc), "Root/AcroForm/XFA");
+                xfaForm = (xfa != NULL);
+                acroForm = (fields != NULL && pdf_array_len(ctx, fields) > 0);
+            }
+            count = fz_count_pages(ctx, self.fzdoc);
+            [self enableJS:jsEnable];
+        }
+        fz_catch(ctx)
+        {
+            if (self->_source && fz_caught(ctx) == FZ_ERROR_TRYLATER)
+                awaitingData = YES;
+            else
+                failed = YES;
+        }
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (failed)
+            {
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
+                return;
+            }
 
-                if (--numPages == 0)
+            if (awaitingData)
+            {
+                // The document structure, or for linearized files the first
+                // page's, is yet to arrive
+                [self whenMoreDataAvailable:^{
+                    [self loadDocument];
+                }];
+                return;
+            }
+
+            self->_reportedPageCount = count;
+            // Edits recovered from the journal are yet to be saved
+            if (self.recoveredFromJournal)
+                self.hasBeenModified = YES;
+            if (needsPassword)
+            {
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_PasswordRequest);
+            }
+            else if (count <= 0)
+            {
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
+                // A document may continue to load after an error, but
+                // not in this case, so signal loading compelete.
+                if (self.progressBlock)
+                    self.progressBlock(0, YES);
+                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
+                    [weakTarget.target updatePageCount:0 andLoadingComplete:YES];
+            }
+            else
+            {
+                self->_hasXFAForm = xfaForm;
+
+                if (xfaForm && !acroForm)
                 {
-                    dispatch_async(dispatch_get_main_queue(), ^{
-                        onComplete();
-                    });
+                    if (self.errorBlock)
+                        self.errorBlock(ARDKDocErrorType_XFAForm);
                 }
-            });
-        }
 
-        [_pagesWithRedactions removeAllObjects];
+                [self loadSomePages];
+            }
+        });
+    });
+
+    return 0;
+}
+
+- (BOOL)haveTextSelection
+{
+    return [self.selections.allValues.firstObject isKindOfClass:MuPDFDKTextSelection.class];
+}
+
+- (BOOL)haveAnnotationSelection
+{
+    return [self.selections.allValues.firstObject isKindOfClass:MuPDFDKAnnotationInternal.class];
+}
+
+- (void)selectAnnotation:(MuPDFDKAnnotation *)annot onPage:(NSInteger)pageNum
+{
+    self.selections[@(pageNum)] = (MuPDFDKAnnotationInternal *)annot;
+    [self selectionChangedForPage:pageNum];
+    [self setSelectionIsRedaction:(annot.type == MuPDFAnnotType_Redact)];
+
+    if (self.onSelectionChanged)
+        self.onSelectionChanged();
+    for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
+        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+            [weakTarget.target selectionHasChanged];
+}
+
+- (BOOL)selectionIsTextHighlight
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+    {
+        return ((MuPDFDKAnnotationInternal *)selection).type == MuPDFAnnotType_Highlight;
+    }
+    else
+    {
+        return  NO;
     }
 }
 
-- (void)deleteSelectedAnnotation
+- (BOOL)selectionIsWidget
 {
-    for (NSNumber *n in self.selections.allKeys)
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
     {
-        NSInteger pageNumber = n.integerValue;
-        NSObject<MuPDFDKSelection> *selection = self.selections[n];
-        if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
-        {
-            MuPDFDKAnnotationInternal *mannot = ((MuPDFDKAnnotationInternal *)selection);
-            NSInteger index = mannot.index;
-            BOOL isWidget = mannot.isWidget;
-            dispatch_async(self.mulib.queue, ^{
-                fz_context *ctx = self.mulib.ctx;
-                pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
-                if (!idoc)
-                    return;
+        return ((MuPDFDKAnnotationInternal *)selection).type == MuPDFAnnotType_Widget;
+    }
+    else
+    {
+        return  NO;
+    }
+}
 
-                FzPage *page = [self getFzPage:n.integerValue];
-                fz_try(ctx)
-                {
-                    pdf_annot *annot;
-                    if (isWidget)
-                    {
-                        annot = page.fzpage ? pdf_first_widget(ctx, (pdf_page *)page.fzpage) : NULL;
-                        for (int i = 0; i < index && annot; i++)
-                            annot = pdf_next_widget(ctx, annot);
-                    }
-                    else
-                    {
-                        annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
-                        for (int i = 0; i < index && annot; i++)
-                            annot = pdf_next_annot(ctx, annot);
-                    }
+- (BOOL)selectionIsAnnotationWithText
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] && ((MuPDFDKAnnotationInternal *)selection).hasText;
+}
 
-                    if (annot)
-                    {
-                        fz_rect rect = pdf_bound_annot(ctx, annot);
-                        pdf_delete_annot(ctx, (pdf_page *)page.fzpage, annot);
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self updatePageNumbered:pageNumber changedRects:@[[NSValue valueWithCGRect:rect_from_fz(rect)]]];
-                        });
-                    }
-                }
-                fz_catch(ctx)
-                {
-                }
-            });
+- (NSString *)selectedAnnotationsText
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).text : nil;
+}
+
+- (void)setText:(NSString *)text forAnnotIndex:(NSInteger)index onPage:(NSInteger)pageNo
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections[@(pageNo)];
+    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+    {
+        ((MuPDFDKAnnotationInternal *)selection).text = text;
+        dispatch_async(self.mulib.queue, ^{
+            fz_context *ctx = self.mulib.ctx;
+            FzPage *page = [self getFzPage:pageNo];
+
+            fz_var(page);
+            fz_try(ctx)
+            {
+                pdf_annot *annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
+                for (int i = 0; i < index && annot; i++)
+                    annot = pdf_next_annot(ctx, annot);
+
+                if (annot)
+                {
+                    pdf_set_annot_contents(ctx, annot, text.UTF8String);
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        if (self.onSelectionChanged)
+                            self.onSelectionChanged();
+                        for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
+                            if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+                                [weakTarget.target selectionHasChanged];
+                    });
+                }
+            }
+            fz_catch(ctx)
+            {
+            }
+        });
+    }
+}
+
+- (void)setSelectedAnnotationsText:(NSString *)text
+{
+    NSNumber *p = self.selections.allKeys.firstObject;
+    NSObject<MuPDFDKSelection> *selection = self.selections[p];
+    if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+        [self setText:text forAnnotIndex:((MuPDFDKAnnotationInternal *)selection).index onPage:p.integerValue];
+}
+
+- (NSDate *)selectedAnnotationsDate
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).date : nil;
+}
+
+- (NSString *)selectedAnnotationsAuthor
+{
+    NSObject<MuPDFDKSelection> *selection = self.selections.allValues.firstObject;
+    return [selection isKindOfClass:MuPDFDKAnnotationInternal.class] ? ((MuPDFDKAnnotationInternal *)selection).author : nil;
+}
+
+- (void)selectionChangedForPage:(NSInteger)pageNo
+{
+    for (MuPDFDKPageHolder *h in _pages)
+        if (h.pageNo == pageNo && h.page && h.page.onSelectionChanged)
+            h.page.onSelectionChanged();
+}
+
+- (void)clearSelection
+{
+    BOOL changed = NO;
+
+    for (NSNumber *n in self.selections)
+    {
+        changed = YES;
+        self.selections[n] = nil;
+        [self selectionChangedForPage:n.integerValue];
+    }
+
+    for (NSNumber *n in self.selections)
+    {
+        changed = YES;
+        self.selections[n] = nil;
+        [self selectionChangedForPage:n.integerValue];
+    }
+
+    [self setSelectionIsRedaction:NO];
+
+    if (changed)
+    {
+        if (_onSelectionChanged)
+            _onSelectionChanged();
+        for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
+            if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+                [weakTarget.target selectionHasChanged];
+    }
+}
+
+- (void)forSelectedPages:(void (^)(NSInteger, NSArray<MuPDFDKQuad *> *))block
+{
+    NSInteger first = NSIntegerMax;
+    NSInteger last = NSIntegerMin;
+
+    for (NSNumber *n in [self.selections.allKeys arrayByAddingObjectsFromArray:self.selections.allKeys])
+    {
+        if (n.integerValue < first)
+            first = n.integerValue;
+        if (n.integerValue > last)
+            last = n.integerValue;
+    }
+
+    for (NSInteger p = first; p <= last; p++)
+    {
+        block(p, selectionAsQuads(self.selections[@(p)]));
+    }
+}
+
+- (NSArray<MuPDFDKQuad *> *)formFieldQuadsForPage:(NSInteger)pageNumber
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    NSArray<MuPDFDKWidgetQuad *> *widgetQuads = _formFieldQuads[@(pageNumber)];
+    if (widgetQuads == nil)
+    {
+        NSMutableArray<MuPDFDKWidgetQuad *> *found = [NSMutableArray array];
+        fz_try(ctx)
+        {
+            pdf_widget *widget;
+            pdf_document *idoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+            FzPage *page = [self getFzPage:pageNumber];
+            if (idoc && page.fzpage)
+            {
+                for (widget = pdf_first_widget(ctx, (pdf_page *)page.fzpage); widget; widget = pdf_next_widget(ctx, widget))
+                {
+                    if (widget_is_visible(ctx, widget))
+                    {
+                        MuPDFDKWidgetQuad *widgetQuad = [[MuPDFDKWidgetQuad alloc] init];
+                        widgetQuad.quad = [MuPDFDKQuad quadFromRect:rect_from_fz(pdf_bound_widget(ctx, widget))];
+                        widgetQuad.num = pdf_to_num(ctx, widget->obj);
+                        [found addObject:widgetQuad];
+                    }
+                }
+
+                _formFieldQuads[@(pageNumber)] = found;
+            }
+        }
+        fz_catch(ctx)
+        {
+        }
+
+        widgetQuads = found;
+    }
+
+    // Leave out the focused field. Focus is held by the page's widgets, so
+    // only a page that is loaded can have one.
+    NSMutableIndexSet *hot = [NSMutableIndexSet indexSet];
+    pdf_page *loaded = (pdf_page *)_fzpages[@(pageNumber)].page.fzpage;
+    if (loaded)
+    {
+        for (pdf_widget *widget = pdf_first_widget(ctx, loaded); widget; widget = pdf_next_widget(ctx, widget))
+        {
+            if (widget->is_hot)
+                [hot addIndex:(NSUInteger)pdf_to_num(ctx, widget->obj)];
+        }
+    }
+
+    NSMutableArray<MuPDFDKQuad *> *quads = [NSMutableArray arrayWithCapacity:widgetQuads.count];
+    for (MuPDFDKWidgetQuad *widgetQuad in widgetQuads)
+    {
+        if (![hot containsIndex:(NSUInteger)widgetQuad.num])
+            [quads addObject:widgetQuad.quad];
+    }
+
+    return quads;
+}
+
+- (void)forgetFormFieldsOnPage:(NSInteger)pageNumber
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    [_formFieldQuads removeObjectForKey:@(pageNumber)];
+}
+
+- (void)formFieldQuads:(void (^)(NSDictionary<NSNumber *, NSArray<MuPDFDKQuad *> *> *))block
+{
+    dispatch_async(self.mulib.queue, ^{
+        NSMutableDictionary<NSNumber *, NSArray<MuPDFDKQuad *> *> *quadsByPage = [NSMutableDictionary dictionary];
+        for (NSInteger i = 0; i < self->_pageCount; i++)
+        {
+            NSArray<MuPDFDKQuad *> *quads = [self formFieldQuadsForPage:i];
+            if (quads.count > 0)
+                quadsByPage[@(i)] = quads;
+        }
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            block(quadsByPage);
+        });
+    });
+}
+
+- (void)findFormFields
+{
+    // Called when the focus may have changed, which affects which fields
+    // are listed. The focus is applied as the quads are read, and changes
+    // made by the scripts run on focusing clear the cache via
+    // invalidateAllPages, so the cache remains valid.
+    @synchronized(_pages)
+    {
+        for (MuPDFDKPageHolder *holder in _pages)
+            [holder.page findFormFields];
+    }
+}
+
+- (void)clearFocus
+{
+    dispatch_async(self.mulib.queue, ^{
+        fz_context *ctx = self.mulib.ctx;
+        fz_try(ctx)
+        {
+            pdf_document *idoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+            if (idoc)
+            {
+                FzPage *fzPage = [self getFzPage:self.focusPageNumber];
+                for (pdf_widget *w = pdf_first_widget(ctx, (pdf_page *)fzPage.fzpage)
+                     ; w
+                     ; w = pdf_next_widget(ctx, w))
+                {
+                    if (w->is_hot)
+                    {
+                        NSDictionary<NSNumber *, NSString *> *states = [self widgetStatesBeforeEventsOn:w];
+                        w->is_hot = 0;
+                        pdf_annot_event_blur(ctx, w);
+                        [self widgetEventsRanOn:w withStatesBefore:states];
+                    }
+                }
+            }
+        }
+        fz_catch(ctx)
+        {
+        }
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self findFormFields];
+        });
+    });
+}
+
+- (void)annotateSelection:(enum pdf_annot_type)annot_type leaveSelected:(BOOL)leaveSelected
+{
+    NSString *author = self.documentAuthor;
+    [self forSelectedPages:^(NSInteger pageNo, NSArray<MuPDFDKQuad *> *quads) {
+        if (quads.count > 0)
+        {
+            if (annot_type == PDF_ANNOT_REDACT)
+                [self->_pagesWithRedactions addObject:[NSNumber numberWithInteger:pageNo]];
+
+            dispatch_async(self.mulib.queue, ^{
+                fz_context *ctx = self.mulib.ctx;
+                pdf_document *idoc;
+                FzPage *page = [self getFzPage:pageNo];
+                fz_quad *fzquads = NULL;
+
+                idoc = pdf_specifics(ctx, self->_fzdoc);
+                if (!idoc)
+                    return;
+
+                fz_var(fzquads);
+                fz_try(ctx)
+                {
+                    int i;
+                    pdf_annot *annot;
+
+                    fzquads = fz_malloc_array(ctx, (int)quads.count, fz_quad);
+                    for (i = 0; i < quads.count; i++)
+                        fzquads[i] = quad_to_fz(quads[i]);
+
+                    if (page.fzpage)
+                    {
+                        annot = pdf_create_annot(ctx, (pdf_page *)page.fzpage, annot_type);
+                        pdf_set_annot_quad_points(ctx, annot, (int)quads.count, fzquads);
+                        if (annot_type == PDF_ANNOT_HIGHLIGHT)
+                            pdf_set_annot_color(ctx, annot, 3, highlight_color);
+
+                        if (author)
+                            pdf_set_annot_author(ctx, annot, author.UTF8String);
+                        pdf_set_annot_modification_date(ctx, annot, NSDate.date.timeIntervalSince1970);
+                        [self updatePages];
+
+                        if (leaveSelected)
+                        {
+                            // Look up the created annotation to find it's index.
+                            // Possibly we shouldn't be using indexs, but caching the annotations themselves
+                            // is risky when they may get deleted.
+                            NSInteger index = 0;
+                            for (pdf_annot *a = pdf_first_annot(ctx, (pdf_page *)page.fzpage); a; a = pdf_next_annot(ctx, a))
+                            {
+                                if (a == annot)
+                                {
+                                    MuPDFDKAnnotationInternal *wannot = [MuPDFDKAnnotationInternal annotFromAnnot:a andIndex:index withCtx:ctx];
+                                    dispatch_async(dispatch_get_main_queue(), ^{
+                                        [self selectAnnotation:wannot onPage:pageNo];
+                                    });
+                                    break;
+                                }
+                                ++index;
+                            }
+                        }
+                        else
+                        {
+                            dispatch_async(dispatch_get_main_queue(), ^{
+                                [self clearSelection];
+                            });
+                        }
+                    }
+                }
+                fz_always(ctx)
+                {
+                    fz_free(ctx, fzquads);
+                }
+                fz_catch(ctx)
+                {
+                    NSLog(@"Annotation creation failed");
+                }
+            });
+        }
+    }];
+}
+
+- (void)addHighlightAnnotationDelayedLeaveSelected:(BOOL)leaveSelected
+{
+    [self annotateSelection:PDF_ANNOT_HIGHLIGHT leaveSelected:leaveSelected];
+}
+
+- (void)addHighlightAnnotationLeaveSelected:(BOOL)leaveSelected
+{
+    __weak typeof(self) weakSelf = self;
+    [self doAfterBackgroundTasks:^{
+        [weakSelf addHighlightAnnotationDelayedLeaveSelected:leaveSelected];
+    }];
+}
+
+- (void)addRedactAnnotation
+{
+    [self annotateSelection:PDF_ANNOT_REDACT leaveSelected:NO];
+}
+
+- (BOOL)hasRedactions
+{
+    return _pagesWithRedactions.count > 0;
+}
+
+- (void)finalizeRedactAnnotations:(void (^)(void))onComplete
+{
+    __block NSInteger numPages = _pagesWithRedactions.count;
+
+    if (numPages == 0)
+    {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            onComplete();
+        });
+    }
+    else
+    {
+        for (NSNumber *n in _pagesWithRedactions)
+        {
+            dispatch_async(self.mulib.queue, ^{
+                fz_context *ctx = self.mulib.ctx;
+                fz_try(ctx)
+                {
+                    pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
+                    if (idoc)
+                    {
+                        pdf_redact_options opts = {1, PDF_REDACT_IMAGE_PIXELS};
+                        FzPage *fzPage = [self getFzPage:n.integerValue];
+                        pdf_redact_page(ctx, idoc, (pdf_page *)fzPage.fzpage, &opts);
+                        [self forgetFormFieldsOnPage:n.integerValue];
+                        // pdf_redact_page doesn't mark any annotations as changed, so
+                        // calling updatePages wont work. Instead trigger an update for
+                        // the entire page.
+                        dispatch_async(dispatch_get_main_queue(), ^{
+                            [self updatePageNumbered:n.integerValue];
+                        });
+                    }
+                }
+                fz_catch(ctx)
+                {
+                }
+
+                if (--numPages == 0)
+                {
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        onComplete();
+                    });
+                }
+            });
+        }
+
+        [_pagesWithRedactions removeAllObjects];
+    }
+}
+
+- (void)deleteSelectedAnnotation
+{
+    for (NSNumber *n in self.selections.allKeys)
+    {
+        NSInteger pageNumber = n.integerValue;
+        NSObject<MuPDFDKSelection> *selection = self.selections[n];
+        if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+        {
+            MuPDFDKAnnotationInternal *mannot = ((MuPDFDKAnnotationInternal *)selection);
+            NSInteger index = mannot.index;
+            BOOL isWidget = mannot.isWidget;
+            dispatch_async(self.mulib.queue, ^{
+                fz_context *ctx = self.mulib.ctx;
+                pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
+                if (!idoc)
+                    return;
+
+                FzPage *page = [self getFzPage:n.integerValue];
+                fz_try(ctx)
+                {
+                    pdf_annot *annot;
+                    if (isWidget)
+                    {
+                        annot = page.fzpage ? pdf_first_widget(ctx, (pdf_page *)page.fzpage) : NULL;
+                        for (int i = 0; i < index && annot; i++)
+                            annot = pdf_next_widget(ctx, annot);
+                    }
+                    else
+                    {
+                        annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
+                        for (int i = 0; i < index && annot; i++)
+                            annot = pdf_next_annot(ctx, annot);
+                    }
+
+                    if (annot)
+                    {
+                        fz_rect rect = pdf_bound_annot(ctx, annot);
+                        if (isWidget)
+                            [self->_fieldIndex removeWidget:annot->obj ctx:ctx];
+                        pdf_delete_annot(ctx, (pdf_page *)page.fzpage, annot);
+                        [self forgetFormFieldsOnPage:pageNumber];
+                        dispatch_async(dispatch_get_main_queue(), ^{
+                            [self updatePageNumbered:pageNumber changedRects:@[[NSValue valueWithCGRect:rect_from_fz(rect)]]];
+                        });
+                    }
+                }
+                fz_catch(ctx)
+                {
+                }
+            });
+        }
+    }
+
+    [self clearSelection];
+}
+
+- (void)updateSelectedAnnotationsQuads
+{
+    for (NSNumber *n in self.selections.allKeys)
+    {
+        NSInteger pageNumber = n.integerValue;
+        NSObject<MuPDFDKSelection> *selection = self.selections[n];
+        if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+        {
+            NSArray<MuPDFDKQuad *> *quads = selection.quads;
+            int quadCount = (int)quads.count;
+            NSInteger index = ((MuPDFDKAnnotationInternal *)selection).index;
+            NSInteger isWidget = ((MuPDFDKAnnotationInternal *)selection).isWidget;
+            dispatch_async(self.mulib.queue, ^{
+                fz_context *ctx = self.mulib.ctx;
+                fz_quad *fzquads = NULL;
+                pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
+                if (!idoc)
+                    return;
+
+                FzPage *page = [self getFzPage:n.integerValue];
+                fz_var(fzquads);
+                fz_try(ctx)
+                {
+                    pdf_annot *annot = NULL;
+                    if (isWidget)
+                    {
+                        annot = page.fzpage ? pdf_first_widget(ctx, (pdf_page *)page.fzpage) : NULL;
+                        for (int i = 0; i < index && annot; i++)
+                            annot = pdf_next_widget(ctx, annot);
+                    }
+                    else
+                    {
+                        annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
+                        for (int i = 0; i < index && annot; i++)
+                            annot = pdf_next_annot(ctx, annot);
+                    }
+
+                    if (annot)
+                    {
+                        fz_rect oldrect = pdf_bound_annot(ctx, annot);
+                        if (quads)
+                        {
+                            fzquads = fz_malloc_array(ctx, quadCount, fz_quad);
+                            for (int i = 0; i < quadCount; i++)
+                                fzquads[i] = quad_to_fz(quads[i]);
+                            pdf_set_annot_quad_points(ctx, annot, quadCount, fzquads);
+                        }
+                        else
+                        {
+                            CGRect rect = selectionAsQuads(selection).firstObject.enclosingRect;
+                            pdf_set_annot_rect(ctx, annot, rect_to_fz(rect));
+                        }
+                        [self updatePages];
+                        fz_rect newrect = pdf_bound_annot(ctx, annot);
+                        dispatch_async(dispatch_get_main_queue(), ^{
+                            [self selectionChangedForPage:pageNumber];
+                            [self updatePageNumbered:pageNumber changedRects:@[[NSValue valueWithCGRect:rect_from_fz(oldrect)],
+                                                                               [NSValue valueWithCGRect:rect_from_fz(newrect)]]];
+                        });
+                    }
+                }
+                fz_always(ctx)
+                {
+                    fz_free(ctx, fzquads);
+                }
+                fz_catch(ctx)
+                {
+                }
+            });
+        }
+    }
+}
+
+- (void)setSearchStartPage:(NSInteger)page offset:(CGPoint)offset
+{
+    self.searchStartPage = page;
+}
+
+- (void)searchFor:(NSString *)text inDirection:(MuPDFDKSearchDirection)direction
+          onEvent:(void (^)(MuPDFDKSearchEvent, NSInteger, CGRect))block
+{
+    // States:
+    // New - text != self.searchText - this is a new search
+    // Found - text == self.searchText && self.searchHits.count > 0 - this is continuation after previous success
+    // NotFound - text == self.searchText && self.searchHits.count == 0 - this is continuation after previous failure
+    NSInteger inc = direction == MuPDFDKSearch_Forwards ? 1 : -1;
+    [self clearSelection];
+    self.searchCancelled = NO;
+
+    if (!self.searchText || ![self.searchText isEqualToString:text])
+    {
+        // This is a new search.
+        // Clear the existing search if any
+        if (self.searchHits.count > 0)
+        {
+            self.searchHits = nil;
+            [self selectionChangedForPage:self.searchPage];
+        }
+        // Start from the requested start page
+        self.searchPage =  direction == MuPDFDKSearch_Forwards ? self.searchStartPage : self.searchStartPage - 1;
+        self.searchText = text;
+    }
+
+    if (self.searchHits.count > 0)
+    {
+        // This is continuation after a previous success
+        self.searchCurrentHit += inc;
+        if (0 <= self.searchCurrentHit && self.searchCurrentHit < self.searchHits.count)
+        {
+            // There was another hit on the same page
+            [self selectionChangedForPage:self.searchPage];
+            self.searchStartPage = self.searchPage;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if (self.searchCancelled)
+                {
+                    [self closeSearch];
+                    block(MuPDFDKSearch_Cancelled, 0, CGRectNull);
+                }
+                else
+                {
+                    block(MuPDFDKSearch_Found, self.searchPage, self.searchHits[self.searchCurrentHit].enclosingRect);
+                }
+            });
+            return;
+        }
+        else
+        {
+            // No more hits on this page. Move to the next page
+            self.searchHits = nil;
+            [self selectionChangedForPage:self.searchPage];
+            self.searchPage += inc;
+        }
+    }
+
+    // This could be a new search, continuation after failure or continuation after
+    // success but for the last hit on a page. We should look for the next page with
+    // hits until we run off the end of the docuement. Because of the third case
+    // mentioned above, we may already have run off the end of the document
+    assert(self.searchHits.count == 0);
+    assert(self.searchText.length > 0);
+    NSString *searchText = self.searchText;
+
+    dispatch_async(self.mulib.queue, ^{
+        NSInteger page = self.searchPage;
+        NSArray<MuPDFDKQuad *> *hits = nil;
+        while (0 <= page && page < self.pageCount)
+        {
+            FzPage *fzpage = [self getFzPage:page];
+            hits = fzpage.fzpage ? search_page(self.mulib.ctx, self->_fzdoc, fzpage.fzpage, searchText.UTF8String) : NSArray.array;
+            if (self.searchCancelled || hits.count > 0)
+                break;
+
+            page += inc;
+            dispatch_async(dispatch_get_main_queue(), ^{
+                if (!self.searchCancelled)
+                    block(MuPDFDKSearch_Progress, page, CGRectNull);
+            });
+        }
+
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (self.searchCancelled)
+            {
+                [self closeSearch];
+                block(MuPDFDKSearch_Cancelled, 0, CGRectNull);
+            }
+            else if (hits.count > 0)
+            {
+                // Found a page with at least one hit
+                NSInteger currentHit = direction == MuPDFDKSearch_Forwards ? 0 : hits.count -1;
+                self.searchStartPage = self.searchPage = page;
+                self.searchHits = hits;
+                self.searchCurrentHit = currentHit;
+                [self selectionChangedForPage:page];
+                block(MuPDFDKSearch_Found, page, hits[currentHit].enclosingRect);
+            }
+            else
+            {
+                // Failed to find a page with a hit
+                // Set up page for potential wrap around
+                self.searchPage = direction == MuPDFDKSearch_Forwards ? 0 : self.pageCount - 1;
+                block(MuPDFDKSearch_NotFound, 0, CGRectNull);
+            }
+        });
+    });
+}
+
+- (void)cancelSearch
+{
+    self.searchCancelled = YES;
+}
+
+- (void)closeSearch
+{
+    if (self.searchHits.count > 0)
+    {
+        self.searchHits = nil;
+        [self selectionChangedForPage:self.searchPage];
+    }
+    self.searchText = nil;
+}
+
+- (void)updateAllPages
+{
+    for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
+    {
+        if ([weakTarget.target respondsToSelector:@selector(documentContentHasChanged)])
+            [weakTarget.target documentContentHasChanged];
+    }
+
+    for (MuPDFDKPageHolder *holder in _pages)
+    {
+        // Mark the page as dirty, so that the cached fzpage object
+        // and display list are reloaded.
+        holder.page.displayListDirty = YES;
+        holder.page.textDirty = YES;
+
+        if (holder.page.update)
+        {
+            CGSize size = holder.page.size;
+            holder.page.update(CGRectMake(0, 0, size.width, size.height));
+        }
+    }
+}
+
+- (void)updatePageNumbered:(NSInteger)pageNo changedRects:(NSArray<NSValue *> *)rects
+{
+    self.hasBeenModified = YES;
+    if (self.onSelectionChanged)
+        self.onSelectionChanged();
+    for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
+    {
+        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+            [weakTarget.target selectionHasChanged];
+        if ([weakTarget.target respondsToSelector:@selector(pageContentHasChanged:)])
+            [weakTarget.target pageContentHasChanged:pageNo];
+    }
+
+    for (MuPDFDKPageHolder *h in self->_pages)
+    {
+        if (h.pageNo == pageNo)
+        {
+            // Mark the page as dirty, so that the cached fzpage object
+            // and display list are reloaded.
+            h.page.displayListDirty = YES;
+            h.page.textDirty = YES;
+
+            if (h.page.update)
+            {
+                for (NSValue *v in rects)
+                    h.page.update(v.CGRectValue);
+            }
+        }
+    }
+}
+
+- (void)updatePageNumbered:(NSInteger)pageNo
+{
+    [self updatePageNumbered:pageNo modified:YES];
+}
+
+// Called, on the mupdf queue, when a page has been rendered without some of its
+// content, for want of data. Arranges for it to be rendered again once more of
+// the document has arrived
+- (void)pageNumberedIsIncomplete:(NSInteger)pageNo
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    BOOL waiting = _incompletePages.count > 0;
+    [_incompletePages addIndex:pageNo];
+    if (waiting)
+        return;
+
+    __weak typeof(self) weakSelf = self;
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [weakSelf whenMoreDataAvailable:^{
+            typeof(self) strongSelf = weakSelf;
+            if (strongSelf == nil)
+                return;
+
+            dispatch_async(strongSelf.mulib.queue, ^{
+                NSIndexSet *pages = [strongSelf->_incompletePages copy];
+                [strongSelf->_incompletePages removeAllIndexes];
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    // The content has grown, not been edited
+                    [pages enumerateIndexesUsingBlock:^(NSUInteger pageNumber, BOOL *stop) {
+                        [strongSelf updatePageNumbered:pageNumber modified:NO];
+                    }];
+                });
+            });
+        }];
+    });
+}
+
+- (void)updatePageNumbered:(NSInteger)pageNo modified:(BOOL)modified
+{
+    if (modified)
+        self.hasBeenModified = YES;
+    if (self.onSelectionChanged)
+        self.onSelectionChanged();
+    for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
+    {
+        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
+            [weakTarget.target selectionHasChanged];
+        if ([weakTarget.target respondsToSelector:@selector(pageContentHasChanged:)])
+            [weakTarget.target pageContentHasChanged:pageNo];
+    }
+
+    for (MuPDFDKPageHolder *h in self->_pages)
+    {
+        if (h.pageNo == pageNo)
+        {
+            // Mark the page as dirty, so that the cached fzpage object
+            // and display list are reloaded.
+            h.page.displayListDirty = YES;
+            h.page.textDirty = YES;
+
+            if (h.page.update)
+            {
+                CGRect wholePage = {CGPointZero, h.page.size};
+                h.page.update(wholePage);
+            }
+        }
+    }
+}
+
+// Regenerate the appearances of the widgets of the cached pages that need it,
+// and optionally those of their other annotations, and refresh the areas changed
+- (void)updateAnnotationsIncludingMarkup:(BOOL)includeMarkup
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+
+    for (NSNumber *key in _fzpages)
+    {
+        FzPageHolder *holder = _fzpages[key];
+        pdf_page *page = (pdf_page *)holder.page.fzpage;
+        if (page)
+        {
+            fz_try(ctx)
+            {
+                NSMutableArray<NSValue *> *updateRects = [NSMutableArray array];
+                if (includeMarkup)
+                {
+                    for (pdf_annot *annot = pdf_first_annot(ctx, page);annot;annot = pdf_next_annot(ctx, annot))
+                    {
+                        if (pdf_update_annot(ctx, annot))
+                        {
+                            fz_rect rect = pdf_bound_annot(ctx, annot);
+                            [updateRects addObject:[NSValue valueWithCGRect:rect_from_fz(rect)]];
+                        }
+                    }
+                }
+
+                for (pdf_widget *widget = pdf_first_widget(ctx, page);widget;widget = pdf_next_widget(ctx, widget))
+                {
+                    if (pdf_update_annot(ctx, widget))
+                    {
+                        fz_rect rect = pdf_bound_widget(ctx, widget);
+                        [updateRects addObject:[NSValue valueWithCGRect:rect_from_fz(rect)]];
+                    }
+                }
+
+                if (updateRects.count)
+                {
+                    // The page's widgets may have changed
+                    [self forgetFormFieldsOnPage:holder.pageNo];
+
+                    // Poke the update block for each current instance of this page
+                    dispatch_async(dispatch_get_main_queue(), ^{
+                        [self updatePageNumbered:holder.pageNo changedRects:updateRects];
+                    });
+                }
+            }
+            fz_catch(ctx)
+            {
+            }
+        }
+    }
+}
+
+- (void) updatePagesRecalc:(BOOL)recalc
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+
+    fz_try(ctx)
+    {
+        pdf_document *pdoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+        if (pdoc && recalc && pdoc->recalculate && pdf_js_supported(ctx, pdoc))
+        {
+            NSSet<NSString *> *changed = nil;
+            fz_try(ctx)
+            {
+                changed = [[self formGraphForDoc:pdoc] recalculateAllInDoc:pdoc ctx:ctx];
+            }
+            fz_always(ctx)
+            {
+                pdoc->recalculate = 0;
+            }
+            fz_catch(ctx)
+            {
+                fz_rethrow(ctx);
+            }
+
+            // Calculated fields may have widgets on pages not loaded
+            NSMutableSet<NSNumber *> *widgets = [[self fieldIndexForDoc:pdoc] widgetsOfFields:changed];
+            [self invalidateUnloadedPagesOfWidgets:widgets inDoc:pdoc];
+        }
+    }
+    fz_catch(ctx)
+    {
+        [self invalidateAllPages];
+    }
+
+    [self updateAnnotationsIncludingMarkup:YES];
+}
+
+// Called, on the mupdf queue, after changes whose extent isn't known, such as
+// those made by form calculations and scripts, which may affect pages not
+// currently loaded, and so not covered by updateAnnotationsIncludingMarkup:
+- (void)invalidateAllPages
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    // Such changes include fields shown, hidden, or moved on any page
+    [_formFieldQuads removeAllObjects];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self updateAllPages];
+    });
+}
+
+// Called before running the event handlers of a widget. If they include scripts,
+// which may make changes anywhere in the document, returns the states of the
+// form's widgets, for widgetEventsRanOn:withStatesBefore: to compare against.
+// Otherwise returns nil
+- (NSDictionary<NSNumber *, NSString *> *)widgetStatesBeforeEventsOn:(pdf_widget *)widget
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *pdoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+    NSDictionary<NSNumber *, NSString *> *states = nil;
+
+    if (pdoc == NULL || !pdf_js_supported(ctx, pdoc))
+        return nil;
+
+    fz_try(ctx)
+    {
+        if (widget_has_scripts(ctx, widget->obj))
+            states = [[self fieldIndexForDoc:pdoc] widgetStatesInDoc:pdoc ctx:ctx];
+    }
+    fz_catch(ctx)
+    {
+        // With nothing to compare against, every widget will count as changed
+        states = @{};
+    }
+
+    return states;
+}
+
+// Called after running the event handlers of a widget, with the states returned
+// by widgetStatesBeforeEventsOn:. Brings up to date the pages of the widgets whose
+// states the handlers' scripts changed
+- (void)widgetEventsRanOn:(pdf_widget *)widget withStatesBefore:(NSDictionary<NSNumber *, NSString *> *)before
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *pdoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+    NSMutableSet<NSNumber *> *changed = [NSMutableSet set];
+
+    if (before == nil || pdoc == NULL)
+        return;
+
+    fz_try(ctx)
+    {
+        NSDictionary<NSNumber *, NSString *> *after = [[self fieldIndexForDoc:pdoc] widgetStatesInDoc:pdoc ctx:ctx];
+        [after enumerateKeysAndObjectsUsingBlock:^(NSNumber *num, NSString *state, BOOL *stop) {
+            if (![before[num] isEqualToString:state])
+                [changed addObject:num];
+        }];
+    }
+    fz_catch(ctx)
+    {
+        [self invalidateAllPages];
+        return;
+    }
+
+    if (changed.count == 0)
+        return;
+
+    [self invalidateUnloadedPagesOfWidgets:changed inDoc:pdoc];
+    [self updateAnnotationsIncludingMarkup:NO];
+}
+
+// Invalidate the pages, not currently loaded, holding any of "widgets", which
+// updateAnnotationsIncludingMarkup: will have missed. Falls back to invalidating
+// every page for widgets whose page can't be determined
+- (void)invalidateUnloadedPagesOfWidgets:(NSSet<NSNumber *> *)widgets inDoc:(pdf_document *)pdoc
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    NSMutableSet<NSNumber *> *unloaded = [widgets mutableCopy];
+    NSMutableIndexSet *pageNumbers = [NSMutableIndexSet indexSet];
+    pdf_obj *obj = NULL;
+
+    for (NSNumber *key in _fzpages)
+    {
+        pdf_page *page = (pdf_page *)_fzpages[key].page.fzpage;
+        for (pdf_widget *widget = page ? pdf_first_widget(ctx, page) : NULL; widget; widget = pdf_next_widget(ctx, widget))
+            [unloaded removeObject:@(pdf_to_num(ctx, widget->obj))];
+    }
+
+    if (unloaded.count == 0)
+        return;
+
+    fz_var(obj);
+    fz_try(ctx)
+    {
+        for (NSNumber *num in unloaded)
+        {
+            obj = pdf_new_indirect(ctx, pdoc, num.intValue, 0);
+            int pageNumber = pdf_lookup_page_number(ctx, pdoc, pdf_dict_get(ctx, obj, PDF_NAME(P)));
+            pdf_drop_obj(ctx, obj);
+            obj = NULL;
+            if (pageNumber < 0)
+                fz_throw(ctx, FZ_ERROR_GENERIC, "widget lacks page");
+
+            [pageNumbers addIndex:pageNumber];
+        }
+
+        [pageNumbers enumerateIndexesUsingBlock:^(NSUInteger pageNumber, BOOL *stop) {
+            [self forgetFormFieldsOnPage:pageNumber];
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [self updatePageNumbered:pageNumber];
+            });
+        }];
+    }
+    fz_catch(ctx)
+    {
+        pdf_drop_obj(ctx, obj);
+        [self invalidateAllPages];
+    }
+}
+
+- (MuPDFDKFormGraph *)formGraphForDoc:(pdf_document *)pdoc
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+
+    if (_formGraph == nil || ![_formGraph isCurrentForDoc:pdoc ctx:ctx])
+        _formGraph = [[MuPDFDKFormGraph alloc] initForDoc:pdoc ctx:ctx];
+
+    return _formGraph;
+}
+
+- (MuPDFDKFieldIndex *)fieldIndexForDoc:(pdf_document *)pdoc
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+
+    if (_fieldIndex == nil)
+        _fieldIndex = [[MuPDFDKFieldIndex alloc] initForDoc:pdoc ctx:self.mulib.ctx];
+
+    return _fieldIndex;
+}
+
+// Bring the pages up to date after a change to the value of the field of the widget
+// "field". Unlike updatePagesRecalc:, only the fields that depend on the one changed
+// are recalculated. The widgets of the cached pages are all checked for regeneration,
+// since the scripts run may have changed any of them
+- (void)updatePagesForField:(pdf_obj *)field recalc:(BOOL)recalc
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    fz_context *ctx = self.mulib.ctx;
+    BOOL failed = NO;
+
+    fz_var(failed);
+    fz_try(ctx)
+    {
+        pdf_document *pdoc = pdf_document_from_fz_document(ctx, self.fzdoc);
+        if (pdoc)
+        {
+            MuPDFDKFieldIndex *fieldIndex = [self fieldIndexForDoc:pdoc];
+            NSString *name = [fieldIndex nameOfWidget:field ctx:ctx];
+            NSSet<NSString *> *changed = [NSSet setWithObject:name];
+            if (recalc && pdoc->recalculate && pdf_js_supported(ctx, pdoc))
+            {
+                fz_try(ctx)
+                {
+                    changed = [[self formGraphForDoc:pdoc] recalculateFromField:field named:name inDoc:pdoc ctx:ctx];
+                }
+                fz_always(ctx)
+                {
+                    pdoc->recalculate = 0;
+                }
+                fz_catch(ctx)
+                {
+                    fz_rethrow(ctx);
+                }
+            }
+
+            // The field, and those recalculated, may have widgets on pages not loaded
+            NSMutableSet<NSNumber *> *widgets = [fieldIndex widgetsOfFields:changed];
+            [widgets addObject:@(pdf_to_num(ctx, field))];
+            [self invalidateUnloadedPagesOfWidgets:widgets inDoc:pdoc];
+        }
+    }
+    fz_catch(ctx)
+    {
+        // Fall back to checking every annotation
+        failed = YES;
+        [self invalidateAllPages];
+    }
+
+    [self updateAnnotationsIncludingMarkup:failed];
+}
+
+- (void)updatePages
+{
+    [self updatePagesRecalc:YES];
+}
+
+- (MuPDFPrintProfile)printProfile
+{
+    return _printProfile;
+}
+
+- (void)setPrintProfile:(MuPDFPrintProfile)printProfile
+{
+    _printProfile = printProfile;
+    [self updateAllPages];
+}
+
+- (ARDKSoftProfile)softProfile
+{
+    return _softProfile;
+}
+
+- (void)setSoftProfile:(ARDKSoftProfile)softProfile
+{
+    _softProfile = softProfile;
+    [self updateAllPages];
+}
+
+- (void)abortLoad
+{
+    self.loadAborted = YES;
+    if (self.errorBlock)
+        self.errorBlock(ARDKDocErrorType_Aborted);
+}
+
+- (void)providePassword:(NSString *)password
+{
+    assert([NSThread isMainThread]);
+    dispatch_async(self.mulib.queue, ^{
+        fz_context *ctx = self.mulib.ctx;
+        NSInteger count = 0;
+        int authenticateResult = 0;
+        BOOL failed = NO;
+        fz_var(count);
+        fz_var(authenticateResult);
+        fz_var(failed);
+        fz_try(ctx)
+        {
+            authenticateResult = fz_authenticate_password(self.mulib.ctx, self->_fzdoc, password.UTF8String);
+            if (authenticateResult)
+            {
+                count = fz_count_pages(ctx, self.fzdoc);
+            }
+        }
+        fz_catch(ctx)
+        {
+            failed = YES;
+        }
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (failed)
+            {
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
+                return;
+            }
+
+            if (authenticateResult == 0)
+            {
+                // incorrect password
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_PasswordRequest);
+            }
+            else if (count <= 0)
+            {
+                if (self.errorBlock)
+                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
+                // A document may continue to load after an error, but
+                // not in this case, so signal loading compelete.
+                if (self.progressBlock)
+                    self.progressBlock(0, YES);
+                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
+                    [weakTarget.target updatePageCount:0 andLoadingComplete:YES];
+            }
+            else
+            {
+                self->_reportedPageCount = count;
+                [self loadSomePages];
+            }
+        });
+    });
+}
+
+- (FzPage *)getFzPage:(NSInteger)pageNumber
+{
+    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
+    NSNumber *pn = [NSNumber numberWithInteger:pageNumber];
+    FzPageHolder *holder = _fzpages[pn];
+
+    if (holder.page)
+        return holder.page;
+
+    // There was no holder for this page number, or the weak page property may have been freed.
+    // Overwrite it in either case.
+    fz_context *ctx = self.mulib.ctx;
+    fz_page *fzpage = NULL;
+    fz_try(ctx)
+    {
+        fzpage = fz_load_page(ctx, self.fzdoc, (int)pageNumber);
+    }
+    fz_catch(ctx)
+    {
+        // Don't record the failure if the page's data is yet to arrive
+        if (fz_caught(ctx) == FZ_ERROR_TRYLATER)
+        {
+            _awaitingData = YES;
+            return [FzPage pageFromPage:NULL ofDoc:self];
+        }
+    }
+
+    FzPage *page = [FzPage pageFromPage:fzpage ofDoc:self];
+
+    _fzpages[pn] = [FzPageHolder holderForPage:page numbered:pageNumber];
+
+    return page;
+}
+
+- (id<ARDKPage>)getPage:(NSInteger)pageNumber update:(void (^)(CGRect))block
+{
+    MuPDFDKPage *page;
+    @synchronized (self.pageSizes) {
+        page = [[MuPDFDKPage alloc] initForPage:pageNumber ofDoc:self withSize:self.pageSizes[pageNumber].CGSizeValue update:block];
+    }
+
+    @synchronized(_pages)
+    {
+        // Remove from the pages array any defunct pages and add this new one
+        NSMutableArray<MuPDFDKPageHolder *> *pages = [NSMutableArray array];
+        for (MuPDFDKPageHolder *holder in _pages)
+        {
+            if (holder.page)
+                [pages addObject:holder];
+        }
+
+        [pages addObject:[MuPDFDKPageHolder holderForPage:page numbered:pageNumber]];
+
+        _pages = pages;
+    }
+
+    [page findFormFields];
+
+    return page;
+}
+
+- (NSString *)fileBasedOn:(NSString *)templatePath
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:templatePath];
+    NSFileManager *fman = [NSFileManager defaultManager];
+#if TARGET_OS_OSX
+    NSString *filePath = self.mulib.settings.temporaryPath;
+#else /* TARGET_OS_OSX */
+    NSString *filePath = [templatePath stringByDeletingLastPathComponent];
+#endif /* TARGET_OS_OSX */
+    NSString *fileNameWithExtension = [templatePath lastPathComponent];
+    NSString *fileName = [fileNameWithExtension stringByDeletingPathExtension];
+    NSString *extension = [fileNameWithExtension pathExtension];
+    NSInteger i = 0;
+    NSString *path;
+    NSString *fullPath;
+    while (YES)
+    {
+        path = [NSString stringWithFormat:@"%@%ld.%@", fileName, (long)i, extension];
+        fullPath = [filePath stringByAppendingPathComponent:path];
+        BOOL exists = isSecure ? [MuPDFDKLib.secureFS ARDKSecureFS_fileExists:fullPath] : [fman fileExistsAtPath:fullPath];
+        if (!exists)
+            break;
+
+        i++;
+    }
+
+    return fullPath;
+}
+
+- (BOOL)createItemAtPath:(NSString *)path
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path];
+    if (isSecure)
+    {
+        [MuPDFDKLib.secureFS ARDKSecureFS_fileDelete:path];
+        return [MuPDFDKLib.secureFS ARDKSecureFS_createFileAtPath:path];
+    }
+    else
+    {
+        [NSFileManager.defaultManager removeItemAtPath:path error:nil];
+        return [NSFileManager.defaultManager createFileAtPath:path contents:nil attributes:nil];
+    }
+}
+
+- (BOOL)copyItemAtPath:(NSString *)from toPath:(NSString *)to
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:from];
+    if (isSecure)
+    {
+        assert ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:to]);
+        return [MuPDFDKLib.secureFS ARDKSecureFS_fileCopy:from to:to];
+    }
+    else
+    {
+        return [[NSFileManager defaultManager] copyItemAtPath:from toPath:to error:NULL];
+    }
+}
+
+- (BOOL)moveItemAtPath:(NSString *)from toPath:(NSString *)to
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:from];
+    if (isSecure)
+    {
+        id<ARDKSecureFS> secureFs = MuPDFDKLib.secureFS;
+        assert ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:to]);
+        if ([secureFs ARDKSecureFS_fileExists:to])
+            [secureFs ARDKSecureFS_fileDelete:to];
+
+        return [secureFs ARDKSecureFS_fileRename:from to:to];
+    }
+    else
+    {
+        NSFileManager *fman = [NSFileManager defaultManager];
+        if ([fman fileExistsAtPath:to])
+            [fman removeItemAtPath:to error:NULL];
+
+        return [fman moveItemAtPath:from toPath:to error:NULL];
+    }
+}
+
+- (NSString *)journalPathFor:(NSString *)path
+{
+    NSString *name = [NSString stringWithFormat:@".%@.savejournal", path.lastPathComponent];
+    return [[path stringByDeletingLastPathComponent] stringByAppendingPathComponent:name];
+}
+
+- (unsigned long long)lengthOfItemAtPath:(NSString *)path
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path];
+    NSDictionary<NSString *, id> *attributes = isSecure ? [MuPDFDKLib.secureFS ARDKSecureFS_attributesOfItemAtPath:path]
+                                                        : [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+    return [attributes[NSFileSize] unsignedLongLongValue];
+}
+
+/// Flush a file to storage, first truncating it if a length is provided
+- (void)finishItemAtPath:(NSString *)path truncatingTo:(NSNumber *)length
+{
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
+    {
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForUpdatingAtPath:path];
+        if (length)
+            [handle ARDKSecureFS_truncateFileAtOffset:length.unsignedLongLongValue];
+        [handle ARDKSecureFS_synchronizeFile];
+        [handle ARDKSecureFS_closeFile];
+    }
+    else
+    {
+        NSFileHandle *handle = [NSFileHandle fileHandleForUpdatingAtPath:path];
+        if (length)
+            [handle truncateFileAtOffset:length.unsignedLongLongValue];
+        [handle synchronizeFile];
+        [handle closeFile];
+    }
+}
+
+- (BOOL)writeJournal:(NSString *)journal recordingLength:(unsigned long long)length
+{
+    NSData *data = [[NSString stringWithFormat:@"%llu", length] dataUsingEncoding:NSUTF8StringEncoding];
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:journal])
+    {
+        if (![self createItemAtPath:journal])
+            return NO;
+
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForWritingAtPath:journal];
+        if (handle == nil)
+            return NO;
+
+        [handle ARDKSecureFS_writeData:data];
+        [handle ARDKSecureFS_synchronizeFile];
+        [handle ARDKSecureFS_closeFile];
+        return YES;
+    }
+    else
+    {
+        return [data writeToFile:journal atomically:YES];
+    }
+}
+
+- (void)deleteItemAtPath:(NSString *)path
+{
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
+        [MuPDFDKLib.secureFS ARDKSecureFS_fileDelete:path];
+    else
+        [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+}
+
+/// Roll back any in-place save that was interrupted, by truncating the file
+/// to the length recorded in the journal. Must be called on the mupdf queue.
+- (void)recoverInterruptedSave
+{
+    NSString *journal = [self journalPathFor:self.path];
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:journal];
+    if (!(isSecure ? [MuPDFDKLib.secureFS ARDKSecureFS_fileExists:journal] : [[NSFileManager defaultManager] fileExistsAtPath:journal]))
+        return;
+
+    NSData *data = nil;
+    if (isSecure)
+    {
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:journal];
+        data = [handle ARDKSecureFS_readDataOfLength:64];
+        [handle ARDKSecureFS_closeFile];
+    }
+    else
+    {
+        data = [NSData dataWithContentsOfFile:journal];
+    }
+
+    // A journal that is empty or unreadable was interrupted before
+    // the file was touched
+    NSString *recorded = data ? [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] : nil;
+    long long length = recorded.longLongValue;
+    if (length > 0 && [self lengthOfItemAtPath:self.path] > (unsigned long long)length)
+        [self finishItemAtPath:self.path truncatingTo:@(length)];
+
+    [self deleteItemAtPath:journal];
+}
+
+/// Append the changes to a document directly to the end of its file, rather than
+/// to a copy. The file's original length is journalled for the duration, so that
+/// an interrupted save can be rolled back. Must be called on the mupdf queue.
+- (BOOL)appendChangesTo:(pdf_document *)idoc withOptions:(pdf_write_options *)opts
+{
+    fz_context *ctx = self.mulib.ctx;
+    NSString *path = self.loadedPath;
+    NSString *journal = [self journalPathFor:path];
+    unsigned long long length = [self lengthOfItemAtPath:path];
+    if (length == 0 || ![self writeJournal:journal recordingLength:length])
+        return NO;
+
+    BOOL written = NO;
+    fz_output *ostream = NULL;
+    fz_var(written);
+    fz_var(ostream);
+    fz_try(ctx)
+    {
+        if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
+            ostream = secure_output(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForUpdatingAtPath:path]);
+        else if (MuPDFDKLib.secureFS)
+            ostream = fz_new_output_with_path(ctx, path.UTF8String, 1);
+        else
+            ostream = fz_new_output_with_path(ctx, path.fileSystemRepresentation, 1);
+
+        pdf_write_document(ctx, idoc, ostream, opts);
+        fz_close_output(ctx, ostream);
+        written = YES;
+    }
+    fz_always(ctx)
+    {
+        fz_drop_output(ctx, ostream);
+    }
+    fz_catch(ctx)
+    {
+    }
+
+    // On failure, remove whatever part of the changes made it to file
+    [self finishItemAtPath:path truncatingTo:written ? nil : @(length)];
+    [self deleteItemAtPath:journal];
+    return written;
+}
+
+/// Carry on with the in-memory document after an incremental save, rather than
+/// reopening it. The saved file is the one loaded from with the changes appended,
+/// so the offsets of the objects already read remain valid, and only the stream
+/// and the location of the latest xref need rebasing onto the new file. Pages,
+/// display lists and other caches are unaffected. Must be called on the mupdf
+/// queue. Throws on failure, leaving the document unchanged.
+///
+/// Before rebasing, the new file is checked to be exactly that: the old file,
+/// unchanged, followed by an xref section that chains to the old one and covers
+/// the xrefLength objects the document had when its changes were written.
+/// Otherwise the caller must reopen.
+///
+/// If fold, the document's changes are all in the new file, and become part of
+/// its base, so that further saves append only the changes made after this one.
+- (void)rebaseOnFileAtPath:(NSString *)path xrefLength:(int)xrefLength fold:(BOOL)fold
+{
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
+    NSString *oldPath = _path;
+    NSString *oldRecoveredPath = _recoveredPath;
+    fz_stream *stm = NULL;
+    pdf_obj *trailer = NULL;
+    int64_t length = 0;
+    int64_t startxref = 0;
+    fz_var(stm);
+    fz_var(trailer);
+    _path = path;
+    _recoveredPath = nil;
+    fz_try(ctx)
+    {
+        stm = [self openStream];
+        fz_seek(ctx, stm, 0, SEEK_END);
+        length = fz_tell(ctx, stm);
+        startxref = read_startxref(ctx, stm, length);
+        if (length <= idoc->file_size || startxref < idoc->file_size || startxref >= length)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "saved file is not an incremental update");
+
+        // The end of the old file, where its own trailer lies, must be intact
+        unsigned char oldTail[1024], newTail[1024];
+        int64_t tailStart = MAX(0, idoc->file_size - (int64_t)sizeof(oldTail));
+        size_t tailLength = (size_t)(idoc->file_size - tailStart);
+        fz_seek(ctx, idoc->file, tailStart, SEEK_SET);
+        fz_seek(ctx, stm, tailStart, SEEK_SET);
+        if (fz_read(ctx, idoc->file, oldTail, tailLength) != tailLength
+            || fz_read(ctx, stm, newTail, tailLength) != tailLength
+            || memcmp(oldTail, newTail, tailLength) != 0)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "saved file does not extend the original");
+
+        trailer = read_xref_trailer(ctx, idoc, stm, startxref);
+        if (pdf_to_int64(ctx, pdf_dict_get(ctx, trailer, PDF_NAME(Prev))) != idoc->startxref
+            || pdf_to_int(ctx, pdf_dict_get(ctx, trailer, PDF_NAME(Size))) != xrefLength)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "saved xref does not match the document");
+    }
+    fz_always(ctx)
+    {
+        pdf_drop_obj(ctx, trailer);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_stream(ctx, stm);
+        _path = oldPath;
+        _recoveredPath = oldRecoveredPath;
+        fz_rethrow(ctx);
+    }
+
+    // Further incremental saves then chain their xref to the one just written
+    fz_drop_stream(ctx, idoc->file);
+    idoc->file = fz_keep_stream(ctx, stm);
+    idoc->file_size = length;
+    idoc->startxref = startxref;
+    fz_drop_stream(ctx, _stream);
+    _stream = stm;
+
+    // The saved objects stay held in memory, in what becomes the latest section
+    // of the file's xref, so the offsets of their entries are not used. The next
+    // edit starts a new incremental section, as after loading.
+    if (fold && idoc->num_incremental_sections == 1 && idoc->xref_sections[0].unsaved_sigs == NULL)
+    {
+        idoc->num_incremental_sections = 0;
+        idoc->xref_sections[0].end = length;
+    }
+}
+
+/// Bring the document up to date with a file just saved, either by rebasing the
+/// in-memory document onto it, or failing that by reopening. xrefLength is the
+/// number of objects the document had when its changes were written, and unchanged
+/// whether it has not been edited since. Reopening loses any edits not in the
+/// file, so is allowed only if unchanged, and otherwise failing to rebase throws,
+/// leaving the document as it was. Likewise only if unchanged are the saved
+/// changes folded into the document's base. Must be called on the mupdf queue,
+/// within an fz_try.
+- (void)reloadFrom:(NSString *)path canRebase:(BOOL)canRebase xrefLength:(int)xrefLength
+         unchanged:(BOOL)unchanged jsEnable:(BOOL)jsEnable
+{
+    fz_context *ctx = self.mulib.ctx;
+    BOOL rebased = NO;
+    fz_var(rebased);
+
+    // The document is now complete on file
+    self->_source = nil;
+
+    if (canRebase)
+    {
+        fz_try(ctx)
+        {
+            [self rebaseOnFileAtPath:path xrefLength:xrefLength fold:unchanged];
+            rebased = YES;
+        }
+        fz_catch(ctx)
+        {
+            // Fall back to reopening
         }
     }
 
-    [self clearSelection];
+    if (!rebased && !unchanged)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "document edited while saving cannot be reopened");
+
+    if (!rebased)
+    {
+        // Reopen the document, first removing all references to objects
+        fz_drop_document(ctx, self->_fzdoc);
+        self->_fzdoc = NULL;
+        fz_drop_stream(ctx, self->_stream);
+        self->_stream = NULL;
+
+        self->_fzpages = [NSMutableDictionary dictionaryWithCapacity:INITIAL_FZPAGE_CACHE_SIZE];
+        [self->_formFieldQuads removeAllObjects];
+        self->_formGraph = nil;
+        self->_fieldIndex = nil;
+
+        @synchronized(self->_pages)
+        {
+            for (MuPDFDKPageHolder *holder in self->_pages)
+            {
+                [holder.page drop_page];
+                [holder.page drop_list];
+                [holder.page forgetSignatures];
+            }
+        }
+
+        // openStream reads from self.loadedPath, so that must be the saved file
+        self->_path = path;
+        self->_recoveredPath = nil;
+        self->_stream = [self openStream];
+        self->_fzdoc = fz_open_document_with_stream(ctx, "file.pdf", self->_stream);
+        [self enableJS:jsEnable];
+    }
 }
 
-- (void)updateSelectedAnnotationsQuads
+/// Deflate the document's unfiltered streams, spreading the compression across
+/// cores. Streams are read and updated on the mupdf queue, in batches so as to
+/// bound memory use, with only the compression itself done in parallel. Must be
+/// called on the mupdf queue.
+- (void)deflateStreamsOf:(pdf_document *)idoc
 {
-    for (NSNumber *n in self.selections.allKeys)
+    fz_context *ctx = self.mulib.ctx;
+    int len = pdf_xref_len(ctx, idoc);
+    int num = 1;
+    while (num < len)
     {
-        NSInteger pageNumber = n.integerValue;
-        NSObject<MuPDFDKSelection> *selection = self.selections[n];
-        if ([selection isKindOfClass:MuPDFDKAnnotationInternal.class])
+        NSMutableArray<NSNumber *> *nums = [NSMutableArray array];
+        NSMutableArray<NSData *> *raw = [NSMutableArray array];
+        size_t batch = 0;
+        for (; num < len && batch < COMPACT_BATCH_SIZE; num++)
         {
-            NSArray<MuPDFDKQuad *> *quads = selection.quads;
-            int quadCount = (int)quads.count;
-            NSInteger index = ((MuPDFDKAnnotationInternal *)selection).index;
-            NSInteger isWidget = ((MuPDFDKAnnotationInternal *)selection).isWidget;
-            dispatch_async(self.mulib.queue, ^{
-                fz_context *ctx = self.mulib.ctx;
-                fz_quad *fzquads = NULL;
-                pdf_document *idoc = pdf_specifics(ctx, self->_fzdoc);
-                if (!idoc)
-                    return;
-
-                FzPage *page = [self getFzPage:n.integerValue];
-                fz_var(fzquads);
-                fz_try(ctx)
+            fz_buffer *buf = NULL;
+            fz_var(buf);
+            fz_try(ctx)
+            {
+                if (pdf_obj_num_is_stream(ctx, idoc, num))
                 {
-                    pdf_annot *annot = NULL;
-                    if (isWidget)
-                    {
-                        annot = page.fzpage ? pdf_first_widget(ctx, (pdf_page *)page.fzpage) : NULL;
-                        for (int i = 0; i < index && annot; i++)
-                            annot = pdf_next_widget(ctx, annot);
-                    }
-                    else
-                    {
-                        annot = page.fzpage ? pdf_first_annot(ctx, (pdf_page *)page.fzpage) : NULL;
-                        for (int i = 0; i < index && annot; i++)
-                            annot = pdf_next_annot(ctx, annot);
-                    }
-
-                    if (annot)
+                    pdf_obj *dict = pdf_load_object(ctx, idoc, num);
+                    // XMP metadata is conventionally left readable
+                    BOOL unfiltered = pdf_dict_get(ctx, dict, PDF_NAME(Filter)) == NULL
+                        && !pdf_name_eq(ctx, pdf_dict_get(ctx, dict, PDF_NAME(Type)), PDF_NAME(Metadata));
+                    pdf_drop_obj(ctx, dict);
+                    if (unfiltered)
                     {
-                        fz_rect oldrect = pdf_bound_annot(ctx, annot);
-                        if (quads)
-                        {
-                            fzquads = fz_malloc_array(ctx, quadCount, fz_quad);
-                            for (int i = 0; i < quadCount; i++)
-                                fzquads[i] = quad_to_fz(quads[i]);
-                            pdf_set_annot_quad_points(ctx, annot, quadCount, fzquads);
-                        }
-                        else
+                        buf = pdf_load_raw_stream_number(ctx, idoc, num);
+                        if (buf->len > 0)
                         {
-                            CGRect rect = selectionAsQuads(selection).firstObject.enclosingRect;
-                            pdf_set_annot_rect(ctx, annot, rect_to_fz(rect));
+                            [nums addObject:@(num)];
+                            [raw addObject:[NSData dataWithBytes:buf->data length:buf->len]];
+                            batch += buf->len;
                         }
-                        [self updatePages];
-                        fz_rect newrect = pdf_bound_annot(ctx, annot);
-                        dispatch_async(dispatch_get_main_queue(), ^{
-                            [self selectionChangedForPage:pageNumber];
-                            [self updatePageNumbered:pageNumber changedRects:@[[NSValue valueWithCGRect:rect_from_fz(oldrect)],
-                                                                               [NSValue valueWithCGRect:rect_from_fz(newrect)]]];
-                        });
                     }
                 }
-                fz_always(ctx)
-                {
-                    fz_free(ctx, fzquads);
-                }
-                fz_catch(ctx)
-                {
-                }
-            });
+            }
+            fz_always(ctx)
+            {
+                fz_drop_buffer(ctx, buf);
+            }
+            fz_catch(ctx)
+            {
+                // Leave the stream for the writer to deal with
+            }
         }
-    }
-}
 
-- (void)setSearchStartPage:(NSInteger)page offset:(CGPoint)offset
-{
-    self.searchStartPage = page;
-}
+        NSMutableArray *deflated = [NSMutableArray arrayWithCapacity:raw.count];
+        for (NSUInteger i = 0; i < raw.count; i++)
+            [deflated addObject:[NSNull null]];
 
-- (void)searchFor:(NSString *)text inDirection:(MuPDFDKSearchDirection)direction
-          onEvent:(void (^)(MuPDFDKSearchEvent, NSInteger, CGRect))block
-{
-    // States:
-    // New - text != self.searchText - this is a new search
-    // Found - text == self.searchText && self.searchHits.count > 0 - this is continuation after previous success
-    // NotFound - text == self.searchText && self.searchHits.count == 0 - this is continuation after previous failure
-    NSInteger inc = direction == MuPDFDKSearch_Forwards ? 1 : -1;
-    [self clearSelection];
-    self.searchCancelled = NO;
+        dispatch_apply(raw.count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+            NSData *data = raw[i];
+            uLongf size = compressBound((uLong)data.length);
+            NSMutableData *out = [NSMutableData dataWithLength:size];
+            if (compress2(out.mutableBytes, &size, data.bytes, (uLong)data.length, Z_DEFAULT_COMPRESSION) == Z_OK && size < data.length)
+            {
+                out.length = size;
+                @synchronized (deflated)
+                {
+                    deflated[i] = out;
+                }
+            }
+        });
 
-    if (!self.searchText || ![self.searchText isEqualToString:text])
-    {
-        // This is a new search.
-        // Clear the existing search if any
-        if (self.searchHits.count > 0)
+        for (NSUInteger i = 0; i < nums.count; i++)
         {
-            self.searchHits = nil;
-            [self selectionChangedForPage:self.searchPage];
+            // Streams that don't shrink are left as they are
+            if (![deflated[i] isKindOfClass:NSData.class])
+                continue;
+
+            NSData *data = deflated[i];
+            fz_buffer *buf = NULL;
+            pdf_obj *ref = NULL;
+            fz_var(buf);
+            fz_var(ref);
+            fz_try(ctx)
+            {
+                buf = fz_new_buffer_from_copied_data(ctx, data.bytes, data.length);
+                ref = pdf_new_indirect(ctx, idoc, nums[i].intValue, 0);
+                pdf_update_stream(ctx, idoc, ref, buf, 1);
+                pdf_dict_put(ctx, ref, PDF_NAME(Filter), PDF_NAME(FlateDecode));
+                pdf_dict_del(ctx, ref, PDF_NAME(DecodeParms));
+            }
+            fz_always(ctx)
+            {
+                fz_drop_buffer(ctx, buf);
+                pdf_drop_obj(ctx, ref);
+            }
+            fz_catch(ctx)
+            {
+            }
         }
-        // Start from the requested start page
-        self.searchPage =  direction == MuPDFDKSearch_Forwards ? self.searchStartPage : self.searchStartPage - 1;
-        self.searchText = text;
     }
+}
 
-    if (self.searchHits.count > 0)
+/// Write the document and bring it up to date with the file written, all on the
+/// mupdf queue. Used for saves that cannot be made from a snapshot, and for
+/// compaction, which rewrites the whole file.
+- (BOOL)writeTo:(NSString *)path via:(NSString *)tmpPath jsEnable:(BOOL)jsEnable compact:(BOOL)compact
+{
+    fz_context *ctx = self.mulib.ctx;
+    BOOL written = NO;
+    fz_output *ostream = NULL;
+    fz_var(written);
+    fz_var(ostream);
+    fz_try(ctx)
     {
-        // This is continuation after a previous success
-        self.searchCurrentHit += inc;
-        if (0 <= self.searchCurrentHit && self.searchCurrentHit < self.searchHits.count)
+        pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
+        if (idoc)
         {
-            // There was another hit on the same page
-            [self selectionChangedForPage:self.searchPage];
-            self.searchStartPage = self.searchPage;
-            dispatch_async(dispatch_get_main_queue(), ^{
-                if (self.searchCancelled)
+            pdf_write_options opts = {0};
+            opts.do_incremental = !compact && pdf_can_be_saved_incrementally(ctx, idoc);
+            if (compact)
+            {
+                [self deflateStreamsOf:idoc];
+                // Drop unused objects, renumber, and merge duplicates
+                opts.do_garbage = 3;
+                opts.do_compress = 1;
+                opts.do_compress_images = 1;
+                opts.do_compress_fonts = 1;
+            }
+
+            // Signatures are completed only in the file written, so their
+            // in-memory objects remain placeholders until reloaded
+            BOOL canRebase = opts.do_incremental && !pdf_has_unsaved_sigs(ctx, idoc);
+            BOOL saved = NO;
+            if (opts.do_incremental && self.saveInPlace && self->_source == nil && [path isEqualToString:self.loadedPath])
+            {
+                saved = [self appendChangesTo:idoc withOptions:&opts];
+            }
+            else if (opts.do_incremental ? [self copyItemAtPath:self.loadedPath toPath:tmpPath] : [self createItemAtPath:tmpPath])
+            {
+                if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:tmpPath])
                 {
-                    [self closeSearch];
-                    block(MuPDFDKSearch_Cancelled, 0, CGRectNull);
+                    ostream = secure_output(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForUpdatingAtPath:tmpPath]);
                 }
                 else
                 {
-                    block(MuPDFDKSearch_Found, self.searchPage, self.searchHits[self.searchCurrentHit].enclosingRect);
+                    // When using a secure FS we need to avoid calling fileSystemRepresentation
+                    // which would Unicode Normalize tmpPath
+                    if (MuPDFDKLib.secureFS)
+                        ostream = fz_new_output_with_path(ctx, [tmpPath UTF8String], 1);
+                    else
+                        ostream = fz_new_output_with_path(ctx, tmpPath.fileSystemRepresentation, 1);
                 }
-            });
-            return;
-        }
-        else
-        {
-            // No more hits on this page. Move to the next page
-            self.searchHits = nil;
-            [self selectionChangedForPage:self.searchPage];
-            self.searchPage += inc;
+
+                pdf_write_document(ctx, idoc, ostream, &opts);
+                fz_close_output(ctx, ostream);
+                saved = [self moveItemAtPath:tmpPath toPath:path];
+            }
+
+            if (saved)
+            {
+                // The whole save happens on the mupdf queue, so the file holds every edit
+                [self reloadFrom:path canRebase:canRebase xrefLength:pdf_xref_len(ctx, idoc)
+                       unchanged:YES jsEnable:jsEnable];
+                written = YES;
+            }
         }
     }
+    fz_always(ctx)
+    {
+        fz_drop_output(ctx, ostream);
+    }
+    fz_catch(ctx)
+    {
+    }
 
-    // This could be a new search, continuation after failure or continuation after
-    // success but for the last hit on a page. We should look for the next page with
-    // hits until we run off the end of the docuement. Because of the third case
-    // mentioned above, we may already have run off the end of the document
-    assert(self.searchHits.count == 0);
-    assert(self.searchText.length > 0);
-    NSString *searchText = self.searchText;
-
-    dispatch_async(self.mulib.queue, ^{
-        NSInteger page = self.searchPage;
-        NSArray<MuPDFDKQuad *> *hits = nil;
-        while (0 <= page && page < self.pageCount)
-        {
-            FzPage *fzpage = [self getFzPage:page];
-            hits = fzpage.fzpage ? search_page(self.mulib.ctx, self->_fzdoc, fzpage.fzpage, searchText.UTF8String) : NSArray.array;
-            if (self.searchCancelled || hits.count > 0)
-                break;
+    return written;
+}
 
-            page += inc;
-            dispatch_async(dispatch_get_main_queue(), ^{
-                if (!self.searchCancelled)
-                    block(MuPDFDKSearch_Progress, page, CGRectNull);
-            });
-        }
+/// Write the changes made to the document since it was loaded into a buffer, as
+/// they would be appended to its file by an incremental save. Must be called on
+/// the mupdf queue. Throws on failure.
+- (fz_buffer *)writeChangesOf:(pdf_document *)idoc
+{
+    fz_context *ctx = self.mulib.ctx;
+    fz_buffer *buf = NULL;
+    fz_output *out = NULL;
+    fz_var(buf);
+    fz_var(out);
+    fz_try(ctx)
+    {
+        pdf_write_options opts = {0};
+        opts.do_incremental = 1;
+        buf = fz_new_buffer(ctx, 64 * 1024);
+        out = buffer_output(ctx, buf, idoc->file_size);
+        pdf_write_document(ctx, idoc, out, &opts);
+        fz_close_output(ctx, out);
+    }
+    fz_always(ctx)
+    {
+        fz_drop_output(ctx, out);
+    }
+    fz_catch(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+        fz_rethrow(ctx);
+    }
 
-        dispatch_async(dispatch_get_main_queue(), ^{
-            if (self.searchCancelled)
-            {
-                [self closeSearch];
-                block(MuPDFDKSearch_Cancelled, 0, CGRectNull);
-            }
-            else if (hits.count > 0)
-            {
-                // Found a page with at least one hit
-                NSInteger currentHit = direction == MuPDFDKSearch_Forwards ? 0 : hits.count -1;
-                self.searchStartPage = self.searchPage = page;
-                self.searchHits = hits;
-                self.searchCurrentHit = currentHit;
-                [self selectionChangedForPage:page];
-                block(MuPDFDKSearch_Found, page, hits[currentHit].enclosingRect);
-            }
-            else
-            {
-                // Failed to find a page with a hit
-                // Set up page for potential wrap around
-                self.searchPage = direction == MuPDFDKSearch_Forwards ? 0 : self.pageCount - 1;
-                block(MuPDFDKSearch_NotFound, 0, CGRectNull);
-            }
-        });
-    });
+    return buf;
 }
 
-- (void)cancelSearch
+/// Write the changes made to the document since it was loaded into a buffer, as
+/// they would be appended to its file by an incremental save. Returns NULL if the
+/// document cannot be saved that way. Also returns the path of the file and its
+/// length, to which the changes apply, so that the snapshot can be written without
+/// reference to the document, and the number of objects in the document when
+/// snapshotted, which the xref written covers. Must be called on the mupdf queue.
+- (fz_buffer *)snapshotChangesToFile:(NSString **)docPath length:(unsigned long long *)docLength xrefLength:(int *)xrefLength
 {
-    self.searchCancelled = YES;
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
+    fz_buffer *buf = NULL;
+    fz_var(buf);
+    // The changes must be appended to exactly the file the document was loaded from
+    NSString *path = self.loadedPath;
+    if (idoc == NULL || self->_source || idoc->file_size != (int64_t)[self lengthOfItemAtPath:path])
+        return NULL;
+
+    *docPath = path;
+    *docLength = (unsigned long long)idoc->file_size;
+
+    fz_try(ctx)
+    {
+        // Signing reads back the whole file, so must write to it
+        if (pdf_can_be_saved_incrementally(ctx, idoc) && !pdf_has_unsaved_sigs(ctx, idoc))
+        {
+            buf = [self writeChangesOf:idoc];
+            *xrefLength = pdf_xref_len(ctx, idoc);
+        }
+    }
+    fz_catch(ctx)
+    {
+        buf = NULL;
+    }
+
+    return buf;
 }
 
-- (void)closeSearch
+/// Whether the document's changes are still exactly those of a snapshot, that is
+/// whether it has not been edited since. Must be called on the mupdf queue.
+- (BOOL)changesMatchSnapshot:(fz_buffer *)snapshot xrefLength:(int)xrefLength
 {
-    if (self.searchHits.count > 0)
+    fz_context *ctx = self.mulib.ctx;
+    pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
+    fz_buffer *buf = NULL;
+    BOOL match = NO;
+    fz_var(buf);
+    fz_var(match);
+    if (idoc == NULL || pdf_xref_len(ctx, idoc) != xrefLength)
+        return NO;
+
+    fz_try(ctx)
     {
-        self.searchHits = nil;
-        [self selectionChangedForPage:self.searchPage];
+        buf = [self writeChangesOf:idoc];
+        match = buf->len == snapshot->len && memcmp(buf->data, snapshot->data, buf->len) == 0;
+    }
+    fz_always(ctx)
+    {
+        fz_drop_buffer(ctx, buf);
+    }
+    fz_catch(ctx)
+    {
+        match = NO;
     }
-    self.searchText = nil;
+
+    return match;
 }
 
-- (void)updateAllPages
+/// Copy a file a block at a time, so as to report progress, which is passed the
+/// number of bytes copied so far, and returns NO to abandon the copy
+- (BOOL)copyItemAtPath:(NSString *)from toPath:(NSString *)to progress:(BOOL (^)(unsigned long long done))progress
 {
-    for (MuPDFDKPageHolder *holder in _pages)
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:from];
+    if (![self createItemAtPath:to])
+        return NO;
+
+    id<ARDKSecureFS_Handle> secureIn = nil, secureOut = nil;
+    NSFileHandle *in = nil, *out = nil;
+    if (isSecure)
     {
-        if (holder.page.update)
-        {
-            CGSize size = holder.page.size;
-            holder.page.update(CGRectMake(0, 0, size.width, size.height));
-        }
+        secureIn = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:from];
+        secureOut = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForWritingAtPath:to];
+    }
+    else
+    {
+        in = [NSFileHandle fileHandleForReadingAtPath:from];
+        out = [NSFileHandle fileHandleForWritingAtPath:to];
     }
+
+    BOOL ok = isSecure ? (secureIn && secureOut) : (in && out);
+    unsigned long long done = 0;
+    while (ok)
+    {
+        NSData *data = isSecure ? [secureIn ARDKSecureFS_readDataOfLength:SAVE_COPY_BLOCK_SIZE] : [in readDataOfLength:SAVE_COPY_BLOCK_SIZE];
+        if (data.length == 0)
+            break;
+
+        if (isSecure)
+            [secureOut ARDKSecureFS_writeData:data];
+        else
+            [out writeData:data];
+
+        done += data.length;
+        ok = progress(done);
+    }
+
+    [secureIn ARDKSecureFS_closeFile];
+    [secureOut ARDKSecureFS_closeFile];
+    [in closeFile];
+    [out closeFile];
+    if (!ok)
+        [self deleteItemAtPath:to];
+
+    return ok;
 }
 
-- (void)updatePageNumbered:(NSInteger)pageNo changedRects:(NSArray<NSValue *> *)rects
+/// Append data to the end of a file
+- (BOOL)appendData:(NSData *)data toItemAtPath:(NSString *)path
 {
-    self.hasBeenModified = YES;
-    if (self.onSelectionChanged)
-        self.onSelectionChanged();
-    for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
-        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-            [weakTarget.target selectionHasChanged];
-
-    for (MuPDFDKPageHolder *h in self->_pages)
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
     {
-        if (h.pageNo == pageNo)
-        {
-            // Mark the page as dirty, so that the cached fzpage object
-            // and display list are reloaded.
-            h.page.displayListDirty = YES;
-            h.page.textDirty = YES;
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForUpdatingAtPath:path];
+        if (handle == nil)
+            return NO;
+
+        [handle ARDKSecureFS_seekToEndOfFile];
+        [handle ARDKSecureFS_writeData:data];
+        [handle ARDKSecureFS_synchronizeFile];
+        [handle ARDKSecureFS_closeFile];
+    }
+    else
+    {
+        NSFileHandle *handle = [NSFileHandle fileHandleForUpdatingAtPath:path];
+        if (handle == nil)
+            return NO;
 
-            if (h.page.update)
-            {
-                for (NSValue *v in rects)
-                    h.page.update(v.CGRectValue);
-            }
+        @try
+        {
+            [handle seekToEndOfFile];
+            [handle writeData:data];
+            [handle synchronizeFile];
+        }
+        @catch (NSException *exception)
+        {
+            return NO;
+        }
+        @finally
+        {
+            [handle closeFile];
         }
     }
+
+    return YES;
 }
 
-- (void)updatePageNumbered:(NSInteger)pageNo
+/// Write a snapshot of the document's changes to file, off the mupdf queue.
+/// The changes are appended either to the document's file in place, or to a
+/// copy that then replaces the file at path. The file and its length are those
+/// captured with the snapshot, so that the document itself is not accessed.
+- (ARDKSaveResult)writeSnapshot:(NSData *)changes ofFile:(NSString *)docPath length:(unsigned long long)length
+                             to:(NSString *)path via:(NSString *)tmpPath progress:(void (^)(CGFloat))progress
 {
-    self.hasBeenModified = YES;
-    if (self.onSelectionChanged)
-        self.onSelectionChanged();
-    for (MuPDFDKWeakEventTarget *weakTarget in _eventTargets)
-        if ([weakTarget.target respondsToSelector:@selector(selectionHasChanged)])
-            [weakTarget.target selectionHasChanged];
+    double total = (double)(length + changes.length);
+    void (^report)(unsigned long long) = ^(unsigned long long done) {
+        if (progress)
+            dispatch_async(dispatch_get_main_queue(), ^{
+                progress(done / total);
+            });
+    };
 
-    for (MuPDFDKPageHolder *h in self->_pages)
+    if (self.saveInPlace && [path isEqualToString:docPath])
     {
-        if (h.pageNo == pageNo)
-        {
-            // Mark the page as dirty, so that the cached fzpage object
-            // and display list are reloaded.
-            h.page.displayListDirty = YES;
-            h.page.textDirty = YES;
+        // The changes are written in a single call, so can
+        // be cancelled only beforehand
+        if (self.saveCancelled)
+            return ARDKSave_Cancelled;
+
+        NSString *journal = [self journalPathFor:path];
+        if (![self writeJournal:journal recordingLength:length])
+            return ARDKSave_Error;
+
+        BOOL ok = [self appendData:changes toItemAtPath:path];
+        if (!ok)
+            [self finishItemAtPath:path truncatingTo:@(length)];
+        [self deleteItemAtPath:journal];
+        report(length + changes.length);
+        return ok ? ARDKSave_Succeeded : ARDKSave_Error;
+    }
 
-            if (h.page.update)
-            {
-                CGRect wholePage = {CGPointZero, h.page.size};
-                h.page.update(wholePage);
-            }
-        }
+    BOOL copied = [self copyItemAtPath:docPath toPath:tmpPath progress:^BOOL(unsigned long long done) {
+        report(done);
+        return !self.saveCancelled;
+    }];
+    if (!copied)
+        return self.saveCancelled ? ARDKSave_Cancelled : ARDKSave_Error;
+
+    if (self.saveCancelled || ![self appendData:changes toItemAtPath:tmpPath])
+    {
+        [self deleteItemAtPath:tmpPath];
+        return self.saveCancelled ? ARDKSave_Cancelled : ARDKSave_Error;
     }
+
+    report(length + changes.length);
+    return [self moveItemAtPath:tmpPath toPath:path] ? ARDKSave_Succeeded : ARDKSave_Error;
 }
 
-- (void) updatePagesRecalc:(BOOL)recalc
+- (void)saveTo:(NSString *)path completion:(void (^)(ARDKSaveResult, ARError))block
 {
-    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
-    fz_context *ctx = self.mulib.ctx;
+    [self saveTo:path progress:nil completion:block];
+}
 
-    for (NSNumber *key in _fzpages)
-    {
-        FzPageHolder *holder = _fzpages[key];
-        pdf_page *page = (pdf_page *)holder.page.fzpage;
-        if (page)
-        {
-            fz_try(ctx)
+- (void)saveTo:(NSString *)path progress:(void (^)(CGFloat))progress completion:(void (^)(ARDKSaveResult, ARError))block
+{
+    BOOL jsEnable = _pdfFormFillingEnabled;
+    NSString *tmpPath = [self fileBasedOn:path];
+    NSUInteger modifications = self.modificationCount;
+    __weak typeof(self) weakSelf = self;
+    self.saveCancelled = NO;
+
+    // Saves are serialised on their own queue, visiting the mupdf queue only
+    // to snapshot the changes and to bring the document up to date afterwards.
+    // Rendering and editing continue while the file is written.
+    dispatch_async(self.saveQueue, ^{
+        __block ARDKSaveResult result = ARDKSave_Error;
+        __block fz_buffer *changes = NULL;
+        __block NSString *docPath = nil;
+        __block unsigned long long docLength = 0;
+        __block int xrefLength = 0;
+        dispatch_sync(self.mulib.queue, ^{
+            weakSelf.isBeingSaved = YES;
+            if (self.saveCancelled)
             {
-                pdf_document *pdoc = pdf_document_from_fz_document(ctx, self.fzdoc);
-                if (recalc && pdoc->recalculate)
-                    pdf_calculate_form(ctx, pdoc);
+                result = ARDKSave_Cancelled;
+                return;
+            }
 
-                NSMutableArray<NSValue *> *updateRects = [NSMutableArray array];
-                for (pdf_annot *annot = pdf_first_annot(ctx, page);annot;annot = pdf_next_annot(ctx, annot))
+            NSString *snapshotPath = nil;
+            int snapshotXrefLength = 0;
+            changes = [self snapshotChangesToFile:&snapshotPath length:&docLength xrefLength:&snapshotXrefLength];
+            xrefLength = snapshotXrefLength;
+            docPath = snapshotPath;
+            if (changes == NULL)
+                result = [self writeTo:path via:tmpPath jsEnable:jsEnable compact:NO] ? ARDKSave_Succeeded : ARDKSave_Error;
+        });
+
+        if (changes)
+        {
+            // The buffer is not altered until dropped, so can be read without the context
+            NSData *data = [NSData dataWithBytesNoCopy:changes->data length:changes->len freeWhenDone:NO];
+            result = [self writeSnapshot:data ofFile:docPath length:docLength to:path via:tmpPath progress:progress];
+            dispatch_sync(self.mulib.queue, ^{
+                fz_context *ctx = self.mulib.ctx;
+                if (result == ARDKSave_Succeeded)
                 {
-                    if (pdf_update_annot(ctx, annot))
+                    fz_try(ctx)
                     {
-                        fz_rect rect = pdf_bound_annot(ctx, annot);
-                        [updateRects addObject:[NSValue valueWithCGRect:rect_from_fz(rect)]];
+                        // Reopening from the file would discard edits made while it
+                        // was written, which are not in it, so the save fails instead.
+                        // Nor can those edits be folded into the file's base.
+                        BOOL unchanged = self.modificationCount == modifications
+                            && [self changesMatchSnapshot:changes xrefLength:xrefLength];
+                        [self reloadFrom:path canRebase:YES xrefLength:xrefLength
+                               unchanged:unchanged jsEnable:jsEnable];
                     }
-                }
-
-                for (pdf_widget *widget = pdf_first_widget(ctx, page);widget;widget = pdf_next_widget(ctx, widget))
-                {
-                    if (pdf_update_annot(ctx, widget))
+                    fz_catch(ctx)
                     {
-                        fz_rect rect = pdf_bound_widget(ctx, widget);
-                        [updateRects addObject:[NSValue valueWithCGRect:rect_from_fz(rect)]];
+                        result = ARDKSave_Error;
                     }
                 }
 
-                if (updateRects.count)
-                {
-                    // Poke the update block for each current instance of this page
-                    dispatch_async(dispatch_get_main_queue(), ^{
-                        [self updatePageNumbered:holder.pageNo changedRects:updateRects];
-                    });
-                }
-            }
-            fz_catch(ctx)
-            {
-            }
+                fz_drop_buffer(ctx, changes);
+            });
         }
-    }
+
+        if (result == ARDKSave_Succeeded)
+            [self restartJournalFor:path];
+
+        weakSelf.isBeingSaved = NO;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            typeof(self) strongSelf = weakSelf;
+            // Edits made while saving remain unsaved
+            if (result == ARDKSave_Succeeded && strongSelf.modificationCount == modifications)
+                strongSelf.hasBeenModified = NO;
+            if (progress && result == ARDKSave_Succeeded)
+                progress(1.0);
+            block(result, 0);
+        });
+    });
 }
 
-- (void)updatePages
+- (void)compactTo:(NSString *)path completion:(void (^)(ARDKSaveResult, ARError, unsigned long long, NSTimeInterval))block
 {
-    [self updatePagesRecalc:YES];
+    BOOL jsEnable = _pdfFormFillingEnabled;
+    NSString *tmpPath = [self fileBasedOn:path];
+    NSUInteger modifications = self.modificationCount;
+    __weak typeof(self) weakSelf = self;
+
+    dispatch_async(self.saveQueue, ^{
+        NSDate *start = [NSDate date];
+        __block BOOL written = NO;
+        dispatch_sync(self.mulib.queue, ^{
+            weakSelf.isBeingSaved = YES;
+            written = [self writeTo:path via:tmpPath jsEnable:jsEnable compact:YES];
+        });
+
+        if (written)
+            [self restartJournalFor:path];
+
+        unsigned long long size = written ? [self lengthOfItemAtPath:path] : 0;
+        NSTimeInterval time = -start.timeIntervalSinceNow;
+        weakSelf.isBeingSaved = NO;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            typeof(self) strongSelf = weakSelf;
+            if (written && strongSelf.modificationCount == modifications)
+                strongSelf.hasBeenModified = NO;
+            block(written ? ARDKSave_Succeeded : ARDKSave_Error, 0, size, time);
+        });
+    });
 }
 
-- (MuPDFPrintProfile)printProfile
+- (void)cancelSave
 {
-    return _printProfile;
+    self.saveCancelled = YES;
 }
 
-- (void)setPrintProfile:(MuPDFPrintProfile)printProfile
+- (BOOL)hasBeenModified
 {
-    _printProfile = printProfile;
-    [self updateAllPages];
+    return _hasBeenModified;
 }
 
-- (ARDKSoftProfile)softProfile
+- (void)setHasBeenModified:(BOOL)hasBeenModified
 {
-    return _softProfile;
+    if (hasBeenModified)
+    {
+        self.modificationCount++;
+        if (self.journalEdits)
+        {
+            dispatch_async(dispatch_get_main_queue(), ^{
+                [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(recordInJournal) object:nil];
+                [self performSelector:@selector(recordInJournal) withObject:nil afterDelay:JOURNAL_DELAY];
+            });
+        }
+    }
+
+    _hasBeenModified = hasBeenModified;
 }
 
-- (void)setSoftProfile:(ARDKSoftProfile)softProfile
+/// The journal for the edits to a document file, held in the temporary directory,
+/// under a name derived from the document's path
+- (NSString *)journalPathForDoc:(NSString *)docPath
 {
-    _softProfile = softProfile;
-    [self updateAllPages];
+    // FNV-1a, so that the name is stable between sessions
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = docPath.UTF8String; *c; c++)
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+
+    NSString *name = [NSString stringWithFormat:@"%@-%016llx.editjournal", docPath.lastPathComponent.stringByDeletingPathExtension, hash];
+    return [self.mulib.settings.temporaryPath stringByAppendingPathComponent:name];
 }
 
-- (void)abortLoad
+- (BOOL)itemExistsAtPath:(NSString *)path
 {
-    self.loadAborted = YES;
-    if (self.errorBlock)
-        self.errorBlock(ARDKDocErrorType_Aborted);
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
+        return [MuPDFDKLib.secureFS ARDKSecureFS_fileExists:path];
+    else
+        return [[NSFileManager defaultManager] fileExistsAtPath:path];
 }
 
-- (void)providePassword:(NSString *)password
+- (NSData *)contentsOfItemAtPath:(NSString *)path
 {
-    assert([NSThread isMainThread]);
-    dispatch_async(self.mulib.queue, ^{
-        fz_context *ctx = self.mulib.ctx;
-        NSInteger count = 0;
-        int authenticateResult = 0;
-        BOOL failed = NO;
-        fz_var(count);
-        fz_var(authenticateResult);
-        fz_var(failed);
-        fz_try(ctx)
-        {
-            authenticateResult = fz_authenticate_password(self.mulib.ctx, self->_fzdoc, password.UTF8String);
-            if (authenticateResult)
-            {
-                count = fz_count_pages(ctx, self.fzdoc);
-            }
-        }
-        fz_catch(ctx)
+    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path])
+    {
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:path];
+        NSData *data = [handle ARDKSecureFS_readDataOfLength:(NSUInteger)[self lengthOfItemAtPath:path]];
+        [handle ARDKSecureFS_closeFile];
+        return data;
+    }
+    else
+    {
+        return [NSData dataWithContentsOfFile:path];
+    }
+}
+
+/// Identify a file for journalling, by its length, modification time, and a digest
+/// of its final bytes, so that records are replayed only onto the file they were
+/// made against. Returns nil if the file cannot be read.
+- (NSData *)journalIdentityOfItemAtPath:(NSString *)path
+{
+    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path];
+    NSDictionary<NSString *, id> *attributes = isSecure ? [MuPDFDKLib.secureFS ARDKSecureFS_attributesOfItemAtPath:path]
+                                                        : [[NSFileManager defaultManager] attributesOfItemAtPath:path error:NULL];
+    uint64_t length = [attributes[NSFileSize] unsignedLongLongValue];
+    double mtime = [attributes[NSFileModificationDate] timeIntervalSinceReferenceDate];
+    uint64_t start = length > JOURNAL_IDENTITY_SPAN ? length - JOURNAL_IDENTITY_SPAN : 0;
+
+    NSData *tail = nil;
+    if (isSecure)
+    {
+        id<ARDKSecureFS_Handle> handle = [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:path];
+        [handle ARDKSecureFS_seekToFileOffset:start];
+        tail = [handle ARDKSecureFS_readDataOfLength:(NSUInteger)(length - start)];
+        [handle ARDKSecureFS_closeFile];
+    }
+    else
+    {
+        NSFileHandle *handle = [NSFileHandle fileHandleForReadingAtPath:path];
+        [handle seekToFileOffset:start];
+        tail = [handle readDataOfLength:(NSUInteger)(length - start)];
+        [handle closeFile];
+    }
+
+    if (attributes == nil || tail.length != length - start)
+        return nil;
+
+    NSMutableData *identity = [NSMutableData dataWithCapacity:JOURNAL_IDENTITY_SIZE];
+    [identity appendBytes:&length length:8];
+    [identity appendBytes:&mtime length:8];
+    unsigned char digest[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(tail.bytes, (CC_LONG)tail.length, digest);
+    [identity appendBytes:digest length:sizeof(digest)];
+    return identity;
+}
+
+/// Whether edits to a document file can be journalled. The journal holds the
+/// document's content, and so is not kept for a document within the secure FS
+/// unless the temporary directory is also within it.
+- (BOOL)canJournalDoc:(NSString *)docPath
+{
+    NSString *temporaryPath = self.mulib.settings.temporaryPath;
+    if (temporaryPath == nil)
+        return NO;
+
+    return ![MuPDFDKLib.secureFS ARDKSecureFS_isSecure:docPath]
+        || [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:[self journalPathForDoc:docPath]];
+}
+
+/// Append a record of the document's changes to its edit journal. The changes are
+/// snapshotted as for saving, and so each record supersedes those before it.
+- (void)recordInJournal
+{
+    if (!self.hasBeenModified || self.mulib.settings.temporaryPath == nil)
+        return;
+
+    dispatch_async(self.saveQueue, ^{
+        __block fz_buffer *changes = NULL;
+        __block NSString *docPath = nil;
+        dispatch_sync(self.mulib.queue, ^{
+            NSString *snapshotPath = nil;
+            unsigned long long docLength;
+            int xrefLength;
+            changes = [self snapshotChangesToFile:&snapshotPath length:&docLength xrefLength:&xrefLength];
+            docPath = snapshotPath;
+        });
+
+        if (changes == NULL)
+            return;
+
+        // Unless recovered from the journal, the changes apply to the document's own file
+        if (self->_journalDocPath == nil)
+            self->_journalDocPath = docPath;
+        if (self->_journalDocIdentity == nil && [self canJournalDoc:self->_journalDocPath])
+            self->_journalDocIdentity = [self journalIdentityOfItemAtPath:self->_journalDocPath];
+
+        if (self->_journalDocIdentity == nil)
         {
-            failed = YES;
+            dispatch_sync(self.mulib.queue, ^{
+                fz_drop_buffer(self.mulib.ctx, changes);
+            });
+            return;
         }
-        dispatch_async(dispatch_get_main_queue(), ^{
-            if (failed)
-            {
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
-                return;
-            }
 
-            if (authenticateResult == 0)
-            {
-                // incorrect password
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_PasswordRequest);
-            }
-            else if (count <= 0)
-            {
-                if (self.errorBlock)
-                    self.errorBlock(ARDKDocErrorType_UnableToLoadDocument);
-                // A document may continue to load after an error, but
-                // not in this case, so signal loading compelete.
-                if (self.progressBlock)
-                    self.progressBlock(0, YES);
-                for (MuPDFDKWeakEventTarget *weakTarget in self.eventTargets)
-                    [weakTarget.target updatePageCount:0 andLoadingComplete:YES];
-            }
-            else
-            {
-                self->_reportedPageCount = count;
-                [self loadSomePages];
-            }
+        uint64_t length = self->_journalPrefix.length + changes->len;
+        NSMutableData *record = [NSMutableData dataWithCapacity:JOURNAL_HEADER_SIZE + length];
+        [record appendBytes:JOURNAL_MAGIC length:4];
+        [record appendData:self->_journalDocIdentity];
+        [record appendBytes:&length length:8];
+        if (self->_journalPrefix)
+            [record appendData:self->_journalPrefix];
+        [record appendBytes:changes->data length:changes->len];
+
+        dispatch_sync(self.mulib.queue, ^{
+            fz_drop_buffer(self.mulib.ctx, changes);
         });
+
+        NSString *journal = [self journalPathForDoc:self->_journalDocPath];
+        unsigned long long journalLength = [self lengthOfItemAtPath:journal];
+        if (journalLength > JOURNAL_COMPACT_SIZE && journalLength > 4 * record.length)
+        {
+            // Start afresh with just the latest record, replacing the journal
+            // only once that is safely written
+            NSString *fresh = [journal stringByAppendingPathExtension:@"new"];
+            if ([self createItemAtPath:fresh] && [self appendData:record toItemAtPath:fresh])
+                [self moveItemAtPath:fresh toPath:journal];
+        }
+        else if ([self itemExistsAtPath:journal] || [self createItemAtPath:journal])
+        {
+            [self appendData:record toItemAtPath:journal];
+        }
     });
 }
 
-- (FzPage *)getFzPage:(NSInteger)pageNumber
+/// Discard the edit journal once the edits are saved, with future records applying
+/// to the saved file. Must be called on the save queue.
+- (void)restartJournalFor:(NSString *)path
 {
-    assert(strcmp(dispatch_queue_get_label(DISPATCH_CURRENT_QUEUE_LABEL), queue_label) == 0);
-    NSNumber *pn = [NSNumber numberWithInteger:pageNumber];
-    FzPageHolder *holder = _fzpages[pn];
+    if (_journalDocPath && self.mulib.settings.temporaryPath)
+        [self deleteItemAtPath:[self journalPathForDoc:_journalDocPath]];
 
-    if (holder.page)
-        return holder.page;
+    _journalDocPath = path;
+    _journalPrefix = nil;
+    _journalDocIdentity = nil;
+}
 
-    // There was no holder for this page number, or the weak page property may have been freed.
-    // Overwrite it in either case.
-    fz_context *ctx = self.mulib.ctx;
-    fz_page *fzpage = NULL;
-    fz_try(ctx)
+/// Replay the edit journal left by a session that ended without saving, if any,
+/// by opening the document from a copy of its file with the journalled changes
+/// appended. Must be called on the mupdf queue, before opening the document.
+- (void)recoverFromJournal
+{
+    if (!self.journalEdits || ![self canJournalDoc:self.path])
+        return;
+
+    NSString *journal = [self journalPathForDoc:self.path];
+    NSData *data = [self itemExistsAtPath:journal] ? [self contentsOfItemAtPath:journal] : nil;
+    NSData *identity = data ? [self journalIdentityOfItemAtPath:self.path] : nil;
+
+    // Find the latest complete record that applies to the file as it is. Any
+    // record cut short by the session ending must be the last.
+    NSData *update = nil;
+    const uint8_t *bytes = data.bytes;
+    NSUInteger pos = 0;
+    while (pos + JOURNAL_HEADER_SIZE <= data.length && memcmp(bytes + pos, JOURNAL_MAGIC, 4) == 0)
     {
-        fzpage = fz_load_page(ctx, self.fzdoc, (int)pageNumber);
+        uint64_t length;
+        memcpy(&length, bytes + pos + 4 + JOURNAL_IDENTITY_SIZE, 8);
+        if (length > data.length - pos - JOURNAL_HEADER_SIZE)
+            break;
+
+        if (identity && memcmp(bytes + pos + 4, identity.bytes, JOURNAL_IDENTITY_SIZE) == 0)
+            update = [data subdataWithRange:NSMakeRange(pos + JOURNAL_HEADER_SIZE, (NSUInteger)length)];
+        pos += JOURNAL_HEADER_SIZE + length;
     }
-    fz_catch(ctx)
+
+    if (update.length == 0)
     {
+        if (data)
+            [self deleteItemAtPath:journal];
+        return;
     }
 
-    FzPage *page = [FzPage pageFromPage:fzpage ofDoc:self];
-
-    _fzpages[pn] = [FzPageHolder holderForPage:page numbered:pageNumber];
+    NSString *recovered = [self.mulib.settings.temporaryPath stringByAppendingPathComponent:
+                           [journal.lastPathComponent.stringByDeletingPathExtension stringByAppendingPathExtension:self.path.pathExtension]];
+    [self deleteItemAtPath:recovered];
+    if (![self copyItemAtPath:self.path toPath:recovered] || ![self appendData:update toItemAtPath:recovered])
+        return;
 
-    return page;
+    // Further records continue to apply to the original file
+    _journalDocPath = self.path;
+    _journalDocIdentity = identity;
+    _journalPrefix = update;
+    _recoveredPath = recovered;
+    _recoveredFromJournal = YES;
 }
 
-- (id<ARDKPage>)getPage:(NSInteger)pageNumber update:(void (^)(CGRect))block
+// The number of the page whose /Annots holds "widget", found from the widget's
+// /P entry or, lacking that, from the page objects, without loading any page.
+// Returns -1 if the widget is on no page.
+static int widget_page_number(fz_context *ctx, pdf_document *doc, pdf_obj *widget)
 {
-    MuPDFDKPage *page;
-    @synchronized (self.pageSizes) {
-        page = [[MuPDFDKPage alloc] initForPage:pageNumber ofDoc:self withSize:self.pageSizes[pageNumber].CGSizeValue update:block];
-    }
+    pdf_obj *page = pdf_dict_get(ctx, widget, PDF_NAME(P));
+    int pageNumber = page ? pdf_lookup_page_number(ctx, doc, page) : -1;
+    if (pageNumber >= 0)
+        return pageNumber;
 
-    @synchronized(_pages)
+    int count = pdf_count_pages(ctx, doc);
+    for (int i = 0; i < count; i++)
     {
-        // Remove from the pages array any defunct pages and add this new one
-        NSMutableArray<MuPDFDKPageHolder *> *pages = [NSMutableArray array];
-        for (MuPDFDKPageHolder *holder in _pages)
+        pdf_obj *annots = pdf_dict_get(ctx, pdf_lookup_page_obj(ctx, doc, i), PDF_NAME(Annots));
+        int n = pdf_array_len(ctx, annots);
+        for (int j = 0; j < n; j++)
         {
-            if (holder.page)
-                [pages addObject:holder];
+            if (pdf_to_num(ctx, pdf_array_get(ctx, annots, j)) == pdf_to_num(ctx, widget))
+                return i;
         }
-
-        [pages addObject:[MuPDFDKPageHolder holderForPage:page numbered:pageNumber]];
-
-        _pages = pages;
     }
 
-    [page findFormFields];
-
-    return page;
+    return -1;
 }
 
-- (NSString *)fileBasedOn:(NSString *)templatePath
+// Find the document's signed signatures from its form's field tree, loading
+// only the pages that hold them
+- (NSArray<MuPDFDKSignatureCheck *> *)findSignatures
 {
-    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:templatePath];
-    NSFileManager *fman = [NSFileManager defaultManager];
-#if TARGET_OS_OSX
-    NSString *filePath = self.mulib.settings.temporaryPath;
-#else /* TARGET_OS_OSX */
-    NSString *filePath = [templatePath stringByDeletingLastPathComponent];
-#endif /* TARGET_OS_OSX */
-    NSString *fileNameWithExtension = [templatePath lastPathComponent];
-    NSString *fileName = [fileNameWithExtension stringByDeletingPathExtension];
-    NSString *extension = [fileNameWithExtension pathExtension];
-    NSInteger i = 0;
-    NSString *path;
-    NSString *fullPath;
-    while (YES)
-    {
-        path = [NSString stringWithFormat:@"%@%ld.%@", fileName, (long)i, extension];
-        fullPath = [filePath stringByAppendingPathComponent:path];
-        BOOL exists = isSecure ? [MuPDFDKLib.secureFS ARDKSecureFS_fileExists:fullPath] : [fman fileExistsAtPath:fullPath];
-        if (!exists)
-            break;
+    fz_context *ctx = self.mulib.ctx;
+    NSMutableArray<MuPDFDKSignatureCheck *> *checks = [NSMutableArray array];
+    pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
+    if (idoc == NULL)
+        return checks;
 
-        i++;
-    }
+    // The object numbers of the signed signature widgets, by page
+    NSMutableDictionary<NSNumber *, NSMutableSet<NSNumber *> *> *signedWidgets = [NSMutableDictionary dictionary];
+    pdf_obj *fields = NULL;
+    fz_var(fields);
+    fz_try(ctx)
+    {
+        fields = get_fields(ctx, idoc);
+        int n = pdf_array_len(ctx, fields);
+        for (int i = 0; i < n; i++)
+        {
+            pdf_obj *widget = pdf_array_get(ctx, fields, i);
+            if (pdf_field_type(ctx, widget) != PDF_WIDGET_TYPE_SIGNATURE
+                || pdf_dict_get(ctx, widget, PDF_NAME(V)) == NULL)
+                continue;
 
-    return fullPath;
-}
+            int pageNumber = widget_page_number(ctx, idoc, widget);
+            if (pageNumber < 0 || pageNumber >= _reportedPageCount)
+                continue;
 
-- (BOOL)createItemAtPath:(NSString *)path
-{
-    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:path];
-    if (isSecure)
+            if (signedWidgets[@(pageNumber)] == nil)
+                signedWidgets[@(pageNumber)] = [NSMutableSet set];
+            [signedWidgets[@(pageNumber)] addObject:@(pdf_to_num(ctx, widget))];
+        }
+    }
+    fz_always(ctx)
     {
-        [MuPDFDKLib.secureFS ARDKSecureFS_fileDelete:path];
-        return [MuPDFDKLib.secureFS ARDKSecureFS_createFileAtPath:path];
+        pdf_drop_obj(ctx, fields);
     }
-    else
+    fz_catch(ctx)
     {
-        [NSFileManager.defaultManager removeItemAtPath:path error:nil];
-        return [NSFileManager.defaultManager createFileAtPath:path contents:nil attributes:nil];
     }
-}
 
-- (BOOL)copyItemAtPath:(NSString *)from toPath:(NSString *)to
-{
-    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:from];
-    if (isSecure)
+    NSArray<NSNumber *> *pageNumbers = [signedWidgets.allKeys sortedArrayUsingSelector:@selector(compare:)];
+    for (NSNumber *pageNumber in pageNumbers)
     {
-        assert ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:to]);
-        return [MuPDFDKLib.secureFS ARDKSecureFS_fileCopy:from to:to];
+        NSInteger i = pageNumber.integerValue;
+        NSSet<NSNumber *> *nums = signedWidgets[pageNumber];
+        FzPage *page = [self getFzPage:i];
+        if (page.fzpage == NULL)
+            continue;
+
+        for (pdf_widget *widget = pdf_first_widget(ctx, (pdf_page *)page.fzpage); widget; widget = pdf_next_widget(ctx, widget))
+        {
+            if (![nums containsObject:@(pdf_to_num(ctx, widget->obj))])
+                continue;
+
+            char *contents = NULL;
+            fz_var(contents);
+            fz_try(ctx)
+            {
+                MuPDFDKSignatureCheck *check = [[MuPDFDKSignatureCheck alloc] init];
+                check.pageNumber = i;
+                check.rect = rect_from_fz(pdf_bound_widget(ctx, widget));
+                [checks addObject:check];
+
+                size_t contents_len = pdf_signature_contents(ctx, idoc, widget->obj, &contents);
+                int nranges = pdf_signature_byte_range(ctx, idoc, widget->obj, NULL);
+                if (contents && nranges > 0)
+                {
+                    NSMutableData *ranges = [NSMutableData dataWithLength:nranges * sizeof(fz_range)];
+                    pdf_signature_byte_range(ctx, idoc, widget->obj, ranges.mutableBytes);
+                    check.byteRanges = ranges;
+                    check.contents = [NSData dataWithBytes:contents length:contents_len];
+                }
+
+                // Find which update invalidated the signature. 0 means it's still
+                // valid. 1 means the last update invalidated it. 2 means the last but one, etc..
+                check.invalidChangePoint = pdf_validate_signature(ctx, widget);
+            }
+            fz_always(ctx)
+            {
+                fz_free(ctx, contents);
+            }
+            fz_catch(ctx)
+            {
+            }
+        }
     }
-    else
+
+    return checks;
+}
+
+// Send the data between two offsets of a file to verifiers, through a buffer of
+// VERIFY_BLOCK_SIZE bytes. Throws if the file ends first.
+static void feed_verifiers(fz_context *ctx, fz_stream *stm, int64_t start, int64_t end,
+                           NSArray<id<PKCS7Verifier>> *verifiers, unsigned char *buf)
+{
+    fz_seek(ctx, stm, start, SEEK_SET);
+    int64_t remaining = end - start;
+    while (remaining > 0)
     {
-        return [[NSFileManager defaultManager] copyItemAtPath:from toPath:to error:NULL];
+        size_t n = fz_read(ctx, stm, buf, (size_t)MIN(remaining, VERIFY_BLOCK_SIZE));
+        if (n == 0)
+            fz_throw(ctx, FZ_ERROR_GENERIC, "Signed byte range extends beyond the file");
+
+        // Digesting dominates, so update the verifiers concurrently
+        NSData *data = [NSData dataWithBytesNoCopy:buf length:n freeWhenDone:NO];
+        dispatch_apply(verifiers.count, dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0), ^(size_t i) {
+            [verifiers[i] data:data];
+        });
+
+        remaining -= n;
     }
 }
 
-- (BOOL)moveItemAtPath:(NSString *)from toPath:(NSString *)to
+// Read the byte ranges of all the signatures in a single pass through the file,
+// passing each block read to the verifiers of all the signatures whose ranges
+// cover it. Typically the ranges of a document's signatures are prefixes of
+// one another, so this reads the data once, rather than once per signature.
+//
+// The data from the start of the file up to the first hole in any signature's
+// ranges is common to all of them, and so is digested only once, by the first
+// signature's verifier, which is then forked for the others where possible.
+//
+// The file is read through "stm", with "ctx", both of which are the caller's own,
+// so that this need not run on the mupdf queue.
+- (BOOL)feedSignatures:(NSArray<MuPDFDKSignatureCheck *> *)checks fromStream:(fz_stream *)stm ctx:(fz_context *)ctx
 {
-    BOOL isSecure = [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:from];
-    if (isSecure)
+    unsigned char *buf = NULL;
+    BOOL success = NO;
+
+    // The points at which the set of signatures covering the data can change
+    NSMutableIndexSet *bounds = [NSMutableIndexSet indexSet];
+    int64_t shared = -1;
+    for (MuPDFDKSignatureCheck *check in checks)
     {
-        id<ARDKSecureFS> secureFs = MuPDFDKLib.secureFS;
-        assert ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:to]);
-        if ([secureFs ARDKSecureFS_fileExists:to])
-            [secureFs ARDKSecureFS_fileDelete:to];
+        const fz_range *ranges = check.byteRanges.bytes;
+        for (NSUInteger i = 0; i < check.byteRanges.length / sizeof(fz_range); i++)
+        {
+            [bounds addIndex:(NSUInteger)ranges[i].offset];
+            [bounds addIndex:(NSUInteger)(ranges[i].offset + ranges[i].length)];
+        }
 
-        return [secureFs ARDKSecureFS_fileRename:from to:to];
+        int64_t prefix = ranges[0].offset == 0 ? ranges[0].length : 0;
+        shared = shared < 0 ? prefix : MIN(shared, prefix);
     }
-    else
-    {
-        NSFileManager *fman = [NSFileManager defaultManager];
-        if ([fman fileExistsAtPath:to])
-            [fman removeItemAtPath:to error:NULL];
 
-        return [fman moveItemAtPath:from toPath:to error:NULL];
+    MuPDFDKSignatureCheck *leader = checks.firstObject;
+    BOOL forking = checks.count > 1 && shared > 0 && [leader.verifier respondsToSelector:@selector(forkFor:)];
+    if (forking)
+    {
+        for (MuPDFDKSignatureCheck *check in checks)
+        {
+            if (check != leader)
+                check.forkedLength = shared;
+        }
     }
-}
 
-- (void)saveTo:(NSString *)path completion:(void (^)(ARDKSaveResult, ARError))block
-{
-    BOOL jsEnable = _pdfFormFillingEnabled;
-    NSString *tmpPath = [self fileBasedOn:path];
-    __weak typeof(self) weakSelf = self;
-    
-    dispatch_async(self.mulib.queue, ^{
-        fz_context *ctx = self.mulib.ctx;
-        BOOL written = NO;
-        fz_output *ostream = NULL;
-        weakSelf.isBeingSaved = YES;
-        fz_var(written);
-        fz_var(ostream);
-        fz_try(ctx)
+    fz_var(buf);
+    fz_var(success);
+    fz_try(ctx)
+    {
+        buf = fz_malloc(ctx, VERIFY_BLOCK_SIZE);
+        NSUInteger start = bounds.firstIndex;
+        NSUInteger end;
+        for (; start != NSNotFound; start = end)
         {
-            pdf_document *idoc = pdf_specifics(ctx, self.fzdoc);
-            if (idoc)
+            // The leader now has just the shared data
+            if (forking && (int64_t)start == shared)
             {
-                pdf_write_options opts = {0};
-                opts.do_incremental = pdf_can_be_saved_incrementally(ctx, idoc);
-                if (opts.do_incremental ? [self copyItemAtPath:self.path toPath:tmpPath] : [self createItemAtPath:tmpPath])
+                for (MuPDFDKSignatureCheck *check in checks)
                 {
-                    if ([MuPDFDKLib.secureFS ARDKSecureFS_isSecure:tmpPath])
+                    if (check == leader)
+                        continue;
+
+                    id<PKCS7Verifier> fork = [leader.verifier forkFor:check.contents];
+                    if (fork)
                     {
-                        ostream = secure_output(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForUpdatingAtPath:tmpPath]);
+                        check.verifier = fork;
                     }
                     else
                     {
-                        // When using a secure FS we need to avoid calling fileSystemRepresentation
-                        // which would Unicode Normalize tmpPath
-                        if (MuPDFDKLib.secureFS)
-                            ostream = fz_new_output_with_path(ctx, [tmpPath UTF8String], 1);
-                        else
-                            ostream = fz_new_output_with_path(ctx, tmpPath.fileSystemRepresentation, 1);
+                        // Catch up the check's own verifier
+                        feed_verifiers(ctx, stm, 0, shared, @[check.verifier], buf);
                     }
+                }
+            }
 
-                    pdf_write_document(ctx, idoc, ostream, &opts);
-                    fz_close_output(ctx, ostream);
-                    if ([self moveItemAtPath:tmpPath toPath:path])
-                    {
-                        // Reopen the document, first removing all references to objects
-                        fz_drop_document(ctx, self->_fzdoc);
-                        self->_fzdoc = NULL;
-                        fz_drop_stream(ctx, self->_stream);
-                        self->_stream = NULL;
-
-                        self->_fzpages = [NSMutableDictionary dictionaryWithCapacity:INITIAL_FZPAGE_CACHE_SIZE];
-
-                        @synchronized(self->_pages)
-                        {
-                            for (MuPDFDKPageHolder *holder in self->_pages)
-                            {
-                                [holder.page drop_page];
-                                [holder.page drop_list];
-                                [holder.page forgetSignatures];
-                            }
-                        }
+            end = [bounds indexGreaterThanIndex:start];
+            if (end == NSNotFound)
+                break;
 
-                        if (MuPDFDKLib.secureFS && [MuPDFDKLib.secureFS ARDKSecureFS_isSecure:@(self.path.UTF8String)])
-                            self->_stream = secure_stream(ctx, [MuPDFDKLib.secureFS ARDKSecureFS_fileHandleForReadingAtPath:@(self.path.UTF8String)]);
-                        else
-                            self->_stream = fz_open_file(ctx, self.path.UTF8String);
+            NSMutableArray<id<PKCS7Verifier>> *covering = [NSMutableArray array];
+            for (MuPDFDKSignatureCheck *check in checks)
+            {
+                if ((int64_t)start < check.forkedLength)
+                    continue;
 
-                        self->_fzdoc = fz_open_document_with_stream(ctx, "file.pdf", self->_stream);
-                        [self enableJS:jsEnable];
-                        self->_path = path;
-                        self->_hasBeenModified = NO;
-                        written = YES;
+                const fz_range *ranges = check.byteRanges.bytes;
+                for (NSUInteger i = 0; i < check.byteRanges.length / sizeof(fz_range); i++)
+                {
+                    if (ranges[i].offset <= (int64_t)start && (int64_t)start < ranges[i].offset + (int64_t)ranges[i].length)
+                    {
+                        [covering addObject:check.verifier];
+                        break;
                     }
                 }
             }
+
+            if (covering.count == 0)
+                continue;
+
+            feed_verifiers(ctx, stm, start, end, covering, buf);
         }
-        fz_always(ctx)
+
+        success = YES;
+    }
+    fz_always(ctx)
+    {
+        fz_free(ctx, buf);
+    }
+    fz_catch(ctx)
+    {
+    }
+
+    return success;
+}
+
+- (void)verifyAllSignatures:(id<PKCS7Verifier> (^)(void))makeVerifier
+                   onResult:(void (^)(NSInteger, CGRect, PKCS7VerifyResult, int, id<PKCS7DesignatedName>, id<PKCS7Description>))result
+                 completion:(void (^)(void))completion
+{
+    dispatch_async(self.mulib.queue, ^{
+        NSArray<MuPDFDKSignatureCheck *> *checks = [self findSignatures];
+        NSMutableArray<MuPDFDKSignatureCheck *> *readable = [NSMutableArray array];
+        for (MuPDFDKSignatureCheck *check in checks)
         {
-            fz_drop_output(ctx, ostream);
+            if (check.contents == nil)
+                continue;
+
+            id<PKCS7Verifier> verifier = makeVerifier();
+            if ([verifier respondsToSelector:@selector(begin:)])
+                [verifier begin:check.contents];
+            else
+                [verifier begin];
+
+            check.verifier = verifier;
+            [readable addObject:check];
         }
-        fz_catch(ctx)
+
+        // The signed data is read through a stream of its own, with a context of
+        // its own, so doesn't involve the document. Opened now, the stream holds
+        // the file as loaded, which saves only ever extend or replace.
+        fz_context *sctx = NULL;
+        fz_stream *stm = NULL;
+        fz_var(stm);
+        if (readable.count > 0 && self->_source == nil)
         {
+            sctx = fz_clone_context(self.mulib.ctx);
+            if (sctx)
+            {
+                fz_try(sctx)
+                {
+                    stm = [self openStreamOnFile:self.loadedPath ctx:sctx];
+                }
+                fz_catch(sctx)
+                {
+                }
+            }
         }
 
-        weakSelf.isBeingSaved = NO;
-        dispatch_async(dispatch_get_main_queue(), ^{
-            block(written ? ARDKSave_Succeeded : ARDKSave_Error, 0);
+        // The rest doesn't involve the document, so leave the mupdf queue, and
+        // check the signatures concurrently
+        dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+        dispatch_async(queue, ^{
+            BOOL fed = stm && [self feedSignatures:readable fromStream:stm ctx:sctx];
+            if (sctx)
+            {
+                fz_drop_stream(sctx, stm);
+                fz_drop_context(sctx);
+            }
+
+            dispatch_apply(checks.count, queue, ^(size_t i) {
+                MuPDFDKSignatureCheck *check = checks[i];
+                PKCS7VerifyResult res = PKCS7VerifyResult_Unknown;
+                id<PKCS7DesignatedName> name = nil;
+                id<PKCS7Description> description = nil;
+                if (check.verifier && fed)
+                {
+                    res = [check.verifier verify:check.contents];
+                    name = [check.verifier name:check.contents];
+                    description = [check.verifier description:check.contents];
+                }
+
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    result(check.pageNumber, check.rect, res, check.invalidChangePoint, name, description);
+                });
+            });
+
+            dispatch_async(dispatch_get_main_queue(), ^{
+                completion();
+            });
         });
     });
 }
@@ -3854,6 +6869,21 @@ static id<ARDKSecureFS> MuPDFDKLib_secureFS = nil;
 #if (TARGET_OS_IPHONE || TARGET_IPHONE_SIMULATOR)
 #if !defined(SODK_EXCLUDE_OPENSSL_PDF_SIGNING)
         
+        // Install locking before any other use of OpenSSL, leaving alone
+        // any already set up by the app
+        static dispatch_once_t opensslOnceToken;
+        dispatch_once(&opensslOnceToken, ^{
+            if (CRYPTO_get_locking_callback() == NULL)
+            {
+                openssl_mutexes = calloc(CRYPTO_num_locks(), sizeof(pthread_mutex_t));
+                for (int i = 0; i < CRYPTO_num_locks(); i++)
+                    pthread_mutex_init(&openssl_mutexes[i], NULL);
+
+                CRYPTO_THREADID_set_callback(openssl_thread_id);
+                CRYPTO_set_locking_callback(openssl_lock);
+            }
+        });
+
         // initialize the OpenSLL and Crypto libraries
         SSL_library_init();
         SSL_load_error_strings();
@@ -3864,11 +6894,19 @@ static id<ARDKSecureFS> MuPDFDKLib_secureFS = nil;
 
         _settings = settings;
         MuPDFDKLib_secureFS = settings.secureFs;
+        secure_stream_configure(settings);
         self.queue = dispatch_queue_create(queue_label, NULL);
+        self.updateBmPool = [NSMutableArray array];
+        self.draftBmPool = [NSMutableArray array];
+        static dispatch_once_t onceToken;
+        dispatch_once(&onceToken, ^{
+            for (int i = 0; i < FZ_LOCK_MAX; i++)
+                pthread_mutex_init(&mupdf_mutexes[i], NULL);
+        });
         __block fz_context *ctx;
         __block BOOL failed = NO;
         dispatch_sync(self.queue, ^{
-            ctx = fz_new_context(NULL, NULL, 64<<20);
+            ctx = fz_new_context(NULL, &mupdf_locks, 64<<20);
             fz_try(ctx)
             {
                 fz_register_document_handlers(ctx);
@@ -3895,9 +6933,74 @@ static id<ARDKSecureFS> MuPDFDKLib_secureFS = nil;
     });
 }
 
+- (ARDKBitmap *)takeUpdateBitmap
+{
+    @synchronized (self.updateBmPool)
+    {
+        ARDKBitmap *bm = self.updateBmPool.lastObject;
+        if (bm)
+        {
+            [self.updateBmPool removeLastObject];
+            return bm;
+        }
+    }
+
+    UIScreen *screen = [UIScreen mainScreen];
+    CGSize size = ARCGSizeScale(screen.bounds.size, screen.scale);
+    return [ARDKBitmap bitmapAtSize:CGSizeMake(size.width, size.height/UPDATE_BITMAP_PROPORTION) ofType:ARDKBitmapType_RGBA8888];
+}
+
+- (void)returnUpdateBitmap:(ARDKBitmap *)bm
+{
+    @synchronized (self.updateBmPool)
+    {
+        // Retain no more than can be in use at once
+        if (bm && self.updateBmPool.count < [NSProcessInfo processInfo].activeProcessorCount)
+            [self.updateBmPool addObject:bm];
+    }
+}
+
+- (ARDKBitmap *)takeDraftBitmapAtSize:(CGSize)size
+{
+    @synchronized (self.draftBmPool)
+    {
+        ARDKBitmap *bm = self.draftBmPool.lastObject;
+        if ([bm canAdjustToSize:size])
+        {
+            [self.draftBmPool removeLastObject];
+            [bm adjustToSize:size];
+            return bm;
+        }
+    }
+
+    // Allocate for at least the screen, so that the bitmap can serve
+    // for any draft of a view that fits on screen
+    UIScreen *screen = [UIScreen mainScreen];
+    CGSize screenSize = ARCGSizeScale(screen.bounds.size, screen.scale * DRAFT_RESOLUTION_PROPORTION);
+    CGSize allocSize = CGSizeMake(MAX(size.width, ceil(screenSize.width)), MAX(size.height, ceil(screenSize.height)));
+    ARDKBitmap *bm = [ARDKBitmap bitmapAtSize:allocSize ofType:ARDKBitmapType_RGBA8888];
+    [bm adjustToSize:size];
+    return bm;
+}
+
+- (void)returnDraftBitmap:(ARDKBitmap *)bm
+{
+    @synchronized (self.draftBmPool)
+    {
+        // Drafts are rendered on the mupdf queue, so one at a time
+        if (bm && self.draftBmPool.count == 0)
+            [self.draftBmPool addObject:bm];
+    }
+}
+
 - (id<ARDKDoc>)docForPath:(NSString *)path ofType:(ARDKDocType)docType
 {
     return [[MuPDFDKDoc alloc] initForPath:path ofType:docType lib:self];
 }
 
+- (MuPDFDKDoc *)docForSource:(id<MuPDFDKProgressiveSource>)source atPath:(NSString *)path ofType:(ARDKDocType)docType
+{
+    return [[MuPDFDKDoc alloc] initForSource:source atPath:path ofType:docType lib:self];
+}
+
 @end
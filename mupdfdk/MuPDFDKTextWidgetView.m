@@ -80,6 +80,10 @@ static BOOL breakchar(UniChar c)
     CGFloat _scale;
     BOOL _finalized;
     NSString *_initialText;
+    // Set while an asynchronous update of the widget's text and layout is
+    // outstanding, and _layoutStale set if the text has changed since it began
+    BOOL _layoutPending;
+    BOOL _layoutStale;
 }
 
 @synthesize markedTextStyle=_markedTextStyle, markedTextRange=_markedTextRange,
@@ -204,6 +208,8 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     {
         assert(_finalized);
         _finalized = NO;
+        _layoutPending = NO;
+        _layoutStale = NO;
         self.frame = ARCGRectScale(widget.rect, _scale);
         _widget = textWidget;
         [_inputDelegate textWillChange:self];
@@ -276,13 +282,20 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
 {
     NSMutableArray<NSValue *> *rects = [NSMutableArray array];
 
+    // While a new layout is pending, the text may extend beyond the
+    // current one. Clip to the characters it covers
+    if (nsRange.location != NSNotFound && NSMaxRange(nsRange) > _layoutIndex.count)
+    {
+        NSInteger start = MIN(nsRange.location, _layoutIndex.count);
+        nsRange = NSMakeRange(start, _layoutIndex.count - start);
+    }
+
     if (nsRange.location != NSNotFound && nsRange.length > 0)
     {
-        assert(NSMaxRange(nsRange) <= _layoutIndex.count);
         MuPDFDKLayoutIndex *first = _layoutIndex[nsRange.location];
         MuPDFDKLayoutIndex *last = _layoutIndex[NSMaxRange(nsRange) - 1];
 
-        if (last.charIndex == _layout[last.lineIndex].charRects.count)
+        if (last.charIndex == _layout[last.lineIndex].charCount)
         {
             // Selection includes the new line char at the end of this line, so
             // Include the following line, but set the char index to -1
@@ -300,9 +313,9 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
             {
                 // First line: start to the left of the first character included, or the right of
                 // the whole line if no characters included
-                start = first.charIndex == _layout[first.lineIndex].charRects.count
+                start = first.charIndex == _layout[first.lineIndex].charCount
                         ? CGRectGetMaxX(rect)
-                        : CGRectGetMinX(_layout[first.lineIndex].charRects[first.charIndex].CGRectValue);
+                        : CGRectGetMinX([_layout[first.lineIndex] charRectAt:first.charIndex]);
             }
             else
             {
@@ -317,7 +330,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
                 // the whole line if no characters included
                 end = last.charIndex == -1
                         ? CGRectGetMinX(rect)
-                        : CGRectGetMaxX(_layout[last.lineIndex].charRects[last.charIndex].CGRectValue);
+                        : CGRectGetMaxX([_layout[last.lineIndex] charRectAt:last.charIndex]);
             }
             else
             {
@@ -340,6 +353,10 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     CGRect rect;
     BOOL before;
 
+    // Positions beyond the text covered by the current layout, as when a new
+    // layout is pending, are placed at its end
+    location = MIN(location, (NSInteger)_layoutIndex.count);
+
     if (location == 0)
     {
         rect = _layout[0].lineRect;
@@ -348,14 +365,14 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     else
     {
         MuPDFDKLayoutIndex *index = _layoutIndex[location - 1];
-        if (index.charIndex == _layout[index.lineIndex].charRects.count)
+        if (index.charIndex == _layout[index.lineIndex].charCount)
         {
             rect = _layout[index.lineIndex + 1].lineRect;
             before = YES;
         }
         else
         {
-            rect = _layout[index.lineIndex].charRects[index.charIndex].CGRectValue;
+            rect = [_layout[index.lineIndex] charRectAt:index.charIndex];
             before = NO;
         }
     }
@@ -378,7 +395,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     if (range.length > 0)
     {
         NSArray<NSValue *> *rects = [self selRectsForRange:range];
-        assert(rects.count > 0);
+        assert(rects.count > 0 || _layoutPending);
         CGRect rect = rects.count > 0 ? rects.firstObject.CGRectValue : CGRectZero;
         return CGPointMake(CGRectGetMinX(_widget.rect) + CGRectGetMinX(rect),
                            CGRectGetMinY(_widget.rect) + CGRectGetMinY(rect));
@@ -395,7 +412,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     if (range.length > 0)
     {
         NSArray<NSValue *> *rects = [self selRectsForRange:range];
-        assert(rects.count > 0);
+        assert(rects.count > 0 || _layoutPending);
         CGRect rect = rects.count > 0 ? rects.lastObject.CGRectValue : CGRectZero;
         return CGPointMake(CGRectGetMinX(_widget.rect) + CGRectGetMaxX(rect),
                            CGRectGetMinY(_widget.rect) + CGRectGetMaxY(rect));
@@ -511,7 +528,12 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
 
 - (void)updateLayout
 {
-    _layout = _widget.getTextLayout();
+    [self useLayout:_widget.getTextLayout()];
+}
+
+- (void)useLayout:(NSArray<MuPDFDKTextLayoutLine *> *)layout
+{
+    _layout = layout;
 
     // Create an index, locating where each character appears in the layout
     NSMutableArray<MuPDFDKLayoutIndex *> *layoutIndex = [NSMutableArray array];
@@ -522,13 +544,13 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
 
     for (NSInteger textIndex = 0; textIndex < _text.length; textIndex++)
     {
-        assert(lineIndex < _layout.count && charIndex <= _layout[lineIndex].charRects.count);
+        assert(lineIndex < _layout.count && charIndex <= _layout[lineIndex].charCount);
 
         unichar c = [_text characterAtIndex:textIndex];
         if (c == L'\n')
         {
             // We should have used up all the characters in the current line
-            assert(charIndex == _layout[lineIndex].charRects.count);
+            assert(charIndex == _layout[lineIndex].charCount);
 
             [layoutIndex addObject:[MuPDFDKLayoutIndex indexWithLineIndex:lineIndex andCharIndex: charIndex]];
             lineIndex++;
@@ -536,7 +558,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
         }
         else
         {
-            if (charIndex == _layout[lineIndex].charRects.count)
+            if (charIndex == _layout[lineIndex].charCount)
             {
                 lineIndex++;
                 charIndex = 0;
@@ -548,26 +570,87 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     }
 
     // We should be on the last line and have used up all the characters within it
-    assert(lineIndex == _layout.count - 1 && charIndex == _layout[lineIndex].charRects.count);
+    assert(lineIndex == _layout.count - 1 && charIndex == _layout[lineIndex].charCount);
     _layoutIndex = layoutIndex;
 }
 
+// Pass the text to the widget, and lay it out, asynchronously. Until the layout
+// arrives, the previous one continues to be used. Requests made while one is
+// outstanding are combined into a single follow-up request.
+- (void)updateTextAndLayout
+{
+    if (_layoutPending)
+    {
+        _layoutStale = YES;
+        return;
+    }
+
+    _layoutPending = YES;
+    _layoutStale = NO;
+    MuPDFDKWidgetText *widget = _widget;
+    NSString *text = [_text copy];
+    __weak MuPDFDKTextWidgetView *weakSelf = self;
+    _widget.updateTextAndLayout(text, ^(NSArray<MuPDFDKTextLayoutLine *> *layout) {
+        [weakSelf didLayoutText:text ofWidget:widget layout:layout];
+    });
+}
+
+- (void)didLayoutText:(NSString *)text ofWidget:(MuPDFDKWidgetText *)widget layout:(NSArray<MuPDFDKTextLayoutLine *> *)layout
+{
+    // Ignore layouts for a field no longer being edited
+    if (widget != _widget)
+        return;
+
+    _layoutPending = NO;
+    if (_finalized)
+        return;
+
+    if (_layoutStale || ![text isEqualToString:_text])
+    {
+        [self updateTextAndLayout];
+        return;
+    }
+
+    [self useLayout:layout];
+
+    // Check that no characters stray outside the form field
+    NSInteger maxChars = [self numCharsWithinFieldArea];
+    if (_widget.maxChars > 0 && _widget.maxChars < maxChars)
+        maxChars = _widget.maxChars;
+
+    if (_text.length > maxChars)
+    {
+        [_inputDelegate textWillChange:self];
+        [_inputDelegate selectionWillChange:self];
+        [self limitTextLength:maxChars];
+        [self limitSelectionPosition];
+        [_inputDelegate textDidChange:self];
+        [_inputDelegate selectionDidChange:self];
+        [self updateTextAndLayout];
+    }
+
+    [self showRect];
+    [self setNeedsDisplay];
+    _selectionChangedBlock();
+}
+
 - (NSInteger)numCharsWithinFieldArea
 {
+    assert(_layoutIndex.count == _text.length);
     CGRect wrect = CGRectMake(0, 0, _widget.rect.size.width, _widget.rect.size.height);
     for (NSInteger i = 0; i < _text.length; i++)
     {
         CGRect charRect;
 
         MuPDFDKLayoutIndex *index = _layoutIndex[i];
-        if (index.charIndex == _layout[index.lineIndex].charRects.count)
+        if (index.charIndex == _layout[index.lineIndex].charCount)
         {
             charRect = _layout[index.lineIndex + 1].lineRect;
             charRect.size.width = 0;
         }
         else
         {
-            charRect = _layout[index.lineIndex].charRects[index.charIndex].CGRectValue;
+            charRect = [_layout[index.lineIndex] charRectAt:index.charIndex];
         }
 
         if (CGRectGetMidX(charRect) > CGRectGetMaxX(wrect) || CGRectGetMidY(charRect) > CGRectGetMaxY(wrect))
@@ -615,39 +698,12 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
     [_text replaceCharactersInRange:nsRange withString:text];
     _selectedTextRange = [ARDKTextRange range:NSMakeRange(nsRange.location + text.length, 0)];
     _markedTextRange = nil;
-    _widget.setText(_text, NO);
-    [self updateLayout];
-
-    // Check that no characters stray outside the form field
-    NSInteger maxChars = [self numCharsWithinFieldArea];
-    if (_widget.maxChars > 0 && _widget.maxChars < maxChars)
-        maxChars = _widget.maxChars;
-
-    if (_text.length <= maxChars)
-    {
-        [self showRect];
-        [self setNeedsDisplay];
-        _selectionChangedBlock();
-    }
-    else
-    {
-        dispatch_async(dispatch_get_main_queue(), ^{
-            if (self.text.length > maxChars)
-            {
-                [self.inputDelegate textWillChange:self];
-                [self.inputDelegate selectionWillChange:self];
-                [self limitTextLength:maxChars];
-                [self limitSelectionPosition];
-                self.widget.setText(self.text, NO);
-                [self updateLayout];
-                [self.inputDelegate textDidChange:self];
-                [self.inputDelegate selectionDidChange:self];
-                [self showRect];
-                [self setNeedsDisplay];
-                self.selectionChangedBlock();
-            }
-        });
-    }
+    // The check that no characters stray outside the form field
+    // is made once the new layout arrives
+    [self updateTextAndLayout];
+    [self showRect];
+    [self setNeedsDisplay];
+    _selectionChangedBlock();
 }
 
 - (void)setMarkedText:(NSString *)markedText selectedRange:(NSRange)selectedRange
@@ -668,16 +724,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
             [self limitTextLength:_widget.maxChars];
             [self limitSelectionPosition];
         }
-        _widget.setText(_text, NO);
-        [self updateLayout];
-        NSInteger maxChars = [self numCharsWithinFieldArea];
-        if (maxChars < _text.length)
-        {
-            [self limitTextLength:maxChars];
-            [self limitSelectionPosition];
-            _widget.setText(_text, NO);
-            [self updateLayout];
-        }
+        [self updateTextAndLayout];
         [self showRect];
         [_inputDelegate textDidChange:self];
         [_inputDelegate selectionDidChange:self];
@@ -802,7 +849,7 @@ inputDelegate=_inputDelegate, tokenizer=_tokenizer;
 {
     NSInteger index = ((ARDKTextPosition *)position).index;
 
-    if (index > _layoutIndex.count)
+    if (index > _text.length)
     {
         NSLog(@"caretRectForPosition: position out of range");
         return CGRectNull;
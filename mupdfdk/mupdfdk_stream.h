@@ -6,8 +6,32 @@
 #include "mupdf/fitz.h"
 #import "MuPDFDKLib.h"
 
+/// Set the size of the blocks in which secure streams read, the number of bytes
+/// of recently read blocks to cache per file handle, the size of the buffer in
+/// which secure outputs gather writes, and whether streams read the following
+/// block in the background, from the settings' secureFs properties. Must be
+/// called before opening any stream. Applies to streams and outputs opened
+/// subsequently.
+void secure_stream_configure(ARDKSettings *settings);
+
 fz_stream *secure_stream(fz_context *ctx, id<ARDKSecureFS_Handle> handle);
 
 fz_output *secure_output(fz_context *ctx, id<ARDKSecureFS_Handle> handle);
 
+/// Create an output that writes into a buffer as though appending to a file of
+/// length base, so that tell reports positions within that file. Used to write
+/// incremental updates into memory for later appending to the file.
+fz_output *buffer_output(fz_context *ctx, fz_buffer *buf, int64_t base);
+
+/// Open a stream on a file that is arriving progressively. Reads beyond the
+/// data available so far throw FZ_ERROR_TRYLATER.
+fz_stream *progressive_stream(fz_context *ctx, id<MuPDFDKProgressiveSource> source);
+
+/// Open a stream reading directly from a memory mapping of a file. Returns
+/// NULL if the file cannot be mapped, in which case the caller should fall
+/// back to fz_open_file. The file's existing contents must not be modified
+/// while the stream is open, but it may be appended to, or replaced, since
+/// the mapping keeps the original contents alive.
+fz_stream *mapped_stream(fz_context *ctx, const char *path);
+
 #endif /* mupdfdk_stream_h */
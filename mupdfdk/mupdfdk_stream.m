@@ -1,21 +1,150 @@
 // Copyright © 2017 Artifex Software Inc. All rights reserved.
 
+#import <objc/runtime.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "mupdfdk_stream.h"
 
-#define BUF_SIZE (4096)
+// The cache always holds at least this many blocks, so that a block
+// read ahead survives until used
+#define MIN_CACHE_BLOCKS (2)
+
+// Set by secure_stream_configure, from the library's settings
+static size_t block_size;
+static size_t cache_size;
+static size_t write_buffer_size;
+static BOOL read_ahead = NO;
+
+static char cacheKey;
+
+/// Cache of the most recently used blocks read from a handle, shared by all
+/// streams on the handle. Accessed from the read-ahead queues as well as the
+/// library's, and so synchronized.
+@interface MuPDFDKBlockCache : NSObject
++ (MuPDFDKBlockCache *)cacheForHandle:(id<ARDKSecureFS_Handle>)handle;
+- (NSData *)blockAt:(int64_t)offset;
+- (void)addBlock:(NSData *)block at:(int64_t)offset;
+- (void)invalidateFrom:(int64_t)offset length:(size_t)length;
+@end
+
+@implementation MuPDFDKBlockCache
+{
+    NSMutableDictionary<NSNumber *, NSData *> *_blocks;
+    NSMutableOrderedSet<NSNumber *> *_lru;
+    size_t _bytes;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self)
+    {
+        _blocks = [NSMutableDictionary dictionary];
+        _lru = [NSMutableOrderedSet orderedSet];
+    }
+    return self;
+}
+
++ (MuPDFDKBlockCache *)cacheForHandle:(id<ARDKSecureFS_Handle>)handle
+{
+    @synchronized (handle)
+    {
+        // The cache is attached to the handle so that it has the same lifetime
+        MuPDFDKBlockCache *cache = objc_getAssociatedObject(handle, &cacheKey);
+        if (cache == nil)
+        {
+            cache = [[MuPDFDKBlockCache alloc] init];
+            objc_setAssociatedObject(handle, &cacheKey, cache, OBJC_ASSOCIATION_RETAIN);
+        }
+
+        return cache;
+    }
+}
+
+- (NSData *)blockAt:(int64_t)offset
+{
+    @synchronized (self)
+    {
+        NSData *block = _blocks[@(offset)];
+        if (block)
+        {
+            [_lru removeObject:@(offset)];
+            [_lru addObject:@(offset)];
+        }
+
+        return block;
+    }
+}
+
+- (void)addBlock:(NSData *)block at:(int64_t)offset
+{
+    @synchronized (self)
+    {
+        NSData *old = _blocks[@(offset)];
+        _bytes -= old.length;
+        [_lru removeObject:@(offset)];
+
+        _blocks[@(offset)] = block;
+        [_lru addObject:@(offset)];
+        _bytes += block.length;
+
+        while (_bytes > MAX(cache_size, MIN_CACHE_BLOCKS * block_size) && _lru.count > 1)
+        {
+            NSNumber *key = _lru.firstObject;
+            _bytes -= _blocks[key].length;
+            [_blocks removeObjectForKey:key];
+            [_lru removeObjectAtIndex:0];
+        }
+    }
+}
+
+- (void)invalidateFrom:(int64_t)offset length:(size_t)length
+{
+    @synchronized (self)
+    {
+        int64_t end = offset + (int64_t)length;
+        for (NSNumber *key in _lru.array)
+        {
+            // A block shorter than block_size ended at the end of the file
+            // when read, and so is stale if written beyond, as well as within
+            int64_t start = key.longLongValue;
+            NSData *block = _blocks[key];
+            if (start < end && start + (int64_t)MAX(block.length, block_size) > offset)
+            {
+                _bytes -= block.length;
+                [_blocks removeObjectForKey:key];
+                [_lru removeObject:key];
+            }
+        }
+    }
+}
+
+@end
 
 @interface MuPDFDKStreamState : NSObject
 @property(readonly) id<ARDKSecureFS_Handle> handle;
+@property(readonly) MuPDFDKBlockCache *cache;
+/// Block currently in use by the stream. The stream's rp and wp pointers
+/// point directly into this data, so it must be retained while in use.
+@property NSData *block;
+@property int64_t blockOffset;
+/// Queue on which the handle is accessed, when reading ahead
+@property dispatch_queue_t queue;
+/// For outputs, the file position of the next write. Kept locally so
+/// as to avoid querying the handle.
+@property int64_t offset;
+/// For outputs, set when the handle may have been moved by reading
+/// back, so that the next write must first seek to the offset
+@property BOOL handleMoved;
+/// For streams reading back an output, the output's state
+@property(weak) MuPDFDKStreamState *writer;
 + (MuPDFDKStreamState *)stateForHandle:(id<ARDKSecureFS_Handle>)handle;
 
 @end
 
 @implementation MuPDFDKStreamState
-{
-    @public
-
-    unsigned char _buffer[BUF_SIZE];
-}
 
 - (instancetype)initWithHandle:(id<ARDKSecureFS_Handle>)handle
 {
@@ -23,6 +152,8 @@
     if (self)
     {
         _handle = handle;
+        _cache = [MuPDFDKBlockCache cacheForHandle:handle];
+        _blockOffset = -1;
     }
     return self;
 }
@@ -32,21 +163,91 @@
     return [[MuPDFDKStreamState alloc] initWithHandle:handle];
 }
 
+- (NSData *)readBlockAt:(int64_t)offset
+{
+    NSData *data = [self.cache blockAt:offset];
+    if (data == nil)
+    {
+        self.writer.handleMoved = YES;
+        [self.handle ARDKSecureFS_seekToFileOffset:offset];
+        data = [self.handle ARDKSecureFS_readDataOfLength:block_size];
+        if (data.length > 0)
+            [self.cache addBlock:data at:offset];
+    }
+
+    return data;
+}
+
+/// Return the block at an aligned offset, from the cache if available
+- (NSData *)blockAt:(int64_t)offset
+{
+    NSData *data = [self.cache blockAt:offset];
+    if (data)
+        return data;
+
+    if (self.queue == nil)
+        return [self readBlockAt:offset];
+
+    // A read ahead of this block may be in progress, in which case
+    // readBlockAt: will find it in the cache once it completes
+    __block NSData *qdata;
+    dispatch_sync(self.queue, ^{
+        qdata = [self readBlockAt:offset];
+    });
+
+    // Having read a full block, start reading the one following
+    if (qdata.length == block_size)
+    {
+        int64_t next = offset + block_size;
+        dispatch_async(self.queue, ^{
+            [self readBlockAt:next];
+        });
+    }
+
+    return qdata;
+}
+
 @end
 
+void secure_stream_configure(ARDKSettings *settings)
+{
+    // Zero sizes are unusable, so fall back to the defaults for those
+    ARDKSettings *defaults = [[ARDKSettings alloc] init];
+    block_size = settings.secureFsReadBlockSize > 0 ? settings.secureFsReadBlockSize : defaults.secureFsReadBlockSize;
+    cache_size = settings.secureFsBlockCacheSize;
+    write_buffer_size = settings.secureFsWriteBufferSize > 0 ? settings.secureFsWriteBufferSize : defaults.secureFsWriteBufferSize;
+    read_ahead = settings.secureFsReadAhead;
+}
+
+/// Point the stream at the part of the current block from a position onwards
+static int use_block(fz_stream *stm, MuPDFDKStreamState *state, int64_t pos)
+{
+    NSData *block = state.block;
+    if (block == nil || pos < state.blockOffset || pos >= state.blockOffset + (int64_t)block.length)
+        return 0;
+
+    stm->rp = (unsigned char *)block.bytes + (pos - state.blockOffset);
+    stm->wp = (unsigned char *)block.bytes + block.length;
+    stm->pos = state.blockOffset + block.length;
+    return 1;
+}
+
 static int mupdfdk_next(fz_context *ctx, fz_stream *stm, size_t max)
 {
     MuPDFDKStreamState *state = (__bridge MuPDFDKStreamState *)stm->state;
-    NSData *data = [state.handle ARDKSecureFS_readDataOfLength:BUF_SIZE];
-    if (data.length == 0)
-        return -1;
+    // stm->pos is the file position corresponding to wp, and so, with the buffer
+    // exhausted, it is the position of the next byte to read. Read the aligned
+    // block containing it, and point the stream straight at the block's bytes.
+    int64_t pos = stm->pos;
+    int64_t offset = pos - pos % (int64_t)block_size;
+    state.block = [state blockAt:offset];
+    state.blockOffset = offset;
 
-    unsigned char *buf = (unsigned char *)data.bytes;
-    NSInteger len = data.length;
-    memcpy(state->_buffer, buf, len);
-    stm->rp = state->_buffer;
-    stm->wp = stm->rp + len;
-    stm->pos += len;
+    if (!use_block(stm, state, pos))
+    {
+        stm->rp = stm->wp = NULL;
+        return -1;
+    }
 
     return *stm->rp++;
 }
@@ -54,6 +255,8 @@ static int mupdfdk_next(fz_context *ctx, fz_stream *stm, size_t max)
 static void mupdfdk_drop(fz_context *ctx, void *state)
 {
     MuPDFDKStreamState *s = ((__bridge_transfer MuPDFDKStreamState *)state);
+    if (s.queue)
+        dispatch_sync(s.queue, ^{});
     [s.handle ARDKSecureFS_closeFile];
     // Since s was transfered in, returning from this function will release it
 }
@@ -72,36 +275,59 @@ static void mupdfdk_seek(fz_context *ctx, fz_stream *stm, int64_t offset, int wh
     switch (whence)
     {
         case SEEK_SET:
-            [state.handle ARDKSecureFS_seekToFileOffset:offset];
             pos = offset;
             break;
 
         case SEEK_CUR:
-        {
-            int64_t cur = [state.handle ARDKSecureFS_offsetInFile];
-            pos = cur + offset;
-            [state.handle ARDKSecureFS_seekToFileOffset:pos];
+            // stm->pos is the position of wp, not rp
+            pos = stm->pos - (stm->wp - stm->rp) + offset;
             break;
-        }
 
         case SEEK_END:
-            [state.handle ARDKSecureFS_seekToEndOfFile];
-            int64_t cur = [state.handle ARDKSecureFS_offsetInFile];
-            pos = cur + offset;
-            if (offset)
-                [state.handle ARDKSecureFS_seekToFileOffset:cur + offset];
+        {
+            __block int64_t end;
+            void (^findEnd)(void) = ^{
+                end = [state.handle ARDKSecureFS_seekToEndOfFile];
+            };
+            if (state.queue)
+                dispatch_sync(state.queue, findEnd);
+            else
+                findEnd();
+            pos = end + offset;
             break;
+        }
     }
 
-    stm->pos = pos;
-    stm->rp = stm->wp = state->_buffer;
+    // Seeks within the current block need no read
+    if (!use_block(stm, state, pos))
+    {
+        stm->pos = pos;
+        stm->rp = stm->wp = NULL;
+    }
 }
 
 static void mupdfdk_write(fz_context *ctx, void *opaque, const void *buffer, size_t count)
 {
     MuPDFDKStreamState *state = (__bridge MuPDFDKStreamState *)opaque;
 
-    [state.handle ARDKSecureFS_writeData:[NSData dataWithBytes:buffer length:count]];
+    if (state.handleMoved)
+    {
+        [state.handle ARDKSecureFS_seekToFileOffset:state.offset];
+        state.handleMoved = NO;
+    }
+
+    // Blocks cached for streams reading the same handle that overlap
+    // the write are now stale
+    [state.cache invalidateFrom:state.offset length:count];
+    // The fz_output gathers writes into its buffer, which remains valid for
+    // the duration of the call, so handles that accept transient data can
+    // be passed it without a copy
+    id<ARDKSecureFS_Handle> handle = state.handle;
+    if ([(NSObject *)handle respondsToSelector:@selector(ARDKSecureFS_writeTransientData:)])
+        [handle ARDKSecureFS_writeTransientData:[NSData dataWithBytesNoCopy:(void *)buffer length:count freeWhenDone:NO]];
+    else
+        [handle ARDKSecureFS_writeData:[NSData dataWithBytes:buffer length:count]];
+    state.offset += count;
 }
 
 static void mupdfdk_write_seek(fz_context *ctx, void *opaque, int64_t offset, int whence)
@@ -111,52 +337,285 @@ static void mupdfdk_write_seek(fz_context *ctx, void *opaque, int64_t offset, in
     switch (whence)
     {
         case SEEK_SET:
-            [state.handle ARDKSecureFS_seekToFileOffset:offset];
+            state.offset = offset;
             break;
 
         case SEEK_CUR:
-        {
-            int64_t cur = [state.handle ARDKSecureFS_offsetInFile];
-            [state.handle ARDKSecureFS_seekToFileOffset:cur + offset];
+            state.offset += offset;
             break;
-        }
 
         case SEEK_END:
-            [state.handle ARDKSecureFS_seekToEndOfFile];
-            int64_t cur = [state.handle ARDKSecureFS_offsetInFile];
-            if (offset)
-                [state.handle ARDKSecureFS_seekToFileOffset:cur + offset];
+            state.offset = [state.handle ARDKSecureFS_seekToEndOfFile] + offset;
             break;
     }
+
+    [state.handle ARDKSecureFS_seekToFileOffset:state.offset];
+    state.handleMoved = NO;
 }
 
 static int64_t mupdfdk_write_tell(fz_context *ctx, void *opaque)
 {
     MuPDFDKStreamState *state = (__bridge MuPDFDKStreamState *)opaque;
-    return [state.handle ARDKSecureFS_offsetInFile];
+    return state.offset;
 }
 
 static fz_stream *as_stream(fz_context *ctx, void *opaque)
 {
     MuPDFDKStreamState *state = (__bridge MuPDFDKStreamState *)opaque;
-    fz_stream *stm = secure_stream(ctx, state.handle);
-    stm->drop = mupdfdk_drop_no_close;
+    // The handle is shared with the output, so no reading ahead
+    MuPDFDKStreamState *readState = [MuPDFDKStreamState stateForHandle:state.handle];
+    readState.writer = state;
+    fz_stream *stm = fz_new_stream(ctx, (__bridge_retained void *)readState, mupdfdk_next, mupdfdk_drop_no_close);
+    stm->seek = mupdfdk_seek;
     return stm;
 }
 
 fz_stream *secure_stream(fz_context *ctx, id<ARDKSecureFS_Handle> handle)
 {
-    fz_stream *stm = fz_new_stream(ctx, (__bridge_retained void *)[MuPDFDKStreamState stateForHandle:handle], mupdfdk_next, mupdfdk_drop);
+    MuPDFDKStreamState *state = [MuPDFDKStreamState stateForHandle:handle];
+    if (read_ahead)
+        state.queue = dispatch_queue_create("com.artifex.mupdf.readahead", NULL);
+    fz_stream *stm = fz_new_stream(ctx, (__bridge_retained void *)state, mupdfdk_next, mupdfdk_drop);
     stm->seek = mupdfdk_seek;
     return stm;
 }
 
 fz_output *secure_output(fz_context *ctx, id<ARDKSecureFS_Handle> handle)
 {
-    fz_output *op = fz_new_output(ctx, 8192, (__bridge_retained void *)[MuPDFDKStreamState stateForHandle:handle], mupdfdk_write, NULL, mupdfdk_drop);
+    MuPDFDKStreamState *state = [MuPDFDKStreamState stateForHandle:handle];
+    state.offset = handle.ARDKSecureFS_offsetInFile;
+    fz_output *op = fz_new_output(ctx, write_buffer_size, (__bridge_retained void *)state, mupdfdk_write, NULL, mupdfdk_drop);
     op->seek = mupdfdk_write_seek;
     op->tell = mupdfdk_write_tell;
     op->as_stream = as_stream;
 
     return op;
 }
+
+typedef struct
+{
+    fz_buffer *buf;
+    int64_t base;
+    int64_t pos;
+} buffer_output_state;
+
+static void buffer_output_write(fz_context *ctx, void *opaque, const void *data, size_t count)
+{
+    buffer_output_state *state = opaque;
+    int64_t offset = state->pos - state->base;
+    if (offset < 0)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot write before the end of the original file");
+
+    size_t end = (size_t)offset + count;
+    if (end > state->buf->cap)
+        fz_resize_buffer(ctx, state->buf, MAX(end, state->buf->cap * 2));
+
+    memcpy(state->buf->data + offset, data, count);
+    state->buf->len = MAX(state->buf->len, end);
+    state->pos += count;
+}
+
+static void buffer_output_seek(fz_context *ctx, void *opaque, int64_t offset, int whence)
+{
+    buffer_output_state *state = opaque;
+
+    switch (whence)
+    {
+        case SEEK_SET:
+            state->pos = offset;
+            break;
+
+        case SEEK_CUR:
+            state->pos += offset;
+            break;
+
+        case SEEK_END:
+            state->pos = state->base + (int64_t)state->buf->len + offset;
+            break;
+    }
+}
+
+static int64_t buffer_output_tell(fz_context *ctx, void *opaque)
+{
+    buffer_output_state *state = opaque;
+    return state->pos;
+}
+
+static void buffer_output_drop(fz_context *ctx, void *opaque)
+{
+    buffer_output_state *state = opaque;
+    fz_drop_buffer(ctx, state->buf);
+    fz_free(ctx, state);
+}
+
+fz_output *buffer_output(fz_context *ctx, fz_buffer *buf, int64_t base)
+{
+    buffer_output_state *state = fz_malloc_struct(ctx, buffer_output_state);
+    state->buf = fz_keep_buffer(ctx, buf);
+    state->base = base;
+    state->pos = base + (int64_t)buf->len;
+
+    fz_output *op = NULL;
+    fz_try(ctx)
+    {
+        op = fz_new_output(ctx, 0, state, buffer_output_write, NULL, buffer_output_drop);
+    }
+    fz_catch(ctx)
+    {
+        buffer_output_drop(ctx, state);
+        fz_rethrow(ctx);
+    }
+
+    op->seek = buffer_output_seek;
+    op->tell = buffer_output_tell;
+    return op;
+}
+
+@interface MuPDFDKProgressiveState : NSObject
+@property id<MuPDFDKProgressiveSource> source;
+/// Block currently in use by the stream, into which rp and wp point
+@property NSData *block;
+@end
+
+@implementation MuPDFDKProgressiveState
+@end
+
+static int progressive_next(fz_context *ctx, fz_stream *stm, size_t max)
+{
+    MuPDFDKProgressiveState *state = (__bridge MuPDFDKProgressiveState *)stm->state;
+    int64_t pos = stm->pos;
+    if (pos >= state.source.length)
+        return EOF;
+
+    int64_t available = state.source.bytesAvailable;
+    if (pos >= available)
+        fz_throw(ctx, FZ_ERROR_TRYLATER, "awaiting data at offset %lld", (long long)pos);
+
+    state.block = [state.source readDataAtOffset:pos length:(NSUInteger)MIN((int64_t)block_size, available - pos)];
+    if (state.block.length == 0)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "cannot read data at offset %lld", (long long)pos);
+
+    stm->rp = (unsigned char *)state.block.bytes;
+    stm->wp = stm->rp + state.block.length;
+    stm->pos += state.block.length;
+    return *stm->rp++;
+}
+
+static void progressive_seek(fz_context *ctx, fz_stream *stm, int64_t offset, int whence)
+{
+    MuPDFDKProgressiveState *state = (__bridge MuPDFDKProgressiveState *)stm->state;
+
+    switch (whence)
+    {
+        case SEEK_CUR:
+            offset += stm->pos - (stm->wp - stm->rp);
+            break;
+
+        case SEEK_END:
+            // The length is known up front, which is what lets mupdf
+            // locate the linearization data
+            offset += state.source.length;
+            break;
+    }
+
+    stm->pos = offset;
+    stm->rp = stm->wp = NULL;
+}
+
+static void progressive_drop(fz_context *ctx, void *state)
+{
+    (void)((__bridge_transfer MuPDFDKProgressiveState *)state);
+    // Since state was transfered in, returning from this function will release it
+}
+
+fz_stream *progressive_stream(fz_context *ctx, id<MuPDFDKProgressiveSource> source)
+{
+    MuPDFDKProgressiveState *state = [[MuPDFDKProgressiveState alloc] init];
+    state.source = source;
+    fz_stream *stm = fz_new_stream(ctx, (__bridge_retained void *)state, progressive_next, progressive_drop);
+    stm->seek = progressive_seek;
+    stm->progressive = 1;
+    return stm;
+}
+
+typedef struct
+{
+    void *base;
+    size_t length;
+} mapping;
+
+static int mapped_next(fz_context *ctx, fz_stream *stm, size_t max)
+{
+    // The whole file is available from the outset, so once
+    // the buffer is exhausted there is nothing more
+    return EOF;
+}
+
+static void mapped_seek(fz_context *ctx, fz_stream *stm, int64_t offset, int whence)
+{
+    // stm->pos is always the length of the file, with wp at its end
+    int64_t pos = stm->pos - (stm->wp - stm->rp);
+
+    switch (whence)
+    {
+        case SEEK_CUR:
+            offset += pos;
+            break;
+
+        case SEEK_END:
+            offset += stm->pos;
+            break;
+    }
+
+    if (offset < 0)
+        offset = 0;
+    if (offset > stm->pos)
+        offset = stm->pos;
+
+    stm->rp += offset - pos;
+}
+
+static void mapped_drop(fz_context *ctx, void *state)
+{
+    mapping *map = state;
+    munmap(map->base, map->length);
+    fz_free(ctx, map);
+}
+
+fz_stream *mapped_stream(fz_context *ctx, const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    // The mapping remains valid after the file is closed
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    mapping *map = NULL;
+    fz_var(map);
+    fz_try(ctx)
+    {
+        map = fz_malloc_struct(ctx, mapping);
+        map->base = base;
+        map->length = (size_t)st.st_size;
+    }
+    fz_catch(ctx)
+    {
+        munmap(base, (size_t)st.st_size);
+        fz_rethrow(ctx);
+    }
+
+    fz_stream *stm = fz_new_stream(ctx, map, mapped_next, mapped_drop);
+    stm->rp = base;
+    stm->wp = (unsigned char *)base + map->length;
+    stm->pos = (int64_t)map->length;
+    stm->seek = mapped_seek;
+    return stm;
+}